@@ -32,14 +32,70 @@ std::vector<material> material_prop;
 std::unordered_map<std::string, uint16_t> texture_names;
 std::unordered_map<std::string, custom_block> custom_blocks;
 
+std::array<uint8_t, 65536> material_opacity;
+std::array<uint8_t, 65536> material_flags;
+std::array<uint8_t, 65536> material_light_emission;
+
+namespace
+{
+
+uint8_t material_flags_of(const material& m)
+{
+    uint8_t flags(0);
+    if (m.is_solid)
+        flags |= material_flag::solid;
+    if (m.is_transparent())
+        flags |= material_flag::transparent;
+    if (m.is_visually_solid())
+        flags |= material_flag::visually_solid;
+    if (m.is_custom_block())
+        flags |= material_flag::custom_model;
+    if (!m.bounding_box.empty())
+        flags |= material_flag::collision_boxes;
+
+    return flags;
+}
+
+void set_material_tables(uint16_t type_id, const material& m)
+{
+    material_opacity[type_id] = 255 - m.transparency;
+    material_flags[type_id] = material_flags_of(m);
+    material_light_emission[type_id] = m.light_emission;
+}
+
+bool tables_match(uint16_t type_id, const material& m)
+{
+    return material_opacity[type_id] == 255 - m.transparency
+           && material_flags[type_id] == material_flags_of(m)
+           && material_light_emission[type_id] == m.light_emission;
+}
+
+} // anonymous namespace
+
 material& register_new_material(uint16_t type_id)
 {
     if (type_id >= material_prop.size())
         material_prop.resize(65536); //(type_id + 1);
 
+    set_material_tables(type_id, material_prop[type_id]);
     return material_prop[type_id];
 }
 
+void register_new_material(uint16_t type_id, material definition)
+{
+    auto& m(register_new_material(type_id));
+    m = std::move(definition);
+    set_material_tables(type_id, m);
+}
+
+bool material_tables_match(uint16_t type_id)
+{
+    if (type_id < material_prop.size())
+        return tables_match(type_id, material_prop[type_id]);
+
+    return tables_match(type_id, material());
+}
+
 uint16_t find_material(const std::string& name)
 {
     auto found = find(material_prop, name);
@@ -68,6 +124,11 @@ struct setup_materials
         material_prop[0].name = "air";
         material_prop[0].is_solid = false;
         material_prop[0].transparency = 255;
+
+        const material unregistered;
+        for (uint32_t i(0); i < 65536; ++i)
+            set_material_tables(i, i < material_prop.size() ? material_prop[i]
+                                                            : unregistered);
     }
 };
 
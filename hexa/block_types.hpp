@@ -130,9 +130,44 @@ extern std::unordered_map<std::string, uint16_t> texture_names;
 
 //---------------------------------------------------------------------------
 
-/** Register a new material by ID and return its record. */
+/** Bits used in \ref material_flags. */
+namespace material_flag
+{
+
+constexpr uint8_t solid = 1;
+constexpr uint8_t transparent = 2;
+constexpr uint8_t visually_solid = 4;
+constexpr uint8_t custom_model = 8;
+constexpr uint8_t collision_boxes = 16;
+
+} // namespace material_flag
+
+/** Compact copies of the material properties that are used in tight
+ ** loops.
+ *  The material struct is big, and looking up a single property in it
+ *  usually costs a cache miss.  These tables are indexed by material ID,
+ *  and are filled in by register_new_material(). */
+extern std::array<uint8_t, 65536> material_opacity;
+/** \sa material_opacity */
+extern std::array<uint8_t, 65536> material_flags;
+/** \sa material_opacity */
+extern std::array<uint8_t, 65536> material_light_emission;
+
+//---------------------------------------------------------------------------
+
+/** Register a new material by ID and return its record.
+ *  The lookup tables are filled in from the record as it is now; later
+ *  changes to it are not picked up.  Use this to look up or name a
+ *  material, and the other overload to define one. */
 material& register_new_material(uint16_t type_id);
 
+/** Register a material definition, and update the lookup tables. */
+void register_new_material(uint16_t type_id, material definition);
+
+/** Check if the lookup tables match a material's record.
+ *  Only meant for assertions. */
+bool material_tables_match(uint16_t type_id);
+
 /** Search for a material ID by name.
  * @param name  The name of the material to look for
  * @throw std::runtime_error If the material was not registered. */
@@ -151,22 +186,47 @@ namespace type
 
 constexpr uint16_t air = 0;
 
-/** Check if a block type is transparent. */
+/** Check if a block type is visually solid. */
 inline bool is_visually_solid(uint16_t type)
 {
-    return material_prop[type].is_visually_solid();
+    return material_flags[type] & material_flag::visually_solid;
 }
 
 /** Check if a block type is transparent. */
 inline bool is_transparent(uint16_t type)
 {
-    return material_prop[type].is_transparent();
+    return material_flags[type] & material_flag::transparent;
 }
 
 /** Check if a block type is solid. */
 inline bool is_solid(uint16_t type)
 {
-    return material_prop[type].is_solid;
+    return material_flags[type] & material_flag::solid;
+}
+
+/** Check if a block type has a custom 3-D model. */
+inline bool is_custom_block(uint16_t type)
+{
+    return material_flags[type] & material_flag::custom_model;
+}
+
+/** Check if a block type collides like a plain cube. */
+inline bool is_plain_cube(uint16_t type)
+{
+    return !(material_flags[type]
+             & (material_flag::custom_model | material_flag::collision_boxes));
+}
+
+/** How much light a block type stops, from 0 (none) to 1 (all). */
+inline float opacity(uint16_t type)
+{
+    return material_opacity[type] * (1.0f / 255.0f);
+}
+
+/** How much light a block type emits. */
+inline uint8_t light_emission(uint16_t type)
+{
+    return material_light_emission[type];
 }
 
 } // namespace type
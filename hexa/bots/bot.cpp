@@ -0,0 +1,418 @@
+//---------------------------------------------------------------------------
+// bots/bot.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "bot.hpp"
+
+#include <cmath>
+#include <boost/math/constants/constants.hpp>
+#include <hexa/log.hpp>
+#include <hexa/protocol.hpp>
+
+using namespace boost::chrono;
+using namespace boost::math::float_constants;
+
+namespace hexa
+{
+
+namespace
+{
+
+/** How often the position is sent to the server. */
+const milliseconds motion_interval(100);
+/** How often the round trip time is measured. */
+const seconds ping_interval(1);
+/** How often the bot looks for terrain it doesn't have yet. */
+const milliseconds request_interval(250);
+/** How long to wait for a chunk before giving up on it. */
+const seconds terrain_timeout(10);
+/** The number of chunks that can be requested without having been
+ ** answered yet. */
+const size_t max_pending(512);
+/** The radius of the "circle" path, in blocks. */
+const float circle_radius(32.f);
+
+/** Stands in for the authentication server.
+ *  Every bot gets a fixed player ID, so running the same number of bots
+ *  again logs in the same players.  The server only accepts these IDs
+ *  when it is started with --offline-auth, and the bots run on the same
+ *  machine. */
+binary_data player_id(uint32_t bot)
+{
+    std::string name("hexahedra-bot:" + std::to_string(bot));
+    auto hash(crypto::sha256(crypto::buffer(name.begin(), name.end())));
+    hash.resize(8);
+    return hash;
+}
+
+} // anonymous namespace
+
+bot::bot(uint32_t id, const std::string& host, uint16_t port,
+         const bot_settings& conf)
+    : udp_client(host, port)
+    , id_(id)
+    , conf_(conf)
+    , rng_(conf.seed + id)
+    , done_(false)
+    , private_key_(crypto::make_new_key())
+    , entity_(0xffffffff)
+    , heading_(std::uniform_real_distribution<float>(0.f, two_pi)(rng_))
+    , distance_(0.f)
+    , place_next_(true)
+    , created_(clock::now())
+    , rescan_(true)
+{
+}
+
+bool bot::start()
+{
+    connected_ = clock::now();
+    if (!connect()) {
+        done_ = true;
+        return false;
+    }
+
+    msg::knock m;
+    m.protocol_id = 0x41584548;
+    m.maximum_version = msg::current_protocol_version;
+    m.minimum_version = msg::oldest_protocol_version;
+    send_msg(m);
+
+    return true;
+}
+
+void bot::update(clock::time_point now)
+{
+    try {
+        for (int i(0); i < 64 && !done_ && poll(0); ++i)
+            ;
+    } catch (std::exception& e) {
+        log_msg("bot %1%: %2%", id_, e.what());
+        ++stats_.errors;
+        done_ = true;
+    }
+
+    if (done_ || !is_playing())
+        return;
+
+    walk(now);
+
+    if (now >= next_ping_) {
+        msg::time_sync_request m;
+        m.request = elapsed(now);
+        send_msg(m);
+        next_ping_ = now + ping_interval;
+    }
+
+    if (now >= next_request_) {
+        request_terrain(now);
+        next_request_ = now + request_interval;
+    }
+
+    if (conf_.edit_interval.count() > 0 && now >= next_edit_) {
+        edit();
+        next_edit_ = now + conf_.edit_interval;
+    }
+}
+
+void bot::receive(packet p)
+{
+    stats_.bytes_received += p.size();
+    ++stats_.messages_received;
+
+    if (p.is_encrypted()) {
+        if (!cipher_.is_ready()) {
+            ++stats_.errors;
+            return;
+        }
+        p.decrypt(server_nonce_, cipher_);
+    }
+
+    auto archive(make_deserializer(p));
+    try {
+        switch (p.message_type()) {
+        case msg::handshake::msg_id:
+            handshake(archive);
+            break;
+        case msg::setup::msg_id:
+            setup(archive);
+            break;
+        case msg::kick::msg_id:
+            kick(archive);
+            break;
+        case msg::time_sync_response::msg_id:
+            time_sync_response(archive);
+            break;
+        case msg::heightmap_update::msg_id:
+            heightmap_update(archive);
+            break;
+        case msg::surface_update::msg_id:
+            surface_update(archive);
+            break;
+        case msg::surface_batch::msg_id:
+            surface_batch(archive);
+            break;
+        case msg::entity_snapshot::msg_id:
+            entity_snapshot(archive);
+            break;
+
+        default:
+            // Everything else only counts towards the throughput.
+            break;
+        }
+    } catch (std::exception& e) {
+        log_msg("bot %1%: cannot parse packet type %2%: %3%", id_,
+                (int)p.message_type(), e.what());
+        ++stats_.errors;
+    }
+}
+
+void bot::on_disconnect()
+{
+    done_ = true;
+}
+
+void bot::handshake(deserializer<packet>& p)
+{
+    auto m(read<msg::handshake>(p));
+    auto server_key(crypto::public_key_from_binary(m.public_key));
+    if (!crypto::is_valid(server_key)) {
+        log_msg("bot %1%: server's public key is not valid", id_);
+        done_ = true;
+        disconnect();
+        return;
+    }
+    server_nonce_ = m.nonce;
+
+    // Same as main_game::login(), in multiplayer mode.
+    msg::login login;
+    login.mode = 1;
+    login.name = "bot" + std::to_string(id_);
+    login.uid = player_id(id_);
+    login.public_key
+        = crypto::to_binary(crypto::get_public_key(private_key_));
+
+    auto shared_secret(crypto::ecdh(server_key, private_key_));
+    shared_secret.erase(shared_secret.begin() + 16, shared_secret.end());
+    cipher_.set_key(crypto::x_or(shared_secret, server_nonce_));
+    login.mac = crypto::sha256(crypto::concat(shared_secret, server_nonce_));
+    send_msg(login);
+}
+
+void bot::setup(deserializer<packet>& p)
+{
+    auto m(read<msg::setup>(p));
+    auto now(clock::now());
+
+    entity_ = m.entity_id;
+    position_ = wfpos(m.position, vector(0.5f, 0.5f, 0.0f));
+    origin_ = position_;
+    stats_.login.add(duration<double, boost::milli>(now - connected_).count());
+
+    last_step_ = next_turn_ = next_motion_ = next_ping_ = next_request_
+        = next_edit_ = now;
+}
+
+void bot::kick(deserializer<packet>& p)
+{
+    auto m(read<msg::kick>(p));
+    log_msg("bot %1% got kicked: %2%", id_, m.reason);
+    done_ = true;
+}
+
+void bot::time_sync_response(deserializer<packet>& p)
+{
+    auto m(read<msg::time_sync_response>(p));
+    stats_.ping.add(elapsed(clock::now()) - m.request);
+}
+
+void bot::heightmap_update(deserializer<packet>& p)
+{
+    auto m(read<msg::heightmap_update>(p));
+    for (auto& r : m.data)
+        heights_[r.pos] = r.height;
+
+    rescan_ = true;
+}
+
+void bot::surface_update(deserializer<packet>& p)
+{
+    auto m(read<msg::surface_update>(p));
+    got_surface(m.position);
+}
+
+void bot::surface_batch(deserializer<packet>& p)
+{
+    auto m(read<msg::surface_batch>(p));
+    for (auto& r : m.surfaces)
+        got_surface(r.position);
+}
+
+void bot::entity_snapshot(deserializer<packet>& p)
+{
+    // The bots don't track other entities, but the server keeps resending
+    // them until the snapshots are acknowledged.
+    auto m(read<msg::entity_snapshot>(p));
+    msg::snapshot_ack ack;
+    ack.sequence = m.sequence;
+    send_msg(ack);
+}
+
+void bot::got_surface(const chunk_coordinates& pos)
+{
+    ++stats_.surfaces_received;
+
+    auto found(pending_.find(pos));
+    if (found == pending_.end())
+        return;
+
+    stats_.terrain.add(
+        duration<double, boost::milli>(clock::now() - found->second).count());
+    pending_.erase(found);
+    rescan_ = true;
+}
+
+void bot::walk(clock::time_point now)
+{
+    float step(conf_.speed * duration<float>(now - last_step_).count());
+    last_step_ = now;
+    distance_ += step;
+
+    if (conf_.path == "circle") {
+        // A circle that starts at the spawn point, walked clockwise.
+        float angle(distance_ / circle_radius);
+        position_ = origin_ + vector(circle_radius * (1.f - std::cos(angle)),
+                                     circle_radius * std::sin(angle), 0.f);
+        position_.normalize();
+        heading_ = angle;
+    } else {
+        if (conf_.path != "line" && now >= next_turn_) {
+            heading_ = std::uniform_real_distribution<float>(0.f, two_pi)(rng_);
+            next_turn_ = now + milliseconds(std::uniform_int_distribution<int>(
+                                   2000, 6000)(rng_));
+        }
+        position_ += vector(std::sin(heading_), std::cos(heading_), 0.f) * step;
+        position_.normalize();
+    }
+
+    if (now < next_motion_)
+        return;
+
+    next_motion_ = now + motion_interval;
+
+    msg::look_at look(yaw_pitch(heading_, half_pi));
+    send_msg(look);
+
+    msg::motion m;
+    m.move_dir = 0;
+    m.move_speed = 0xff;
+    m.position = position_;
+    send_msg(m);
+}
+
+void bot::request_terrain(clock::time_point now)
+{
+    for (auto i(pending_.begin()); i != pending_.end();) {
+        if (now - i->second > terrain_timeout) {
+            // Forget about it, so the next scan asks for it again.
+            ++stats_.terrain_timeouts;
+            requested_.erase(i->first);
+            i = pending_.erase(i);
+            rescan_ = true;
+        } else {
+            ++i;
+        }
+    }
+
+    // Going over every chunk in range takes a while, so only do it when
+    // something changed.
+    chunk_coordinates center(position_.int_pos() / chunk_size);
+    if (!rescan_ && center == scanned_center_)
+        return;
+
+    rescan_ = false;
+    scanned_center_ = center;
+
+    const int vd(conf_.view_distance);
+    msg::request_heights heights;
+    msg::request_surfaces surfaces;
+
+    for (int y(-vd); y <= vd; ++y) {
+        for (int x(-vd); x <= vd; ++x) {
+            map_coordinates column(center.x + x, center.y + y);
+            auto found(heights_.find(column));
+            if (found == heights_.end()) {
+                // Like the real client, find out which chunks are empty
+                // before asking for them.
+                if (heights_requested_.insert(column).second)
+                    heights.requests.emplace_back(column);
+
+                continue;
+            }
+
+            for (int z(-vd); z <= vd; ++z) {
+                chunk_coordinates pos(column.x, column.y, center.z + z);
+                if (is_air_chunk(pos, found->second) || requested_.count(pos))
+                    continue;
+
+                if (pending_.size() >= max_pending) {
+                    // Try again once some of them have come in.
+                    rescan_ = true;
+                    break;
+                }
+                requested_.insert(pos);
+                pending_[pos] = now;
+                surfaces.requests.emplace_back(pos);
+            }
+        }
+    }
+
+    if (!heights.requests.empty())
+        send_msg(heights);
+
+    if (!surfaces.requests.empty()) {
+        stats_.terrain_requests += surfaces.requests.size();
+        send_msg(surfaces);
+    }
+}
+
+void bot::edit()
+{
+    // Look down at the ground a few blocks ahead.
+    yaw_pitch look(heading_, 0.75f * pi);
+    uint8_t button(place_next_ ? 1 : 2);
+    place_next_ = !place_next_;
+
+    msg::button_press press(button, 0, look, position_);
+    send_msg(press);
+
+    msg::button_release release;
+    release.button = button;
+    send_msg(release);
+
+    ++stats_.edits;
+}
+
+gameclock_t bot::elapsed(clock::time_point now) const
+{
+    return duration_cast<milliseconds>(now - created_).count();
+}
+
+} // namespace hexa
@@ -0,0 +1,185 @@
+//---------------------------------------------------------------------------
+/// \file   bots/bot.hpp
+/// \brief  A simulated player, for load testing a server.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <boost/chrono.hpp>
+#include <hexa/basic_types.hpp>
+#include <hexa/crypto.hpp>
+#include <hexa/serialize.hpp>
+#include <hexa/wfpos.hpp>
+#include <hexa/client/udp_client.hpp>
+
+#include "bot_stats.hpp"
+
+namespace hexa
+{
+
+/** How the bots behave. */
+struct bot_settings
+{
+    /** How the bots walk around: "random", "circle", or "line". */
+    std::string path;
+    /** Walking speed, in blocks per second. */
+    float speed;
+    /** Terrain is requested up to this many chunks away. */
+    unsigned int view_distance;
+    /** Time between two block edits, or zero to never edit anything. */
+    boost::chrono::milliseconds edit_interval;
+    /** Seed for the random paths. */
+    uint32_t seed;
+};
+
+/** A player without a screen.
+ *  A bot logs in like the normal client does, walks around, asks for the
+ *  terrain around it, and places and removes blocks now and then.  It
+ *  measures how long the server takes to answer along the way.
+ *
+ *  Every bot has its own ENet host.  A bot is not thread-safe, but
+ *  different bots can be updated from different threads. */
+class bot : public udp_client
+{
+public:
+    typedef boost::chrono::steady_clock clock;
+
+public:
+    /** Constructor.
+     * @param id    Number of this bot; its name and player ID are based
+     *              on this
+     * @param host  Server host name
+     * @param port  Server port number
+     * @param conf  How to behave */
+    bot(uint32_t id, const std::string& host, uint16_t port,
+        const bot_settings& conf);
+
+    /** Connect to the server, and start logging in.
+     * @return False if the server could not be reached */
+    bool start();
+
+    /** Handle incoming messages, and send whatever is due. */
+    void update(clock::time_point now);
+
+    /** True once the bot has been kicked or disconnected. */
+    bool is_done() const { return done_; }
+
+    /** True if the bot has logged in and is walking around. */
+    bool is_playing() const { return entity_ != 0xffffffff; }
+
+    uint32_t id() const { return id_; }
+
+    const bot_stats& stats() const { return stats_; }
+
+    void receive(packet p) override;
+
+    void on_disconnect() override;
+
+private:
+    template <typename message_t>
+    void send_msg(message_t& m)
+    {
+        auto data(serialize_packet(m));
+        stats_.bytes_sent += data.size();
+        ++stats_.messages_sent;
+        send(data, m.method());
+    }
+
+    template <typename message_t>
+    message_t read(deserializer<packet>& p)
+    {
+        message_t m;
+        m.serialize(p);
+        return m;
+    }
+
+    void handshake(deserializer<packet>& p);
+    void setup(deserializer<packet>& p);
+    void kick(deserializer<packet>& p);
+    void time_sync_response(deserializer<packet>& p);
+    void heightmap_update(deserializer<packet>& p);
+    void surface_update(deserializer<packet>& p);
+    void surface_batch(deserializer<packet>& p);
+    void entity_snapshot(deserializer<packet>& p);
+
+    /** A chunk surface came in. */
+    void got_surface(const chunk_coordinates& pos);
+
+    /** Take a step along the path, and tell the server about it. */
+    void walk(clock::time_point now);
+
+    /** Ask for the chunks around the bot that it doesn't have yet. */
+    void request_terrain(clock::time_point now);
+
+    /** Place or remove a block in front of the bot. */
+    void edit();
+
+    /** Milliseconds since the bot was created. */
+    gameclock_t elapsed(clock::time_point now) const;
+
+private:
+    uint32_t id_;
+    bot_settings conf_;
+    std::mt19937 rng_;
+    bool done_;
+
+    crypto::private_key private_key_;
+    crypto::aes cipher_;
+    crypto::buffer server_nonce_;
+
+    uint32_t entity_;
+    wfpos position_;
+    /** Where the bot was spawned; the paths are relative to this. */
+    wfpos origin_;
+    /** Walking direction, in radians clockwise from north. */
+    float heading_;
+    /** How far along the path the bot is, in blocks. */
+    float distance_;
+    /** Whether the next edit places or removes a block. */
+    bool place_next_;
+
+    clock::time_point created_;
+    clock::time_point connected_;
+    clock::time_point last_step_;
+    clock::time_point next_turn_;
+    clock::time_point next_motion_;
+    clock::time_point next_ping_;
+    clock::time_point next_request_;
+    clock::time_point next_edit_;
+
+    /** Coarse heights that came in, and the ones that were asked for. */
+    std::unordered_map<map_coordinates, chunk_height> heights_;
+    std::unordered_set<map_coordinates> heights_requested_;
+    /** Every chunk that was requested and didn't time out. */
+    std::unordered_set<chunk_coordinates> requested_;
+    /** Requests that haven't been answered yet. */
+    std::unordered_map<chunk_coordinates, clock::time_point> pending_;
+    /** Set when there might be new chunks to request. */
+    bool rescan_;
+    /** The chunk the bot was in the last time it looked for terrain. */
+    chunk_coordinates scanned_center_;
+
+    bot_stats stats_;
+};
+
+} // namespace hexa
@@ -0,0 +1,144 @@
+//---------------------------------------------------------------------------
+/// \file   bots/bot_stats.hpp
+/// \brief  Latency and throughput measurements of the load testing bots.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace hexa
+{
+
+/** A series of latency measurements, in milliseconds. */
+class latency_stats
+{
+public:
+    void add(double msec) { samples_.push_back(msec); }
+
+    void merge(const latency_stats& other)
+    {
+        samples_.insert(samples_.end(), other.samples_.begin(),
+                        other.samples_.end());
+    }
+
+    size_t count() const { return samples_.size(); }
+
+    bool empty() const { return samples_.empty(); }
+
+    double mean() const
+    {
+        if (samples_.empty())
+            return 0;
+
+        double sum(0);
+        for (auto s : samples_)
+            sum += s;
+
+        return sum / samples_.size();
+    }
+
+    double max() const
+    {
+        if (samples_.empty())
+            return 0;
+
+        return *std::max_element(samples_.begin(), samples_.end());
+    }
+
+    /** The value below which a given fraction of the samples lie.
+     * @param p  The fraction, between 0 and 1 */
+    double percentile(double p) const
+    {
+        if (samples_.empty())
+            return 0;
+
+        std::vector<double> sorted(samples_);
+        size_t i(std::min<size_t>(std::floor(p * sorted.size()),
+                                  sorted.size() - 1));
+        std::nth_element(sorted.begin(), sorted.begin() + i, sorted.end());
+        return sorted[i];
+    }
+
+private:
+    std::vector<double> samples_;
+};
+
+/** Everything a bot keeps track of. */
+struct bot_stats
+{
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint32_t messages_sent;
+    uint32_t messages_received;
+
+    /** Chunks that were asked for. */
+    uint32_t terrain_requests;
+    /** Chunk surfaces that came in, whether they were asked for or not. */
+    uint32_t surfaces_received;
+    /** Requests that didn't get an answer in time.  The server doesn't
+     ** send anything for chunks that turn out to be empty, so these are
+     ** not necessarily errors. */
+    uint32_t terrain_timeouts;
+    /** Blocks placed or removed. */
+    uint32_t edits;
+    /** Messages that could not be parsed. */
+    uint32_t errors;
+
+    /** Time from connecting to getting msg::setup. */
+    latency_stats login;
+    /** Round trips of msg::time_sync_request. */
+    latency_stats ping;
+    /** Time from requesting a chunk to receiving its surface. */
+    latency_stats terrain;
+
+    bot_stats()
+        : bytes_sent(0)
+        , bytes_received(0)
+        , messages_sent(0)
+        , messages_received(0)
+        , terrain_requests(0)
+        , surfaces_received(0)
+        , terrain_timeouts(0)
+        , edits(0)
+        , errors(0)
+    {
+    }
+
+    void merge(const bot_stats& other)
+    {
+        bytes_sent += other.bytes_sent;
+        bytes_received += other.bytes_received;
+        messages_sent += other.messages_sent;
+        messages_received += other.messages_received;
+        terrain_requests += other.terrain_requests;
+        surfaces_received += other.surfaces_received;
+        terrain_timeouts += other.terrain_timeouts;
+        edits += other.edits;
+        errors += other.errors;
+        login.merge(other.login);
+        ping.merge(other.ping);
+        terrain.merge(other.terrain);
+    }
+};
+
+} // namespace hexa
@@ -0,0 +1,316 @@
+//---------------------------------------------------------------------------
+// bots/main.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <signal.h>
+#include <vector>
+
+#include <boost/chrono.hpp>
+#include <boost/format.hpp>
+#include <boost/thread.hpp>
+#include <boost/program_options/option.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+#include <enet/enet.h>
+
+#include <hexa/compiler_fix.hpp>
+#include <hexa/config.hpp>
+#include <hexa/log.hpp>
+
+#include "bot.hpp"
+
+namespace po = boost::program_options;
+
+using namespace boost::chrono;
+using namespace hexa;
+
+using boost::format;
+
+namespace
+{
+
+std::atomic<bool> stop_requested(false);
+
+void handle_interrupt(int)
+{
+    stop_requested.store(true);
+}
+
+/** A thread, and the bots it takes care of. */
+struct worker
+{
+    boost::mutex lock;
+    std::vector<std::unique_ptr<bot>> bots;
+    boost::thread thread;
+};
+
+/** Start the bots of one thread one by one, and keep them going until
+ ** the test is over. */
+void run_worker(worker& w, std::vector<uint32_t> ids,
+                const po::variables_map& vm, const bot_settings& conf,
+                bot::clock::time_point begin, bot::clock::time_point end)
+{
+    const std::string host(vm["hostname"].as<std::string>());
+    const uint16_t port(vm["port"].as<uint16_t>());
+    const milliseconds spawn_interval(vm["spawn-interval"].as<unsigned int>());
+
+    size_t spawned(0);
+    while (!stop_requested && bot::clock::now() < end) {
+        auto now(bot::clock::now());
+        if (spawned < ids.size()
+            && now >= begin + spawn_interval * ids[spawned]) {
+            auto b(std::make_unique<bot>(ids[spawned], host, port, conf));
+            if (!b->start())
+                log_msg("bot %1% could not connect", ids[spawned]);
+
+            ++spawned;
+            boost::lock_guard<boost::mutex> lock(w.lock);
+            w.bots.emplace_back(std::move(b));
+        }
+
+        {
+            boost::lock_guard<boost::mutex> lock(w.lock);
+            for (auto& b : w.bots)
+                b->update(now);
+        }
+        boost::this_thread::sleep_for(milliseconds(1));
+    }
+}
+
+/** Add up the statistics of every bot. */
+bot_stats total(std::vector<std::unique_ptr<worker>>& workers,
+                size_t& playing, size_t& done)
+{
+    bot_stats result;
+    playing = done = 0;
+    for (auto& w : workers) {
+        boost::lock_guard<boost::mutex> lock(w->lock);
+        for (auto& b : w->bots) {
+            result.merge(b->stats());
+            if (b->is_done())
+                ++done;
+            else if (b->is_playing())
+                ++playing;
+        }
+    }
+    return result;
+}
+
+std::string latency(const latency_stats& s)
+{
+    return (format("%1$.1f/%2$.1f/%3$.1f") % s.percentile(0.5)
+            % s.percentile(0.95) % s.max()).str();
+}
+
+void print_header()
+{
+    std::cout << format("%1$8s %2$7s %3$6s %4$10s %5$10s %6$9s %7$9s "
+                        "%8$-20s %9$-20s") % "time" % "playing" % "gone"
+                     % "in kB/s" % "out kB/s" % "surfaces" % "timeouts"
+                     % "ping p50/p95/max" % "terrain p50/p95/max"
+              << std::endl;
+}
+
+void print_line(const std::string& label, size_t playing, size_t done,
+                const bot_stats& s, const bot_stats& prev, double seconds)
+{
+    std::cout << format("%1$8s %2$7d %3$6d %4$10.1f %5$10.1f %6$9d %7$9d "
+                        "%8$-20s %9$-20s") % label % playing % done
+                     % ((s.bytes_received - prev.bytes_received) / 1024.
+                        / seconds)
+                     % ((s.bytes_sent - prev.bytes_sent) / 1024. / seconds)
+                     % s.surfaces_received % s.terrain_timeouts
+                     % latency(s.ping) % latency(s.terrain) << std::endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    po::variables_map vm;
+    po::options_description generic("Command line options");
+    generic.add_options()("version,v", "print version string")(
+        "help", "show help message");
+
+    po::options_description config("Configuration");
+    config.add_options()(
+        "hostname", po::value<std::string>()->default_value(""),
+        "server name, localhost if empty")(
+        "port", po::value<uint16_t>()->default_value(15556),
+        "server port number")("bots",
+                              po::value<unsigned int>()->default_value(10),
+                              "number of simulated players")(
+        "threads", po::value<unsigned int>()->default_value(1),
+        "number of threads running the bots")(
+        "duration", po::value<unsigned int>()->default_value(60),
+        "how long to run the test, in seconds")(
+        "spawn-interval", po::value<unsigned int>()->default_value(200),
+        "milliseconds between two bots logging in")(
+        "path", po::value<std::string>()->default_value("random"),
+        "how the bots walk around: random, circle, or line")(
+        "speed", po::value<float>()->default_value(5.0f),
+        "walking speed, in blocks per second")(
+        "viewdist", po::value<unsigned int>()->default_value(6),
+        "request terrain up to this many chunks away")(
+        "edit-interval", po::value<unsigned int>()->default_value(2000),
+        "milliseconds between two block edits, 0 to turn them off")(
+        "seed", po::value<uint32_t>()->default_value(1),
+        "seed for the random paths")(
+        "report", po::value<unsigned int>()->default_value(5),
+        "seconds between two progress reports")(
+        "per-bot", "print the results of every bot at the end")(
+        "log", po::value<std::string>(), "write debug info to this file");
+
+    po::options_description cmdline;
+    cmdline.add(generic).add(config);
+
+    try {
+        po::store(po::parse_command_line(argc, argv, cmdline), vm);
+        po::notify(vm);
+    } catch (std::exception& e) {
+        std::cerr << "Could not parse options: " << e.what() << std::endl;
+        std::cerr << cmdline << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (vm.count("help")) {
+        std::cout << "Load test a Hexahedra server with simulated players.\n"
+                     "The server has to run on the same machine, and be "
+                     "started with --offline-auth.\n"
+                  << cmdline << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if (vm.count("version")) {
+        std::cout << "hexahedra-bots " << GIT_VERSION << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    std::ofstream logfile;
+    if (vm.count("log")) {
+        logfile.open(vm["log"].as<std::string>());
+        if (logfile)
+            set_log_output(logfile);
+        else
+            std::cerr << "Warning: could not open logfile" << std::endl;
+    }
+
+    bot_settings conf;
+    conf.path = vm["path"].as<std::string>();
+    conf.speed = vm["speed"].as<float>();
+    conf.view_distance = vm["viewdist"].as<unsigned int>();
+    conf.edit_interval = milliseconds(vm["edit-interval"].as<unsigned int>());
+    conf.seed = vm["seed"].as<uint32_t>();
+
+    if (conf.path != "random" && conf.path != "circle"
+        && conf.path != "line") {
+        std::cerr << "Unknown path type '" << conf.path << "'" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (enet_initialize() != 0) {
+        std::cerr << "Could not initialize ENet, exiting" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_interrupt);
+
+    const unsigned int bot_count(vm["bots"].as<unsigned int>());
+    const unsigned int thread_count(
+        std::max(1u, std::min(vm["threads"].as<unsigned int>(), bot_count)));
+
+    auto begin(bot::clock::now());
+    auto end(begin + seconds(vm["duration"].as<unsigned int>()));
+
+    std::vector<std::unique_ptr<worker>> workers;
+    for (unsigned int t(0); t < thread_count; ++t) {
+        std::vector<uint32_t> ids;
+        for (uint32_t i(t); i < bot_count; i += thread_count)
+            ids.push_back(i);
+
+        workers.emplace_back(std::make_unique<worker>());
+        auto& w(*workers.back());
+        w.thread = boost::thread(
+            [&, ids] { run_worker(w, ids, vm, conf, begin, end); });
+    }
+
+    print_header();
+    const seconds report(std::max(1u, vm["report"].as<unsigned int>()));
+    bot_stats previous;
+    auto last_report(begin);
+    size_t playing, done;
+    while (!stop_requested && bot::clock::now() < end) {
+        boost::this_thread::sleep_for(milliseconds(100));
+        auto now(bot::clock::now());
+        if (now - last_report < report)
+            continue;
+
+        auto current(total(workers, playing, done));
+        print_line(std::to_string(duration_cast<seconds>(now - begin).count())
+                       + "s",
+                   playing, done, current, previous,
+                   duration<double>(now - last_report).count());
+        previous = current;
+        last_report = now;
+    }
+
+    for (auto& w : workers)
+        w->thread.join();
+
+    auto elapsed(duration<double>(bot::clock::now() - begin).count());
+    auto result(total(workers, playing, done));
+
+    if (vm.count("per-bot")) {
+        std::cout << std::endl;
+        print_header();
+        for (auto& w : workers) {
+            for (auto& b : w->bots) {
+                print_line("bot" + std::to_string(b->id()),
+                           b->is_playing() && !b->is_done(), b->is_done(),
+                           b->stats(), bot_stats(), elapsed);
+            }
+        }
+    }
+
+    std::cout << std::endl;
+    print_header();
+    print_line("total", playing, done, result, bot_stats(), elapsed);
+    std::cout << format("\n%1% messages sent, %2% received, %3% chunks "
+                        "requested, %4% edits, %5% errors\n"
+                        "login ms (p50/p95/max): %6%\n")
+                     % result.messages_sent % result.messages_received
+                     % result.terrain_requests % result.edits
+                     % result.errors % latency(result.login) << std::endl;
+
+    // Disconnecting waits for the server to answer, so let every thread
+    // take care of its own bots.
+    for (auto& w : workers)
+        w->thread = boost::thread([&w] { w->bots.clear(); });
+
+    for (auto& w : workers)
+        w->thread.join();
+
+    enet_deinitialize();
+    return EXIT_SUCCESS;
+}
@@ -38,6 +38,12 @@ type unpack_as(const compressed_data& data)
     return deserialize_as<type>(tmp);
 }
 
+template <>
+surface_data unpack_as<surface_data>(const compressed_data& data)
+{
+    return decode_surface(decompress(data));
+}
+
 } // anonymous namespace
 
 //---------------------------------------------------------------------------
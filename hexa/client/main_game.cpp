@@ -46,6 +46,7 @@
 #include <hexa/chunk.hpp>
 #include <hexa/config.hpp>
 #include <hexa/crypto.hpp>
+#include <hexa/entity_snapshot.hpp>
 #include <hexa/geometric.hpp>
 #include <hexa/json.hpp>
 #include <hexa/log.hpp>
@@ -102,6 +103,7 @@ main_game::main_game(game& the_game, const std::string& host, uint16_t port,
     , singleplayer_(host.empty() || host[0] == ':')
     , show_ui_(true)
     , ignore_text_(0)
+    , next_snapshot_(0)
 {
     if (singleplayer_) {
         try {
@@ -144,8 +146,8 @@ main_game::main_game(game& the_game, const std::string& host, uint16_t port,
 
     msg::knock msg;
     msg.protocol_id = 0x41584548;
-    msg.maximum_version = 1;
-    msg.minimum_version = 1;
+    msg.maximum_version = msg::current_protocol_version;
+    msg.minimum_version = msg::oldest_protocol_version;
     send(serialize_packet(msg), msg.method());
 }
 
@@ -404,8 +406,7 @@ void main_game::render()
             assert(coll_block != 0); // No need to check for air blocks.
 
             // If it's a normal block, we found an intersection.
-            auto& coll_material(material_prop[coll_block]);
-            if (!coll_material.is_custom_block()) {
+            if (!type::is_custom_block(coll_block)) {
                 renderer().highlight_face({offset + *i, offset + *(i - 1)},
                                           hl_color);
                 break;
@@ -413,6 +414,7 @@ void main_game::render()
 
             // It's a custom model; we'll need to do a detailed raycast
             // against every component.
+            auto& coll_material(material_prop[coll_block]);
             ray<float> pr((origin - vector(*i)) * 16.f, player_.head_angle());
             bool intersected(false);
             for (auto& part : coll_material.model) {
@@ -843,12 +845,18 @@ void main_game::receive(packet p)
         case msg::entity_update_physics::msg_id:
             entity_update_physics(archive);
             break;
+        case msg::entity_snapshot::msg_id:
+            entity_snapshot(archive);
+            break;
         case msg::entity_delete::msg_id:
             entity_delete(archive);
             break;
         case msg::surface_update::msg_id:
             surface_update(archive);
             break;
+        case msg::surface_batch::msg_id:
+            surface_batch(archive);
+            break;
         case msg::lightmap_update::msg_id:
             lightmap_update(archive);
             break;
@@ -953,7 +961,7 @@ void main_game::define_materials(deserializer<packet>& p)
     msg.serialize(p);
 
     for (auto& rec : msg.materials)
-        register_new_material(rec.material_id) = rec.definition;
+        register_new_material(rec.material_id, std::move(rec.definition));
 
     log_msg("Registered %1% materials", msg.materials.size());
 }
@@ -1018,21 +1026,51 @@ void main_game::entity_update_physics(deserializer<packet>& p)
 
     auto lock(entities_.acquire_write_lock());
 
-    for (auto& upd : msg.updates) {
-        auto e(entities_.make(upd.entity_id));
-        auto newpos(upd.pos + upd.velocity * lag);
+    for (auto& upd : msg.updates)
+        update_motion(upd.entity_id, upd.pos, upd.velocity, lag);
+}
 
-        // trace("Set entity %1% to position %2%", upd.entity_id, upd.pos);
-        // trace("  velocity %1%, lag %2%", upd.velocity, lag);
+void main_game::entity_snapshot(deserializer<packet>& p)
+{
+    msg::entity_snapshot msg;
+    msg.serialize(p);
 
-        if (entities_.entity_has_component(e, entity_system::c_position)
-            && entities_.entity_has_component(e, entity_system::c_velocity)) {
-            last_known_phys info{newpos, upd.velocity};
-            entities_.set(e, entity_system::c_lag_comp, info);
-        } else {
-            entities_.set_position(e, newpos);
-            entities_.set_velocity(e, upd.velocity);
-        }
+    // The server sends deltas against the last snapshot we acknowledged,
+    // so one that arrives late must not overwrite a newer one.
+    if (msg.sequence < next_snapshot_)
+        return;
+
+    next_snapshot_ = msg.sequence + 1;
+    msg::snapshot_ack ack;
+    ack.sequence = msg.sequence;
+    send(serialize_packet(ack), ack.method());
+
+    int32_t lag_msec(clock::time() - msg.timestamp);
+    float lag(lag_msec * 0.001f);
+
+    auto updates(decode_snapshot(msg.base, msg.entities));
+    auto lock(entities_.acquire_write_lock());
+    for (auto& upd : updates)
+        update_motion(upd.entity, hexa::position(upd), hexa::velocity(upd),
+                      lag);
+}
+
+void main_game::update_motion(uint32_t entity_id, const wfpos& pos,
+                              const vector& velocity, float lag)
+{
+    auto e(entities_.make(entity_id));
+    auto newpos(pos + velocity * lag);
+
+    // trace("Set entity %1% to position %2%", entity_id, pos);
+    // trace("  velocity %1%, lag %2%", velocity, lag);
+
+    if (entities_.entity_has_component(e, entity_system::c_position)
+        && entities_.entity_has_component(e, entity_system::c_velocity)) {
+        last_known_phys info{newpos, velocity};
+        entities_.set(e, entity_system::c_lag_comp, info);
+    } else {
+        entities_.set_position(e, newpos);
+        entities_.set_velocity(e, velocity);
     }
 }
 
@@ -1053,13 +1091,30 @@ void main_game::surface_update(deserializer<packet>& p)
     msg::surface_update msg;
     msg.serialize(p);
 
-    trace("receive surface %1%", msg.position);
+    receive_surface(msg.position, msg.terrain, msg.light);
+}
+
+void main_game::surface_batch(deserializer<packet>& p)
+{
+    waiting_for_data_ = false;
+
+    msg::surface_batch msg;
+    msg.serialize(p);
+
+    for (auto& s : msg.surfaces)
+        receive_surface(s.position, s.terrain, s.light);
+}
 
-    map().store_surface(msg.position, msg.terrain);
-    if (msg.light.unpacked_len > 0) {
-        map().store_lightmap(msg.position, msg.light);
-        scene_.set(msg.position, map().get_surface(msg.position),
-                   map().get_lightmap(msg.position));
+void main_game::receive_surface(const chunk_coordinates& pos,
+                                const compressed_data& terrain,
+                                const compressed_data& light)
+{
+    trace("receive surface %1%", pos);
+
+    map().store_surface(pos, terrain);
+    if (light.unpacked_len > 0) {
+        map().store_lightmap(pos, light);
+        scene_.set(pos, map().get_surface(pos), map().get_lightmap(pos));
     } else {
         assert(false);
     }
@@ -1072,6 +1127,13 @@ void main_game::lightmap_update(deserializer<packet>& p)
 
     trace("Lightmap update for %1%", msg.position);
 
+    // Without the surface, there's nothing to light.  The surface will
+    // come with its own light map later.
+    if (!map().is_surface_available(msg.position)) {
+        trace("No surface for lightmap %1%", msg.position);
+        return;
+    }
+
     map().store_lightmap(msg.position, msg.data);
 
     scene_.set(msg.position, map().get_surface(msg.position),
@@ -114,8 +114,18 @@ private:
 
     void entity_update(deserializer<packet>& p);
     void entity_update_physics(deserializer<packet>& p);
+    void entity_snapshot(deserializer<packet>& p);
+    /** Apply a position and velocity from the server.
+     ** @pre The entity system is locked for writing. */
+    void update_motion(uint32_t entity_id, const wfpos& pos,
+                       const vector& velocity, float lag);
     void entity_delete(deserializer<packet>& p);
     void surface_update(deserializer<packet>& p);
+    void surface_batch(deserializer<packet>& p);
+    /** Store a surface and light map, and show them. */
+    void receive_surface(const chunk_coordinates& pos,
+                         const compressed_data& terrain,
+                         const compressed_data& light);
     void lightmap_update(deserializer<packet>& p);
     void heightmap_update(deserializer<packet>& p);
     void configure_hotbar(deserializer<packet>& p);
@@ -167,6 +177,8 @@ private:
     bool show_ui_;
 
     uint32_t ignore_text_;
+    /** Entity snapshots older than this are out of date. */
+    uint32_t next_snapshot_;
 
     crypto::private_key my_private_key_;
     crypto::buffer server_nonce_;
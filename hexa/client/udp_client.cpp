@@ -109,7 +109,7 @@ bool udp_client::disconnect()
     return false;
 }
 
-void udp_client::poll(unsigned int milliseconds)
+bool udp_client::poll(unsigned int milliseconds)
 {
     ENetEvent ev;
     int result;
@@ -141,6 +141,8 @@ void udp_client::poll(unsigned int milliseconds)
 
     if (ev.packet != nullptr)
         enet_packet_destroy(ev.packet);
+
+    return result > 0;
 }
 
 bool udp_client::is_connected() const
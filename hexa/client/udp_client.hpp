@@ -51,7 +51,9 @@ public:
 
     bool disconnect();
 
-    void poll(unsigned int timeout = 200);
+    /// Handle the next network event.
+    /// @return False if nothing happened before the timeout
+    bool poll(unsigned int timeout = 200);
 
     void send(const binary_data& p, msg::reliability method);
 
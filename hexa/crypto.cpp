@@ -22,6 +22,7 @@
 
 #include "crypto.hpp"
 
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 
@@ -51,6 +52,10 @@ namespace crypto
 
 static AutoSeededRandomPool rng;
 
+/** The random pool is not thread-safe, and the server sets up its
+ ** connections on worker threads. */
+static std::mutex rng_lock;
+
 std::string hex(const buffer& in)
 {
     static const char* v = "0123456789ABCDEF";
@@ -77,6 +82,7 @@ buffer make_random(int bytes)
     if (bytes < 1)
         throw std::runtime_error("'bytes' must be greater than zero");
 
+    std::lock_guard<std::mutex> lock(rng_lock);
     buffer out(bytes);
     rng.GenerateBlock((byte*)&out[0], bytes);
     return out;
@@ -89,6 +95,7 @@ buffer make_aes_key()
 
 Integer make_random_128()
 {
+    std::lock_guard<std::mutex> lock(rng_lock);
     byte out[16];
     rng.GenerateBlock(out, 16);
     return Integer(out, 16);
@@ -121,18 +128,22 @@ buffer concat(const buffer& a, const buffer& b)
 
 private_key make_new_key()
 {
+    std::lock_guard<std::mutex> lock(rng_lock);
     ECIES<ECP>::Decryptor decr{rng, ASN1::secp256k1()};
     return decr.GetKey();
 }
 
 bool is_valid(const private_key& priv)
 {
-    return priv.Validate(rng, 3);
+    AutoSeededRandomPool local_rng;
+    return priv.Validate(local_rng, 3);
 }
 
 bool is_valid(const public_key& pub)
 {
-    return pub.Validate(rng, 3);
+    // Validating takes a while, so don't hold up the shared pool.
+    AutoSeededRandomPool local_rng;
+    return pub.Validate(local_rng, 3);
 }
 
 public_key get_public_key(const private_key& priv)
@@ -278,6 +289,7 @@ public_key from_json(const boost::property_tree::ptree& json)
 std::string encrypt_ecies(const std::string& plaintext, const public_key& key)
 {
     ECIES<ECP>::Encryptor encr{key};
+    std::lock_guard<std::mutex> lock(rng_lock);
     std::string cipher;
     try {
         StringSource(plaintext, true, new PK_EncryptorFilter(
@@ -298,6 +310,7 @@ std::string decrypt_ecies(const std::string& ciphertext,
     decr.AccessKey().AccessGroupParameters().Initialize(ASN1::secp256k1());
     decr.AccessKey().SetPrivateExponent(key.GetPrivateExponent());
 
+    std::lock_guard<std::mutex> lock(rng_lock);
     std::string plaintext;
     try {
         StringSource(
@@ -0,0 +1,278 @@
+//---------------------------------------------------------------------------
+// lib/entity_snapshot.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#include "entity_snapshot.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#include "serialize.hpp"
+
+namespace hexa
+{
+
+namespace
+{
+
+/** The number of bits for the position inside a chunk, along one axis. */
+const int in_chunk_bits = cnkshift + 8;
+
+/** The smallest number of bits one entity can take up: the ID, the
+ ** "near" flag, a nearby position, and the velocity flag. */
+const size_t min_entity_bits = 8 + 1 + 3 * (8 + in_chunk_bits) + 1;
+
+/** Writes values of any number of bits, without padding. */
+class bit_writer
+{
+public:
+    bit_writer(binary_data& out)
+        : out_(out)
+        , bits_(0)
+        , count_(0)
+    {
+    }
+
+    ~bit_writer() { flush(); }
+
+    void write(uint32_t value, int bits)
+    {
+        assert(bits <= 32);
+        bits_ |= uint64_t(value & mask(bits)) << count_;
+        count_ += bits;
+        while (count_ >= 8) {
+            out_.push_back(bits_ & 0xff);
+            bits_ >>= 8;
+            count_ -= 8;
+        }
+    }
+
+    void write_signed(int32_t value, int bits)
+    {
+        write(static_cast<uint32_t>(value), bits);
+    }
+
+    /** Write a number in groups of seven bits, so small numbers stay
+     ** small. */
+    void write_varint(uint32_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+            write((value & 0x7f) | 0x80, 8);
+
+        write(value, 8);
+    }
+
+    void flush()
+    {
+        if (count_ > 0)
+            out_.push_back(bits_ & 0xff);
+
+        bits_ = 0;
+        count_ = 0;
+    }
+
+    static uint32_t mask(int bits)
+    {
+        return bits == 32 ? 0xffffffff : (1u << bits) - 1;
+    }
+
+private:
+    binary_data& out_;
+    uint64_t bits_;
+    int count_;
+};
+
+/** Reads the values written by bit_writer. */
+class bit_reader
+{
+public:
+    bit_reader(const binary_data& in)
+        : in_(in)
+        , pos_(0)
+        , bits_(0)
+        , count_(0)
+    {
+    }
+
+    uint32_t read(int bits)
+    {
+        while (count_ < bits) {
+            if (pos_ >= in_.size())
+                throw serialize_error("entity snapshot is truncated");
+
+            bits_ |= uint64_t(in_[pos_++]) << count_;
+            count_ += 8;
+        }
+        uint32_t result(bits_ & bit_writer::mask(bits));
+        bits_ >>= bits;
+        count_ -= bits;
+        return result;
+    }
+
+    int32_t read_signed(int bits)
+    {
+        uint32_t raw(read(bits));
+        uint32_t sign(1u << (bits - 1));
+        return static_cast<int32_t>((raw ^ sign) - sign);
+    }
+
+    uint32_t read_varint()
+    {
+        uint32_t result(0);
+        for (int shift(0); shift < 35; shift += 7) {
+            uint32_t group(read(8));
+            result |= (group & 0x7f) << shift;
+            if ((group & 0x80) == 0)
+                return result;
+        }
+        throw serialize_error("invalid number in entity snapshot");
+    }
+
+    /** The number of bits that haven't been read yet. */
+    size_t bits_left() const { return (in_.size() - pos_) * 8 + count_; }
+
+    /** True if only the padding of the last byte is left. */
+    bool at_end() const { return pos_ == in_.size() && count_ < 8; }
+
+private:
+    const binary_data& in_;
+    size_t pos_;
+    uint64_t bits_;
+    int count_;
+};
+
+bool fits(int32_t value, int bits)
+{
+    return value >= -(1 << (bits - 1)) && value < (1 << (bits - 1));
+}
+
+} // anonymous namespace
+
+quantized_motion quantize(uint32_t entity, const wfpos& pos,
+                          const vector& velocity)
+{
+    quantized_motion result;
+    result.entity = entity;
+    result.block = pos.pos;
+    for (int i(0); i < 3; ++i) {
+        // Split the position in a whole block and 256 steps inside it.
+        int32_t steps(std::lround(pos.frac[i] * 256.0f));
+        int32_t whole(steps >> 8);
+        result.block[i] += whole;
+        result.frac[i] = steps - whole * 256;
+
+        float v(std::round(velocity[i] * 256.0f));
+        result.velocity[i] = std::max(-32768.0f, std::min(v, 32767.0f));
+    }
+    return result;
+}
+
+wfpos position(const quantized_motion& m)
+{
+    return wfpos(m.block, vector(m.frac) / 256.0f);
+}
+
+vector velocity(const quantized_motion& m)
+{
+    return vector(m.velocity) / 256.0f;
+}
+
+binary_data encode_snapshot(const chunk_coordinates& base,
+                            std::vector<quantized_motion>& entities)
+{
+    std::sort(entities.begin(), entities.end(),
+              [](const quantized_motion& a, const quantized_motion& b) {
+        return a.entity < b.entity;
+    });
+
+    binary_data result;
+    result.reserve(entities.size() * 12 + 4);
+    bit_writer out(result);
+
+    out.write_varint(entities.size());
+    uint32_t prev(0);
+    for (auto& m : entities) {
+        out.write_varint(m.entity - prev);
+        prev = m.entity;
+
+        world_vector offset((m.block >> cnkshift) - base);
+        bool near(fits(offset.x, 8) && fits(offset.y, 8)
+                  && fits(offset.z, 8));
+        out.write(near, 1);
+        for (int i(0); i < 3; ++i) {
+            uint32_t in_chunk(((m.block[i] & (chunk_size - 1)) << 8) | m.frac[i]);
+            if (near) {
+                out.write_signed(offset[i], 8);
+            } else {
+                out.write(m.block[i] >> cnkshift, 32 - cnkshift);
+            }
+            out.write(in_chunk, in_chunk_bits);
+        }
+
+        bool moving(m.velocity != vector3<int16_t>(0, 0, 0));
+        out.write(moving, 1);
+        if (moving) {
+            for (int i(0); i < 3; ++i)
+                out.write_signed(m.velocity[i], 16);
+        }
+    }
+    out.flush();
+
+    return result;
+}
+
+std::vector<quantized_motion> decode_snapshot(const chunk_coordinates& base,
+                                              const binary_data& data)
+{
+    bit_reader in(data);
+
+    // Don't trust the count until we know there's enough data for it.
+    uint32_t count(in.read_varint());
+    if (count > in.bits_left() / min_entity_bits)
+        throw serialize_error("entity snapshot is truncated");
+
+    std::vector<quantized_motion> result(count);
+
+    uint32_t prev(0);
+    for (auto& m : result) {
+        m.entity = prev + in.read_varint();
+        prev = m.entity;
+
+        bool near(in.read(1));
+        for (int i(0); i < 3; ++i) {
+            uint32_t chunk(near ? base[i] + in.read_signed(8)
+                                : in.read(32 - cnkshift));
+            uint32_t in_chunk(in.read(in_chunk_bits));
+            m.block[i] = (chunk << cnkshift) | (in_chunk >> 8);
+            m.frac[i] = in_chunk & 0xff;
+        }
+
+        if (in.read(1)) {
+            for (int i(0); i < 3; ++i)
+                m.velocity[i] = in.read_signed(16);
+        } else {
+            m.velocity = vector3<int16_t>(0, 0, 0);
+        }
+    }
+
+    return result;
+}
+
+} // namespace hexa
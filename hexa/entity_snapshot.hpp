@@ -0,0 +1,94 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/entity_snapshot.hpp
+/// \brief  Compact encoding of entity positions and velocities.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "basic_types.hpp"
+#include "wfpos.hpp"
+
+namespace hexa
+{
+
+/** The position and velocity of an entity, rounded to the precision
+ ** of an entity snapshot. */
+struct quantized_motion
+{
+    uint32_t entity;
+    /** The block the entity is in. */
+    world_coordinates block;
+    /** The position inside the block, in 1/256ths of a block. */
+    vector3<uint8_t> frac;
+    /** The velocity, in 1/256ths of a block per second. */
+    vector3<int16_t> velocity;
+
+    bool operator==(const quantized_motion& other) const
+    {
+        return entity == other.entity && block == other.block
+               && frac == other.frac && velocity == other.velocity;
+    }
+
+    bool operator!=(const quantized_motion& other) const
+    {
+        return !(*this == other);
+    }
+};
+
+/** The largest error quantize() introduces in a position, in blocks. */
+constexpr float snapshot_position_error = 1.0f / 512.0f;
+
+/** The largest error quantize() introduces in a velocity, in blocks per
+ ** second.  Velocities are clamped to about +/-128 blocks per second. */
+constexpr float snapshot_velocity_error = 1.0f / 512.0f;
+
+/** Round an entity's position and velocity. */
+quantized_motion quantize(uint32_t entity, const wfpos& pos,
+                          const vector& velocity);
+
+/** The position of a quantized entity. */
+wfpos position(const quantized_motion& m);
+
+/** The velocity of a quantized entity. */
+vector velocity(const quantized_motion& m);
+
+/** Pack a list of entities.
+ *  Positions are stored relative to a base chunk, usually the one the
+ *  receiving player is in.  An entity within 127 chunks of the base takes
+ *  an 8-bit chunk offset and a 12-bit fixed point position inside the
+ *  chunk along every axis.  Entities that are not moving only take a
+ *  single bit for their velocity.  Entity IDs are sorted and stored as
+ *  the difference from the previous one.
+ * @param base      The base chunk
+ * @param entities  The entities to pack.  They will be sorted.
+ * @return The packed snapshot */
+binary_data encode_snapshot(const chunk_coordinates& base,
+                            std::vector<quantized_motion>& entities);
+
+/** Unpack a snapshot.
+ * @param base  The base chunk that was passed to encode_snapshot()
+ * @param data  The packed snapshot
+ * @throw serialize_error if the snapshot is truncated */
+std::vector<quantized_motion> decode_snapshot(const chunk_coordinates& base,
+                                              const binary_data& data);
+
+} // namespace hexa
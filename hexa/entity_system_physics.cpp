@@ -145,16 +145,20 @@ void system_terrain_collision(es::storage& s, get_surf_func get_surface,
                 for (auto c : data->opaque) {
                     vector bp(c.pos + local_offset);
 
+                    assert(material_tables_match(c.type));
+                    if (type::is_plain_cube(c.type)) {
+                        cm.emplace_back(bp, 0x3f);
+                        continue;
+                    }
+
                     const auto& m(material_prop[c.type]);
                     if (!m.bounding_box.empty()) {
                         for (auto& part : m.bounding_box)
                             cm.emplace_back(part + bp, 0x3f);
-                    } else if (m.is_custom_block()) {
+                    } else {
                         for (auto& part : m.model)
                             cm.emplace_back(
                                 (++aabb<vector>(part.box)) / 16.f + bp, 0x3f);
-                    } else {
-                        cm.emplace_back(bp, 0x3f);
                     }
                 }
             }
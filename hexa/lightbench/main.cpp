@@ -0,0 +1,234 @@
+//---------------------------------------------------------------------------
+// lightbench/main.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+//
+// Benchmark for the light map generators.  This sets up a world from a
+// game's setup.json, without a database, and runs every light module on
+// its own over a fixed block of chunks.  For every phase it reports the
+// number of faces lit per second, and a checksum of the resulting light
+// maps.  The checksum should stay the same when optimizing a generator,
+// unless its output is supposed to change.
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <boost/program_options/option.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/config.hpp>
+#include <hexa/json.hpp>
+#include <hexa/lightmap.hpp>
+#include <hexa/log.hpp>
+#include <hexa/persistence_null.hpp>
+#include <hexa/voxel_range.hpp>
+
+#include <hexa/server/globals.hpp>
+#include <hexa/server/init_terrain_generators.hpp>
+#include <hexa/server/lua.hpp>
+#include <hexa/server/server_entity_system.hpp>
+#include <hexa/server/world.hpp>
+
+namespace po = boost::program_options;
+namespace pt = boost::property_tree;
+namespace fs = boost::filesystem;
+using boost::format;
+using namespace hexa;
+
+namespace hexa
+{
+po::variables_map global_settings;
+}
+
+namespace
+{
+
+/** FNV-1a, continued from a previous hash. */
+uint32_t add_to_checksum(uint32_t hash, const lightmap_hr& lm)
+{
+    for (auto& l : lm) {
+        auto p(reinterpret_cast<const uint8_t*>(&l));
+        for (size_t i(0); i < sizeof(l); ++i)
+            hash = (hash ^ p[i]) * 16777619;
+    }
+    return hash;
+}
+
+/** The game configuration, with only one light module. */
+pt::ptree single_module(const pt::ptree& config, const std::string& module)
+{
+    pt::ptree result(config);
+    pt::ptree def;
+    def.put("module", module);
+
+    // Use the game's own settings for this module, if it has any.
+    auto light_def(config.get_child_optional("light"));
+    if (light_def) {
+        for (auto& i : *light_def) {
+            if (i.second.get<std::string>("module", "") == module)
+                def = i.second;
+        }
+    }
+
+    pt::ptree light;
+    light.push_back(std::make_pair("", def));
+    result.put_child("light", light);
+    return result;
+}
+
+void run(const pt::ptree& config, const std::string& module,
+         const std::vector<chunk_coordinates>& chunks, int rounds)
+{
+    using namespace std::chrono;
+
+    persistence_null storage;
+    world w(storage);
+
+    auto setup_start(steady_clock::now());
+    init_terrain_gen(w, single_module(config, module));
+    auto setup_time(duration<double>(steady_clock::now() - setup_start));
+
+    // Generate the light maps once without timing them.  This takes
+    // care of all the terrain generation and surface extraction, also
+    // for the chunks around the benchmark area the rays end up in.
+    const unsigned int phases(w.lightmap_phases());
+    for (auto& pos : chunks) {
+        auto proxy(w.acquire_read_access());
+        for (unsigned int phase(0); phase < phases; ++phase)
+            proxy.generate_lightmap(pos, phase);
+    }
+
+    std::cout << format("%1%: set up in %2$.3f s, %3% phases")
+                     % module % setup_time.count() % phases << std::endl;
+
+    for (unsigned int phase(0); phase < phases; ++phase) {
+        uint32_t checksum(2166136261);
+        size_t faces(0);
+        duration<double> elapsed(0);
+
+        for (int round(0); round < rounds; ++round) {
+            for (auto& pos : chunks) {
+                auto proxy(w.acquire_read_access());
+                auto start(steady_clock::now());
+                auto lm(proxy.generate_lightmap(pos, phase));
+                elapsed += steady_clock::now() - start;
+
+                if (round == 0) {
+                    faces += lm.opaque.size() + lm.transparent.size();
+                    checksum = add_to_checksum(checksum, lm.opaque);
+                    checksum = add_to_checksum(checksum, lm.transparent);
+                }
+            }
+        }
+
+        double seconds(elapsed.count() / rounds);
+        std::cout << format("  phase %1%: %2% faces in %3$.3f s, "
+                            "%4$.0f faces/s, checksum %5$08x")
+                         % phase % faces % seconds
+                         % (seconds > 0 ? faces / seconds : 0.0) % checksum
+                  << std::endl;
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[])
+{
+    auto& vm(global_settings);
+
+    po::options_description options("Options");
+    options.add_options()("help", "show help message")(
+        "datadir", po::value<std::string>()->default_value(GAME_DATA_PATH),
+        "the data directory")(
+        "game", po::value<std::string>()->default_value("defaultgame"),
+        "which game's terrain to use")(
+        "modules", po::value<std::string>()->default_value(
+                       "sun,ambient_occlusion,lamp,radiosity"),
+        "comma-separated list of light modules to test")(
+        "size", po::value<int>()->default_value(4),
+        "use the chunks up to this distance from the center, horizontally")(
+        "depth", po::value<int>()->default_value(2),
+        "use the chunks up to this distance from the center, vertically")(
+        "rounds", po::value<int>()->default_value(3),
+        "how many times to generate every light map");
+
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << options << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    try {
+        fs::path datadir(vm["datadir"].as<std::string>());
+        set_gamedir(datadir / "games" / vm["game"].as<std::string>());
+        if (!fs::is_directory(gamedir())) {
+            std::cerr << "Gamedir '" << gamedir().string()
+                      << "' is not a directory" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // The material definitions come from the game's Lua scripts.
+        persistence_null script_storage;
+        world script_world(script_storage);
+        server_entity_system entities;
+        lua scripting(entities, script_world);
+        for (fs::recursive_directory_iterator i{gamedir()};
+             i != fs::recursive_directory_iterator(); ++i) {
+            if (fs::is_regular_file(*i) && i->path().extension() == ".lua") {
+                if (!scripting.load(i->path()))
+                    throw std::runtime_error(scripting.get_error());
+            }
+        }
+
+        auto config(read_json(gamedir() / "setup.json"));
+
+        int size(vm["size"].as<int>()), depth(vm["depth"].as<int>());
+        std::vector<chunk_coordinates> chunks;
+        // The upper bound of the range is exclusive.
+        for (auto rel : make_range<world_vector>(
+                 {-size, -size, -depth}, {size + 1, size + 1, depth + 1})) {
+            chunks.emplace_back(world_chunk_center + rel);
+        }
+
+        std::vector<std::string> modules;
+        boost::split(modules, vm["modules"].as<std::string>(),
+                     boost::is_any_of(","));
+
+        std::cout << format("%1% chunks, %2% rounds") % chunks.size()
+                         % vm["rounds"].as<int>() << std::endl;
+
+        for (auto& module : modules)
+            run(config, module, chunks, vm["rounds"].as<int>());
+
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
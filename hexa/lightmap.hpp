@@ -254,6 +254,7 @@ public:
         if (&m != this) {
             opaque = std::move(m.opaque);
             transparent = std::move(m.transparent);
+            phase = m.phase;
         }
         return *this;
     }
@@ -0,0 +1,101 @@
+//---------------------------------------------------------------------------
+// lib/occupancy_map.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#include "occupancy_map.hpp"
+
+#include <cassert>
+
+#include "chunk.hpp"
+
+namespace hexa
+{
+
+constexpr int occupancy_map::top_level;
+
+namespace
+{
+
+// Where every level starts in the cell array.
+const size_t level_offset[] = {0, 0, 512, 576, 584};
+
+} // anonymous namespace
+
+occupancy_map::occupancy_map()
+{
+    cells_.fill(true);
+}
+
+occupancy_map::occupancy_map(const chunk& cnk)
+{
+    // Level 1 is built from the blocks.
+    for (int z(0); z < 8; ++z) {
+        for (int y(0); y < 8; ++y) {
+            for (int x(0); x < 8; ++x) {
+                bool result(true);
+                for (int i(0); i < 8 && result; ++i) {
+                    result = cnk(x * 2 + (i & 1), y * 2 + ((i >> 1) & 1),
+                                 z * 2 + (i >> 2)).is_air();
+                }
+                cells_[x + y * 8 + z * 64] = result;
+            }
+        }
+    }
+
+    // Every next level combines eight cells from the one below it.
+    for (int level(2); level <= top_level; ++level) {
+        int size(chunk_size >> level);
+        for (int z(0); z < size; ++z) {
+            for (int y(0); y < size; ++y) {
+                for (int x(0); x < size; ++x) {
+                    chunk_index p(x << level, y << level, z << level);
+                    bool result(true);
+                    for (int i(0); i < 8 && result; ++i) {
+                        int half(1 << (level - 1));
+                        chunk_index c(p.x + (i & 1) * half,
+                                      p.y + ((i >> 1) & 1) * half,
+                                      p.z + (i >> 2) * half);
+                        result = cells_[index(level - 1, c)];
+                    }
+                    cells_[index(level, p)] = result;
+                }
+            }
+        }
+    }
+}
+
+int occupancy_map::empty_level(const chunk_index& p) const
+{
+    // Find the biggest empty cell by going down from the top.
+    for (int level(top_level); level > 0; --level) {
+        if (cells_[index(level, p)])
+            return level;
+    }
+    return 0;
+}
+
+size_t occupancy_map::index(int level, const chunk_index& p)
+{
+    assert(level > 0 && level <= top_level);
+    size_t size(chunk_size >> level);
+    return level_offset[level] + (p.x >> level) + (p.y >> level) * size
+           + (p.z >> level) * size * size;
+}
+
+} // namespace hexa
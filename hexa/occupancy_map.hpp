@@ -0,0 +1,75 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/occupancy_map.hpp
+/// \brief  A pyramid of empty and full cells in a chunk.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "basic_types.hpp"
+
+namespace hexa
+{
+
+class chunk;
+
+/** Keeps track of which parts of a chunk are empty.
+ *  The chunk is divided in cells of 2x2x2 blocks (level 1), 4x4x4
+ *  (level 2), 8x8x8 (level 3), and finally the whole chunk (level 4).
+ *  A cell is empty if it only holds air.  Level 0 would be the blocks
+ *  themselves; look those up in the chunk.
+ *
+ *  Rays can use this to skip large empty areas in one go. */
+class occupancy_map
+{
+public:
+    /** The highest level, a single cell covering the chunk. */
+    static constexpr int top_level = 4;
+
+    /** Build the map of an empty chunk. */
+    occupancy_map();
+
+    /** Build the map of a chunk. */
+    occupancy_map(const chunk& cnk);
+
+    /** Check if the cell that contains a given block is empty.
+     * @param level  The level (1..top_level)
+     * @param p      A block in the chunk */
+    bool is_empty(int level, const chunk_index& p) const
+    {
+        return cells_[index(level, p)];
+    }
+
+    /** Find the biggest empty cell around a block.
+     * @pre The block itself is air.
+     * @return The level of the cell, or 0 if there are no empty cells
+     *         around the block */
+    int empty_level(const chunk_index& p) const;
+
+private:
+    static size_t index(int level, const chunk_index& p);
+
+private:
+    /** The cells of levels 1 to 4, one after the other. */
+    std::array<bool, 512 + 64 + 8 + 1> cells_;
+};
+
+} // namespace hexa
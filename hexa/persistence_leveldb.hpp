@@ -60,6 +60,11 @@ public:
     void retrieve(es::storage& es, es::entity entity_id) override;
     bool is_available(es::entity entity_id) override;
 
+    surface_encoding surface_format() const override
+    {
+        return surface_encoding::bitmask;
+    }
+
     //void remove(map_coordinates xy) override;
     //void remove(chunk_coordinates xyz) override;
 
@@ -26,6 +26,7 @@
 #include "basic_types.hpp"
 #include "compression.hpp"
 #include "entity_system.hpp"
+#include "surface.hpp"
 
 namespace hexa
 {
@@ -104,6 +105,13 @@ public:
 
     raii_transaction transaction() { return raii_transaction(*this); }
 
+    /** The encoding that new surfaces should be stored in.  Surfaces that
+     ** were stored earlier can still be in the other one. */
+    virtual surface_encoding surface_format() const
+    {
+        return surface_encoding::face_list;
+    }
+
 public:
     /** This function will be called at regular intervals.
      *  If the storage needs to do some maintenance work, such as writing
@@ -29,12 +29,45 @@
 #include "hotbar_slot.hpp"
 #include "packet.hpp"
 #include "serialize.hpp"
+#include "surface.hpp"
 
 namespace hexa
 {
 namespace msg
 {
 
+/** The oldest protocol version that is still supported. */
+constexpr uint8_t oldest_protocol_version = 1;
+
+/** The current protocol version.
+ *  - 2: surface_update can use surface_encoding::bitmask
+ *  - 3: entity_snapshot replaces entity_update_physics
+ *  - 4: surface_batch
+ *  - 5: entity_snapshot is numbered, and acknowledged with snapshot_ack */
+constexpr uint8_t current_protocol_version = 5;
+
+/** The surface encoding that clients of a given protocol version can
+ ** read. */
+inline surface_encoding surface_encoding_for(uint8_t protocol_version)
+{
+    return protocol_version >= 2 ? surface_encoding::bitmask
+                                 : surface_encoding::face_list;
+}
+
+/** Check if clients of a given protocol version can read entity
+ ** snapshots. */
+inline bool supports_entity_snapshots(uint8_t protocol_version)
+{
+    return protocol_version >= 5;
+}
+
+/** Check if clients of a given protocol version can read surface
+ ** batches. */
+inline bool supports_surface_batches(uint8_t protocol_version)
+{
+    return protocol_version >= 4;
+}
+
 typedef enum {
     /** Will arrive in the same order as sent. */
     sequenced,
@@ -378,6 +411,34 @@ public:
     }
 };
 
+/** Quantized positions and velocities of entities.
+ *  This is a more compact version of entity_update_physics.  It only
+ *  holds the entities that differ from the last snapshot the client has
+ *  acknowledged, so a lost snapshot is made up for by the next one.
+ *  See encode_snapshot() and snapshot_ack. */
+class entity_snapshot : public msg_i
+{
+public:
+    enum { msg_id = 14 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return unreliable; }
+
+    /** Increases by one for every snapshot sent to a client. */
+    uint32_t sequence;
+    gameclock_t timestamp;
+    /** The chunk the positions are relative to. */
+    chunk_coordinates base;
+    /** The output of encode_snapshot(). */
+    binary_data entities;
+
+    /** (De)serialize this message. */
+    template <typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar(sequence)(timestamp)(base)(entities);
+    }
+};
+
 /** Remove an entity completely. */
 class entity_delete : public msg_i
 {
@@ -463,7 +524,8 @@ public:
 
     chunk_coordinates position; /**< Position of the chunk. */
 
-    compressed_data terrain; /**< Compressed opaque & transparent surfaces. */
+    /** Compressed opaque & transparent surfaces, see encode_surface(). */
+    compressed_data terrain;
     compressed_data light;   /**< Compressed light maps. */
 
     /** (De)serialize this message. */
@@ -474,6 +536,39 @@ public:
     }
 };
 
+/** Several surface updates in one message.
+ *  The server bundles the updates for chunks that change at around the
+ *  same time, such as after a big edit. */
+class surface_batch : public msg_i
+{
+public:
+    enum { msg_id = 17 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return reliable; }
+
+    struct record
+    {
+        chunk_coordinates position;
+        compressed_data terrain;
+        compressed_data light;
+
+        template <typename Archive>
+        Archive& serialize(Archive& ar)
+        {
+            return ar(position)(terrain)(light);
+        }
+    };
+
+    std::vector<record> surfaces;
+
+    /** (De)serialize this message. */
+    template <typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar(surfaces);
+    }
+};
+
 /** Register player stat info. */
 class player_stat_register : public msg_i
 {
@@ -672,6 +767,25 @@ public:
     }
 };
 
+/** Acknowledge an entity snapshot.  The server sends the next snapshots
+ ** relative to this one. */
+class snapshot_ack : public msg_i
+{
+public:
+    enum { msg_id = 133 };
+    uint8_t type() const { return msg_id; }
+    reliability method() const { return unreliable; }
+
+    uint32_t sequence;
+
+    /** (De)serialize this message. */
+    template <typename Archive>
+    void serialize(Archive& ar)
+    {
+        ar(sequence);
+    }
+};
+
 /** The player typed something in the console. */
 class console : public msg_i
 {
@@ -0,0 +1,161 @@
+//---------------------------------------------------------------------------
+// lib/ray_batch.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#include "ray_batch.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace hexa
+{
+
+constexpr int ray_batch::width;
+
+ray_batch::ray_batch(const flat_ray_bundle& bundle, size_t stride_y,
+                     size_t stride_z)
+    : bundle_(bundle)
+    , first_voxel_(0, 0, 0)
+{
+    auto& steps(bundle.steps());
+    offsets_.resize(steps.size());
+    dz_.resize(steps.size());
+
+    bool found_first(false);
+    for (auto& n : bundle.nodes()) {
+        world_vector p(n.origin.x, n.origin.y, n.origin.z);
+        for (uint32_t j(n.first_step); j < n.last_step; ++j) {
+            p += world_vector(steps[j].x, steps[j].y, steps[j].z);
+            offsets_[j] = p.x + p.y * stride_y + p.z * stride_z;
+            dz_[j] = p.z;
+        }
+        if (n.first_voxel && n.first_step < n.last_step) {
+            auto& s(steps[n.first_step]);
+            world_vector f(n.origin.x + s.x, n.origin.y + s.y,
+                           n.origin.z + s.z);
+
+            // All rays start in the same voxel.
+            assert(!found_first || f == first_voxel_);
+            first_voxel_ = f;
+            found_first = true;
+        }
+    }
+}
+
+uint32_t ray_batch::trunk(const flat_ray_bundle::node& n, uint32_t open,
+                          const volume& vol, const int32_t* index,
+                          const int32_t* height, const float* first,
+                          float* temp) const
+{
+    for (int l(0); l < width; ++l) {
+        float t(0.0f);
+        if (open & (1 << l)) {
+            bool is_first(n.first_voxel);
+            for (uint32_t j(n.first_step); j < n.last_step; ++j) {
+                if (height[l] + dz_[j] >= 0) {
+                    open &= ~(1 << l);
+                    break;
+                }
+                if (is_first) {
+                    t += first[l];
+                    is_first = false;
+                } else {
+                    // Adding zero for a clear voxel wouldn't change t, so
+                    // those can be skipped.
+                    int32_t i(index[l] + offsets_[j]);
+                    if ((vol.light_mask[i >> 4] >> (i & 15)) & 1)
+                        t += vol.opacity[vol.types[i]] * (1.0f / 255.0f);
+                }
+                if (t >= 1.0f) {
+                    open &= ~(1 << l);
+                    break;
+                }
+            }
+        }
+        temp[l] = t;
+    }
+    return open;
+}
+
+void ray_batch::cast(const volume& vol, const int32_t* index,
+                     const uint32_t* z, uint32_t sky, const float* first,
+                     int count, float* result) const
+{
+    assert(count > 0 && count <= width);
+
+    auto& nodes(bundle_.nodes());
+    const uint32_t end(nodes.size());
+
+    int32_t idx[width], height[width];
+    float fst[width], power[width], temp[width];
+    uint32_t resume[width];
+    for (int l(0); l < width; ++l) {
+        if (l < count) {
+            // Keep the height relative to the sky well inside the int32
+            // range, so the steps can be added without overflowing.
+            int64_t h(int64_t(z[l]) - int64_t(sky));
+            height[l] = std::max<int64_t>(std::min<int64_t>(h, 1 << 30),
+                                          -(1 << 30));
+            idx[l] = index[l];
+            fst[l] = first[l];
+            power[l] = bundle_.weight();
+            resume[l] = 0;
+        } else {
+            height[l] = 0;
+            idx[l] = 0;
+            fst[l] = 0.0f;
+            power[l] = 0.0f;
+            resume[l] = end;
+        }
+    }
+
+    // Go through the tree in preorder.  A lane takes part in a node if
+    // that node is where it is supposed to resume; blocked lanes have
+    // jumped ahead to the end of the subtree.
+    uint32_t i(0);
+    while (i < end) {
+        auto& n(nodes[i]);
+        uint32_t active(0);
+        for (int l(0); l < width; ++l) {
+            if (resume[l] == i)
+                active |= 1 << l;
+        }
+
+        uint32_t open(trunk(n, active, vol, idx, height, fst, temp));
+
+        uint32_t next(end);
+        for (int l(0); l < width; ++l) {
+            if (active & (1 << l)) {
+                power[l] -= std::min(temp[l], 1.0f) * n.weight;
+                if (power[l] <= 0.01) {
+                    power[l] = 0.0f;
+                    resume[l] = end;
+                } else {
+                    resume[l] = (open & (1 << l)) ? i + 1 : n.skip;
+                }
+            }
+            next = std::min(next, resume[l]);
+        }
+        i = next;
+    }
+
+    std::copy(power, power + count, result);
+}
+
+} // namespace hexa
@@ -0,0 +1,106 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/ray_batch.hpp
+/// \brief  Cast a ray bundle from several blocks at once.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "basic_types.hpp"
+#include "ray_bundle.hpp"
+
+namespace hexa
+{
+
+/** Casts a flat_ray_bundle from up to eight blocks at the same time.
+ *  All blocks follow the same path through the bundle's tree, one lane
+ *  per block.  A lane that gets blocked waits until the others reach the
+ *  end of its skipped subtree.  This is faster than calling
+ *  flat_ray_bundle::cast() for every block, because the steps are turned
+ *  into array offsets only once.
+ *
+ *  The voxels are looked up in a bitmask first, and only the ones that
+ *  stop any light are looked up in the material and opacity tables.
+ *  Most voxels a ray crosses are air, and the bitmask is small enough to
+ *  stay in the cache.  The lanes are handled one after the other; they
+ *  diverge too quickly to gain anything from SIMD gathers.  The results
+ *  are exactly the same as those of flat_ray_bundle::cast(), provided
+ *  the opacity function used there returns the same values. */
+class ray_batch
+{
+public:
+    /** The number of lanes. */
+    static constexpr int width = 8;
+
+    /** The voxels a bundle is cast through. */
+    struct volume
+    {
+        /** One bit for every voxel that stops any light, 16 voxels per
+         ** word. */
+        const uint16_t* light_mask;
+        /** The material of every voxel. */
+        const uint16_t* types;
+        /** The opacity of every material, from 0 (clear) to 255. */
+        const uint8_t* opacity;
+    };
+
+    /** Prepare a bundle for a given volume layout.
+     * @param bundle    The ray bundle.  It has to stay around for as long
+     *                  as this object is used.
+     * @param stride_y  Distance between two voxels along the y axis
+     * @param stride_z  Distance between two voxels along the z axis */
+    ray_batch(const flat_ray_bundle& bundle, size_t stride_y,
+              size_t stride_z);
+
+    /** The very first voxel of every ray, relative to the starting
+     ** block.  This one is handled separately, see cast(). */
+    world_vector first_voxel() const { return first_voxel_; }
+
+    /** Cast the bundle.
+     * @param vol      The voxels
+     * @param index    Index of each lane's starting block in the volume
+     * @param z        The z coordinate of each lane's starting block
+     * @param sky      Every voxel at this z-coordinate or above is clear
+     * @param first    Opacity of the first voxel of each lane's rays
+     * @param count    Number of lanes in use (1..width)
+     * @param result   The remaining light for each lane */
+    void cast(const volume& vol, const int32_t* index, const uint32_t* z,
+              uint32_t sky, const float* first, int count,
+              float* result) const;
+
+private:
+    /** Follow a node's trunk for all lanes in \a open.
+     * @return The lanes that are still open at the end of the trunk */
+    uint32_t trunk(const flat_ray_bundle::node& n, uint32_t open,
+                   const volume& vol, const int32_t* index,
+                   const int32_t* height, const float* first,
+                   float* temp) const;
+
+private:
+    const flat_ray_bundle& bundle_;
+    /** For every step, the offset in the volume from the starting block. */
+    std::vector<int32_t> offsets_;
+    /** For every step, the z offset from the starting block. */
+    std::vector<int32_t> dz_;
+    world_vector first_voxel_;
+};
+
+} // namespace hexa
@@ -19,6 +19,7 @@
 // Copyright 2013-2014, nocte@hippie.nu
 //---------------------------------------------------------------------------
 #include "ray_bundle.hpp"
+#include <cassert>
 #include <boost/range/algorithm.hpp>
 
 using namespace std;
@@ -97,4 +98,77 @@ void ray_bundle::multiply_weight(float factor)
         branch.multiply_weight(factor);
 }
 
+//---------------------------------------------------------------------------
+
+flat_ray_bundle::flat_ray_bundle(const ray_bundle& tree)
+    : reach_(world_vector(0, 0, 0))
+{
+    compile(tree, world_vector(0, 0, 0), true);
+}
+
+void flat_ray_bundle::compile(const ray_bundle& tree, world_vector prev,
+                              bool first)
+{
+    size_t index(nodes_.size());
+    nodes_.emplace_back();
+    {
+        node& n(nodes_.back());
+        n.weight = tree.weight;
+        n.first_step = steps_.size();
+        n.origin = origin_type(prev.x, prev.y, prev.z);
+        n.first_voxel = first;
+    }
+    for (auto& voxel : tree.trunk) {
+        world_vector d(voxel - prev);
+        assert(d.x >= -128 && d.x < 128);
+        assert(d.y >= -128 && d.y < 128);
+        assert(d.z >= -128 && d.z < 128);
+        steps_.emplace_back(d.x, d.y, d.z);
+        prev = voxel;
+
+        reach_ = reach_ + aabb<world_vector>(voxel);
+    }
+    nodes_[index].last_step = steps_.size();
+
+    // Only the very first voxel of the whole bundle is special.  The
+    // tree walk only passes this on if the trunk was empty.
+    first = first && tree.trunk.empty();
+    for (auto& branch : tree.branches)
+        compile(branch, prev, first);
+
+    nodes_[index].skip = nodes_.size();
+}
+
+bool flat_ray_bundle::is_valid() const
+{
+    aabb<world_vector> reach(world_vector(0, 0, 0));
+
+    // The nodes whose subtree we're in, innermost last.
+    std::vector<uint32_t> parents;
+    for (uint32_t i(0); i < nodes_.size(); ++i) {
+        const node& n(nodes_[i]);
+        if (n.skip <= i || n.skip > nodes_.size())
+            return false;
+
+        while (!parents.empty() && nodes_[parents.back()].skip <= i)
+            parents.pop_back();
+
+        if (!parents.empty() && n.skip > nodes_[parents.back()].skip)
+            return false;
+
+        parents.push_back(i);
+
+        if (n.first_step > n.last_step || n.last_step > steps_.size())
+            return false;
+
+        world_vector p(n.origin.x, n.origin.y, n.origin.z);
+        for (uint32_t j(n.first_step); j < n.last_step; ++j) {
+            const step& s(steps_[j]);
+            p += world_vector(s.x, s.y, s.z);
+            reach = reach + aabb<world_vector>(p);
+        }
+    }
+    return reach == reach_;
+}
+
 } // namespace hexa
@@ -21,7 +21,11 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <vector>
+#include "aabb.hpp"
+#include "basic_types.hpp"
 #include "ray.hpp"
 
 namespace hexa
@@ -73,4 +77,138 @@ public:
     bool operator==(world_vector comp) const { return trunk.front() == comp; }
 };
 
+/** A ray bundle, compiled to a flat array for fast traversal.
+ *  The tree is stored in preorder.  Every node knows where its subtree
+ *  ends, so a blocked branch can be skipped by jumping ahead instead of
+ *  recursing.  The voxels are stored as single steps from one voxel to the
+ *  next, packed as 8-bit triplets. */
+class flat_ray_bundle
+{
+public:
+    typedef vector3<int8_t> step;
+    typedef vector3<int16_t> origin_type;
+
+    struct node
+    {
+        /** The weight of this part of the tree. */
+        float weight;
+        /** Index of the first step in this node's trunk. */
+        uint32_t first_step;
+        /** Index of the first step after this node's trunk. */
+        uint32_t last_step;
+        /** Index of the first node after this node's subtree. */
+        uint32_t skip;
+        /** The voxel just before the first step. */
+        origin_type origin;
+        /** True if the first voxel of this trunk is also the first
+         ** voxel of the entire ray. */
+        bool first_voxel;
+    };
+
+public:
+    flat_ray_bundle() {}
+
+    flat_ray_bundle(const ray_bundle& tree);
+
+    /** The weight of the entire bundle. */
+    float weight() const { return nodes_.empty() ? 0.f : nodes_[0].weight; }
+
+    const std::vector<node>& nodes() const { return nodes_; }
+    const std::vector<step>& steps() const { return steps_; }
+
+    /** The bounding box of all voxels, relative to the starting
+     ** position. */
+    const aabb<world_vector>& reach() const { return reach_; }
+
+    /** Cast the bundle through the world.
+     *  This gives the same results as walking the ray_bundle tree: every
+     *  node subtracts the opacity along its trunk (capped at 1) times its
+     *  weight, and a branch is skipped once it is fully blocked.
+     *
+     *  The rays must all point upwards for \a sky to work; a ray is
+     *  considered to be unobstructed once it reaches that height.
+     * @param blk  The starting position
+     * @param sky  Every voxel at this z-coordinate or above is clear
+     * @param op   Returns the opacity for a voxel.  The second parameter
+     *             is true if this is the very first voxel of a ray.
+     * @return The remaining light */
+    template <typename Op>
+    float cast(const world_coordinates& blk, uint32_t sky, Op op) const
+    {
+        float power(weight());
+        uint32_t i(0);
+        while (i < nodes_.size()) {
+            const node& n(nodes_[i]);
+            world_coordinates p(blk.x + n.origin.x, blk.y + n.origin.y,
+                                blk.z + n.origin.z);
+            float temp(0.0f);
+            bool open(true);
+            bool first(n.first_voxel);
+            for (uint32_t j(n.first_step); j < n.last_step; ++j) {
+                const step& s(steps_[j]);
+                p.x += s.x;
+                p.y += s.y;
+                p.z += s.z;
+                if (p.z >= sky) {
+                    open = false;
+                    break;
+                }
+                temp += op(p, first);
+                first = false;
+                if (temp >= 1.0f) {
+                    open = false;
+                    break;
+                }
+            }
+
+            power -= std::min(temp, 1.0f) * n.weight;
+            if (power <= 0.01)
+                return 0.0f;
+
+            i = open ? i + 1 : n.skip;
+        }
+        return power;
+    }
+
+    /** Check if the bundle is safe to cast.
+     *  Every index has to stay within the arrays, every subtree has to be
+     *  nested in its parent's, and the reach has to cover every voxel the
+     *  steps lead to.  Use this on bundles that were read from a file. */
+    bool is_valid() const;
+
+    /** Serialize to an archive.
+     *  Every field is stored on its own, so the result does not depend on
+     *  the platform's padding or byte order.  This does not check if the
+     *  bundle makes sense; see is_valid(). */
+    template <class Archive>
+    Archive& serialize(Archive& ar)
+    {
+        // Bytes per node and per step, as stored.
+        const size_t node_size(23), step_size(3);
+
+        uint32_t node_count(nodes_.size()), step_count(steps_.size());
+        ar(node_count)(step_count)
+            .expect(node_count * node_size + step_count * step_size);
+
+        nodes_.resize(node_count);
+        steps_.resize(step_count);
+        for (auto& n : nodes_) {
+            ar(n.weight)(n.first_step)(n.last_step)(n.skip)(n.origin)(
+                n.first_voxel);
+        }
+        for (auto& s : steps_)
+            ar(s.x)(s.y)(s.z);
+
+        return ar(reach_);
+    }
+
+private:
+    void compile(const ray_bundle& tree, world_vector prev, bool first);
+
+private:
+    std::vector<node> nodes_;
+    std::vector<step> steps_;
+    aabb<world_vector> reach_;
+};
+
 } // namespace hexa
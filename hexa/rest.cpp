@@ -80,6 +80,12 @@ size_t header_func(const char* ptr, size_t size, size_t nmemb, void* user)
     return nmemb;
 }
 
+void set_timeout(CURL* curl, const request& req)
+{
+    if (req.timeout > 0)
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)req.timeout);
+}
+
 } // anonymous namespace
 
 response get(const request& req)
@@ -101,6 +107,7 @@ response get(const request& req)
         curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
     }
     curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str());
+    set_timeout(curl, req);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_func);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&res));
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_func);
@@ -160,6 +167,7 @@ response post(const request& req)
         curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
     }
     curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str());
+    set_timeout(curl, req);
     curl_easy_setopt(curl, CURLOPT_POST, 1L);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)json.size());
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
@@ -215,6 +223,7 @@ response put(const request& req)
         curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
     }
     curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str());
+    set_timeout(curl, req);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)json.size());
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, json.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_func);
@@ -268,6 +277,7 @@ response del(const request& req)
         curl_easy_setopt(curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
     }
     curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str());
+    set_timeout(curl, req);
     curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
 
     auto errcode = curl_easy_perform(curl);
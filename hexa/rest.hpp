@@ -38,26 +38,32 @@ struct request
     std::string password;
     std::string etag;
     boost::property_tree::ptree json;
+    /** Give up after this many milliseconds; zero waits forever. */
+    unsigned int timeout;
 
     request(const std::string& url_)
         : url(url_)
+        , timeout(0)
     {
     }
 
     request(const std::string& url_, const boost::property_tree::ptree& json_)
         : url(url_)
         , json(json_)
+        , timeout(0)
     {
     }
 
     request(const std::string& url_, boost::property_tree::ptree&& json_)
         : url(url_)
         , json(std::move(json_))
+        , timeout(0)
     {
     }
 
     request(const char* url_)
         : url(url_)
+        , timeout(0)
     {
     }
 };
@@ -21,11 +21,14 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <deque>
+#include <iterator>
 #include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #ifdef WIN32
@@ -57,6 +60,23 @@ public:
     serialize_error(const std::string& what) : std::runtime_error(what) { }
 };
 
+/// True if the host stores the most significant byte first, like the
+/// serialized data does.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool host_is_big_endian = true;
+#else
+constexpr bool host_is_big_endian = false;
+#endif
+
+/// Numbers that can be (de)serialized a whole array at a time, by copying
+/// them and fixing the byte order afterwards.
+template <typename t>
+struct is_bulk_serializable
+    : std::integral_constant<bool, std::is_arithmetic<t>::value
+                                       && !std::is_same<t, bool>::value>
+{
+};
+
 /// Convert a 64-bit integer from network to host order.
 inline uint64_t ntohll(uint64_t x)
 {
@@ -103,12 +123,41 @@ public:
     template <class t>
     void write(const t val)
     {
-        size_type pos(write_.size());
-        write_.resize(pos + sizeof(t));
         const value_type* ptr = reinterpret_cast<const value_type*>(&val);
-        std::copy(ptr, ptr + sizeof(t), write_.begin() + pos);
+        write_.insert(write_.end(), ptr, ptr + sizeof(t));
+    }
+
+private:
+    template <class t>
+    void write_array(const std::vector<t>& val, std::false_type)
+    {
+        for (auto& elem : val)
+            (*this)(elem);
+    }
+
+    /// Write an array of numbers in one go.  On a little-endian host the
+    /// bytes of every element are reversed while they're copied.
+    template <class t>
+    void write_array(const std::vector<t>& val, std::true_type)
+    {
+        if (val.empty())
+            return;
+
+        const char* src(reinterpret_cast<const char*>(val.data()));
+        const size_t bytes(val.size() * sizeof(t));
+        if (sizeof(t) == 1 || host_is_big_endian) {
+            write_.insert(write_.end(), src, src + bytes);
+            return;
+        }
+
+        size_type pos(write_.size());
+        write_.resize(pos + bytes);
+        auto dest(write_.begin() + pos);
+        for (const char* i(src); i != src + bytes; i += sizeof(t))
+            dest = std::reverse_copy(i, i + sizeof(t), dest);
     }
 
+public:
     self& operator()(const bool val)
     {
         write_.push_back(uint8_t(val ? 1 : 0));
@@ -187,23 +236,18 @@ public:
     self& operator()(const std::basic_string<char>& val)
     {
         if (val.size() * sizeof(char) > 65535)
-            throw std::runtime_error("string too long");
+            throw serialize_error("string too long");
 
         uint16_t byte_size(val.size() * sizeof(char));
         write(htons(byte_size));
-        if (byte_size > 0) {
-            size_type pos(write_.size());
-            write_.resize(pos + byte_size);
-            const char* ptr(reinterpret_cast<const char*>(&*val.begin()));
-            std::copy(ptr, ptr + byte_size, write_.begin() + pos);
-        }
+        write_.insert(write_.end(), val.begin(), val.end());
         return *this;
     }
 
     self& operator()(const std::vector<char>& val)
     {
         if (val.size() > 65535)
-            throw std::runtime_error("array too long");
+            throw serialize_error("array too long");
 
         uint16_t byte_size(val.size());
         write(htons(byte_size));
@@ -215,10 +259,12 @@ public:
     template <class t>
     self& operator()(const std::vector<t>& val)
     {
+        if (val.size() > 65535)
+            throw serialize_error("array too long");
+
         uint16_t array_size(val.size());
         write(htons(array_size));
-        for (uint16_t i(0); i < array_size; ++i)
-            (*this)(val[i]);
+        write_array(val, is_bulk_serializable<t>());
 
         return *this;
     }
@@ -266,6 +312,9 @@ public:
         return *this;
     }
 
+    /// Does nothing; only the deserializer needs to check this.
+    self& expect(size_t) { return *this; }
+
     template <class t>
     self& raw_data(const t& val, size_t elements)
     {
@@ -334,6 +383,36 @@ class deserializer
         float real;
     } conversion;
 
+    /// This union is used to convert integers to doubles.
+    typedef union
+    {
+        uint64_t integer;
+        double real;
+    } conversion_dbl;
+
+    template <class t>
+    void read_array(std::vector<t>& val, std::false_type)
+    {
+        for (auto& elem : val)
+            (*this)(elem);
+    }
+
+    /// Read an array of numbers in one go; the counterpart of
+    /// serializer::write_array().
+    template <class t>
+    void read_array(std::vector<t>& val, std::true_type)
+    {
+        const size_t bytes(val.size() * sizeof(t));
+        char* dest(reinterpret_cast<char*>(val.data()));
+        if (sizeof(t) == 1 || host_is_big_endian) {
+            std::copy(cursor_, cursor_ + bytes, dest);
+        } else {
+            for (ptr_t i(cursor_); i != cursor_ + bytes; i += sizeof(t))
+                dest = std::reverse_copy(i, i + sizeof(t), dest);
+        }
+        std::advance(cursor_, bytes);
+    }
+
     inline void boundary_check(int size)
     {
         assert(std::distance(cursor_, last_) >= size);
@@ -447,8 +526,9 @@ public:
     self& operator()(double& val)
     {
         boundary_check(8);
-        uint64_t temp(ntohll(*reinterpret_cast<const uint64_t*>(cursor_)));
-        val = *reinterpret_cast<double*>(temp);
+        conversion_dbl c;
+        c.integer = ntohll(*reinterpret_cast<const uint64_t*>(cursor_));
+        val = c.real;
         std::advance(cursor_, 8);
         return *this;
     }
@@ -494,10 +574,11 @@ public:
     {
         uint16_t len;
         (*this)(len);
+        if (is_bulk_serializable<t>::value && bytes_left() < len * sizeof(t))
+            throw serialize_error("end of array reached");
 
         val.resize(len);
-        for (uint16_t i(0); i < len; ++i)
-            (*this)(val[i]);
+        read_array(val, is_bulk_serializable<t>());
 
         return *this;
     }
@@ -553,6 +634,17 @@ public:
         return val.serialize(*this);
     }
 
+    /// Throw a serialize_error if fewer than this many bytes are left.
+    /// Use this before resizing a container to a size that was read
+    /// from the data.
+    self& expect(size_t bytes)
+    {
+        if (bytes_left() < bytes)
+            throw serialize_error("end of data reached");
+
+        return *this;
+    }
+
     template <class t>
     self& raw_data(t& val, size_t elements)
     {
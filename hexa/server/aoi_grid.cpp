@@ -0,0 +1,87 @@
+//---------------------------------------------------------------------------
+// server/aoi_grid.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "aoi_grid.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace hexa
+{
+
+aoi_grid::aoi_grid(uint32_t cell_size)
+    : cell_size_(cell_size)
+{
+    assert(cell_size_ > 0);
+}
+
+void aoi_grid::clear()
+{
+    entities_.clear();
+    cells_.clear();
+}
+
+void aoi_grid::set(uint32_t entity, const world_coordinates& pos)
+{
+    auto c(cell(pos));
+    auto found(entities_.find(entity));
+    if (found == entities_.end()) {
+        entities_[entity] = {pos, c};
+        cells_[c].push_back(entity);
+        return;
+    }
+
+    found->second.pos = pos;
+    if (found->second.cell == c)
+        return;
+
+    remove(entity);
+    entities_[entity] = {pos, c};
+    cells_[c].push_back(entity);
+}
+
+void aoi_grid::remove(uint32_t entity)
+{
+    auto found(entities_.find(entity));
+    if (found == entities_.end())
+        return;
+
+    auto cell_found(cells_.find(found->second.cell));
+    assert(cell_found != cells_.end());
+    auto& list(cell_found->second);
+    list.erase(std::find(list.begin(), list.end(), entity));
+    if (list.empty())
+        cells_.erase(cell_found);
+
+    entities_.erase(found);
+}
+
+bool aoi_grid::find(uint32_t entity, world_coordinates& pos) const
+{
+    auto found(entities_.find(entity));
+    if (found == entities_.end())
+        return false;
+
+    pos = found->second.pos;
+    return true;
+}
+
+} // namespace hexa
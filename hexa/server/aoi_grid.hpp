@@ -0,0 +1,171 @@
+//---------------------------------------------------------------------------
+/// \file   server/aoi_grid.hpp
+/// \brief  Finding the entities around a player.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <hexa/basic_types.hpp>
+
+namespace hexa
+{
+
+/** A uniform grid of entity positions.
+ *  Space is divided in cubic cells, and every cell has a list of the
+ *  entities inside it.  Looking up the entities around a position then
+ *  only has to visit the cells that overlap the search radius. */
+class aoi_grid
+{
+public:
+    /** Constructor.
+     * @param cell_size  The size of a cell, in blocks */
+    aoi_grid(uint32_t cell_size = 32);
+
+    /** Remove all entities. */
+    void clear();
+
+    /** Add an entity, or move it if it was already in the grid. */
+    void set(uint32_t entity, const world_coordinates& pos);
+
+    /** Remove an entity. */
+    void remove(uint32_t entity);
+
+    /** Look up the position of an entity.
+     * @return False if the entity is not in the grid */
+    bool find(uint32_t entity, world_coordinates& pos) const;
+
+    size_t size() const { return entities_.size(); }
+
+    /** Call a function for every entity within a given distance of a
+     ** position.  The function gets the entity ID, its position, and the
+     ** squared distance in blocks. */
+    template <typename Op>
+    void for_each_near(const world_coordinates& center, uint32_t radius,
+                       Op op) const
+    {
+        const int64_t sq_radius(int64_t(radius) * radius);
+        const world_coordinates r(radius, radius, radius);
+        const world_coordinates first(cell(center - r));
+        const world_coordinates last(cell(center + r));
+
+        world_coordinates c;
+        for (c.z = first.z; c.z <= last.z; ++c.z) {
+            for (c.y = first.y; c.y <= last.y; ++c.y) {
+                for (c.x = first.x; c.x <= last.x; ++c.x) {
+                    auto found(cells_.find(c));
+                    if (found == cells_.end())
+                        continue;
+
+                    for (auto e : found->second) {
+                        auto& pos(entities_.at(e).pos);
+                        int64_t d(squared_distance(pos, center));
+                        if (d <= sq_radius)
+                            op(e, pos, d);
+                    }
+                }
+            }
+        }
+    }
+
+    /** The squared distance between two positions, in blocks. */
+    static int64_t squared_distance(const world_coordinates& a,
+                                    const world_coordinates& b)
+    {
+        world_vector d(a - b);
+        return int64_t(d.x) * d.x + int64_t(d.y) * d.y + int64_t(d.z) * d.z;
+    }
+
+private:
+    world_coordinates cell(const world_coordinates& pos) const
+    {
+        return pos / cell_size_;
+    }
+
+    struct entry
+    {
+        world_coordinates pos;
+        world_coordinates cell;
+    };
+
+    uint32_t cell_size_;
+    std::unordered_map<uint32_t, entry> entities_;
+    std::unordered_map<world_coordinates, std::vector<uint32_t>> cells_;
+};
+
+/** The entities a single player is subscribed to.
+ *  A player is subscribed to every entity within a given radius.  Once
+ *  subscribed, an entity has to move a bit further away before the
+ *  subscription ends, so entities near the edge don't keep entering and
+ *  leaving. */
+class aoi_subscription
+{
+public:
+    /** Update the subscriptions for a new player position.
+     * @param grid      All entities
+     * @param center    The position of the player
+     * @param radius    Entities within this distance are added
+     * @param margin    Entities are removed once they're further away
+     *                  than radius + margin, or no longer in the grid
+     * @param on_enter  Called with the ID of every new entity
+     * @param on_leave  Called with the ID of every entity that was
+     *                  removed */
+    template <typename Enter, typename Leave>
+    void update(const aoi_grid& grid, const world_coordinates& center,
+                uint32_t radius, uint32_t margin, Enter on_enter,
+                Leave on_leave)
+    {
+        const int64_t keep(int64_t(radius + margin) * (radius + margin));
+        for (auto i(visible_.begin()); i != visible_.end();) {
+            world_coordinates pos;
+            if (!grid.find(*i, pos)
+                || aoi_grid::squared_distance(pos, center) > keep) {
+                on_leave(*i);
+                i = visible_.erase(i);
+            } else {
+                ++i;
+            }
+        }
+
+        grid.for_each_near(center, radius,
+                           [&](uint32_t e, const world_coordinates&, int64_t) {
+            if (visible_.insert(e).second)
+                on_enter(e);
+        });
+    }
+
+    bool contains(uint32_t entity) const
+    {
+        return visible_.count(entity) != 0;
+    }
+
+    void insert(uint32_t entity) { visible_.insert(entity); }
+
+    bool erase(uint32_t entity) { return visible_.erase(entity) != 0; }
+
+    const std::unordered_set<uint32_t>& entities() const { return visible_; }
+
+private:
+    std::unordered_set<uint32_t> visible_;
+};
+
+} // namespace hexa
@@ -0,0 +1,129 @@
+//---------------------------------------------------------------------------
+// server/authenticator.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "authenticator.hpp"
+
+#include <hexa/base58.hpp>
+#include <hexa/log.hpp>
+
+#include "random.hpp"
+
+namespace hexa
+{
+
+using namespace crypto;
+
+namespace
+{
+
+// ENet keeps addresses in network byte order, so the first byte in memory
+// is the first octet.
+bool is_loopback(uint32_t address)
+{
+    return reinterpret_cast<const uint8_t*>(&address)[0] == 127;
+}
+
+} // anonymous namespace
+
+authenticator::authenticator(const private_key& key, const std::string& url,
+                             bool offline, unsigned int timeout,
+                             fetch_func fetch)
+    : key_(key)
+    , url_(url)
+    , offline_(offline)
+    , timeout_(timeout)
+    , fetch_(std::move(fetch))
+{
+}
+
+login_result authenticator::check(const login_request& req) const
+{
+    login_result result;
+    auto& msg(req.msg);
+
+    try {
+        if (msg.uid.size() != 8 || msg.public_key.size() != 33)
+            throw "No valid UID or public key";
+
+        auto their_pubkey = public_key_from_binary(msg.public_key);
+        if (!crypto::is_valid(their_pubkey))
+            throw "Public key is not valid";
+
+        auto shared_secret = crypto::ecdh(their_pubkey, key_);
+        // The shared secret is too wide for our purposes, use only the
+        // lowest 128 bits.
+        shared_secret.erase(shared_secret.begin() + 16, shared_secret.end());
+
+        if (sha256(concat(shared_secret, req.nonce)) != msg.mac)
+            throw "Could not authenticate player";
+
+        result.key = x_or(shared_secret, req.nonce);
+        result.name = msg.name;
+        result.method = login_type::anonymous_guest;
+
+        if (!req.hashed_id && !(offline_ && is_loopback(req.address))) {
+            // This is a registered user ID, run a few checks first.
+            rest::request get(url_ + base58_encode(msg.uid));
+            get.timeout = timeout_;
+
+            rest::response res;
+            try {
+                res = fetch_(get);
+            } catch (std::exception& e) {
+                log_msg("Authentication server error: %1%", e.what());
+                throw "Authentication server is not available";
+            }
+
+            if (res.status_code == 200) {
+                if (from_json(res.json.get_child("users.pubkey"))
+                    != their_pubkey)
+                    throw "Could not authenticate player";
+
+                result.name = res.json.get("users.username", result.name);
+                result.method = login_type::authenticated;
+            } else if (res.status_code == 404) {
+                throw "Player ID does not exist";
+            }
+        }
+
+        if (result.name.empty()) {
+            auto nr = fnv_hash(req.address) % 1000;
+            result.name = "Guest" + std::to_string(nr);
+            result.method = login_type::anonymous_guest;
+        } else if (result.name.size() > 24) {
+            throw "Player name is too long";
+        } else if (result.method != login_type::authenticated) {
+            result.method = login_type::named_guest;
+        }
+
+        result.uid = *reinterpret_cast<const uint64_t*>(&msg.uid[0]);
+
+    } catch (const char* error) {
+        result.error = error;
+    } catch (std::exception& e) {
+        log_msg("Cannot log in player: %1%", e.what());
+        result.error = "Cannot log in player";
+    }
+
+    return result;
+}
+
+} // namespace hexa
@@ -0,0 +1,107 @@
+//---------------------------------------------------------------------------
+/// \file   server/authenticator.hpp
+/// \brief  Checks the credentials of players that log in.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <hexa/crypto.hpp>
+#include <hexa/protocol.hpp>
+#include <hexa/rest.hpp>
+
+#include "server_entity_system.hpp"
+
+namespace hexa
+{
+
+/** Everything needed to check a multiplayer login. */
+struct login_request
+{
+    /** The login message.  If the player has no ID, it has already been
+     ** filled in. */
+    msg::login msg;
+    /** True if the player ID was made up from the IP address. */
+    bool hashed_id;
+    /** The player's IP address, for naming guests. */
+    uint32_t address;
+    /** The nonce that was sent to the player in the handshake. */
+    crypto::buffer nonce;
+};
+
+/** The outcome of a login check. */
+struct login_result
+{
+    /** Why the player could not log in, or empty if all is well. */
+    std::string error;
+    std::string name;
+    login_type method;
+    uint64_t uid;
+    /** The AES key for the player's connection. */
+    crypto::buffer key;
+
+    login_result()
+        : method(login_type::logged_out)
+        , uid(0)
+    {
+    }
+
+    bool is_ok() const { return error.empty(); }
+};
+
+/** Checks players against their public key and the authentication
+ ** server.
+ *  Both the key agreement and the REST call are slow, so check() is meant
+ *  to be called from a worker thread.  It is safe to call from more than
+ *  one thread at once. */
+class authenticator
+{
+public:
+    /** Does a GET request; rest::get, or a stand-in for testing. */
+    typedef std::function<rest::response(const rest::request&)> fetch_func;
+
+public:
+    /** Constructor.
+     * @param key      The server's private key
+     * @param url      Player IDs are looked up at this URL plus the ID
+     * @param offline  Accept player IDs from the loopback address
+     *                 without looking them up, which disables
+     *                 authentication for local load tests
+     * @param timeout  Milliseconds to wait for the authentication server
+     * @param fetch    Does the GET request */
+    authenticator(const crypto::private_key& key, const std::string& url,
+                  bool offline, unsigned int timeout,
+                  fetch_func fetch = [](const rest::request& r) {
+                      return rest::get(r);
+                  });
+
+    /** Check a player's login. */
+    login_result check(const login_request& req) const;
+
+private:
+    crypto::private_key key_;
+    std::string url_;
+    bool offline_;
+    unsigned int timeout_;
+    fetch_func fetch_;
+};
+
+} // namespace hexa
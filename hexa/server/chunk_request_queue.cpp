@@ -0,0 +1,161 @@
+//---------------------------------------------------------------------------
+// server/chunk_request_queue.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "chunk_request_queue.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <hexa/algorithm.hpp>
+
+namespace hexa
+{
+
+namespace
+{
+
+/** If the player turns less than this (as the cosine of the angle), the
+ ** requests are not sorted again. */
+const float turn_threshold = 0.97f;
+
+} // anonymous namespace
+
+chunk_request_queue::chunk_request_queue(uint32_t max_distance)
+    : max_distance_(max_distance)
+    , have_view_(false)
+    , sorted_(true)
+    , center_(world_chunk_center)
+    , offset_(0.5f, 0.5f, 0.5f)
+    , heading_(0, 1, 0)
+{
+}
+
+void chunk_request_queue::push(const chunk_coordinates& pos,
+                               uint32_t version)
+{
+    auto found(pending_.find(pos));
+    if (found != pending_.end()) {
+        found->second = version;
+        return;
+    }
+
+    if (!have_view_) {
+        pending_.emplace(pos, version);
+        order_.emplace_back(0.f, pos);
+        return;
+    }
+
+    if (manhattan_distance(pos, center_) >= max_distance_)
+        return;
+
+    pending_.emplace(pos, version);
+
+    // While the view stays the same, the costs don't change, so there's
+    // no need to sort everything again.  A new view sorts the lot anyway.
+    entry e(cost(pos), pos);
+    if (sorted_) {
+        order_.insert(std::upper_bound(order_.begin(), order_.end(), e,
+                                       less_urgent),
+                      e);
+    } else {
+        order_.push_back(e);
+    }
+}
+
+bool chunk_request_queue::pop(request& next)
+{
+    sort();
+    if (order_.empty())
+        return false;
+
+    chunk_coordinates pos;
+    if (have_view_) {
+        pos = order_.back().second;
+        order_.pop_back();
+    } else {
+        pos = order_.front().second;
+        order_.pop_front();
+    }
+
+    auto found(pending_.find(pos));
+    assert(found != pending_.end());
+    next.position = pos;
+    next.version = found->second;
+    pending_.erase(found);
+
+    return true;
+}
+
+void chunk_request_queue::set_view(const wfpos& position,
+                                   const yaw_pitch& heading)
+{
+    chunk_coordinates center(position.pos / chunk_size);
+    vector dir(from_spherical(heading));
+
+    if (have_view_ && center == center_
+        && dot_prod(dir, heading_) >= turn_threshold) {
+        return;
+    }
+
+    vector in_chunk(world_vector(position.pos - center * chunk_size));
+    offset_ = (in_chunk + position.frac) / (float)chunk_size;
+    center_ = center;
+    heading_ = dir;
+    have_view_ = true;
+    sorted_ = false;
+}
+
+float chunk_request_queue::cost(const chunk_coordinates& pos) const
+{
+    // From the player's eyes to the middle of the chunk.
+    vector to_chunk(vector(world_vector(pos - center_))
+                    + vector(0.5f, 0.5f, 0.5f) - offset_);
+    float distance(length(to_chunk));
+    if (distance < 1e-3f)
+        return 0.f;
+
+    float facing(dot_prod(to_chunk, heading_) / distance);
+    return distance * (1.5f - 0.5f * facing);
+}
+
+void chunk_request_queue::sort()
+{
+    if (sorted_)
+        return;
+
+    std::vector<entry> temp;
+    temp.reserve(order_.size());
+    for (auto& e : order_) {
+        auto& pos(e.second);
+        if (manhattan_distance(pos, center_) >= max_distance_)
+            pending_.erase(pos);
+        else
+            temp.emplace_back(cost(pos), pos);
+    }
+
+    // Most urgent last, so it can be popped off the back.
+    std::sort(temp.begin(), temp.end(), less_urgent);
+    order_.assign(temp.begin(), temp.end());
+
+    sorted_ = true;
+}
+
+} // namespace hexa
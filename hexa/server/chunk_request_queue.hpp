@@ -0,0 +1,112 @@
+//---------------------------------------------------------------------------
+/// \file   server/chunk_request_queue.hpp
+/// \brief  Terrain requests of a single player, sorted by urgency.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <deque>
+#include <unordered_map>
+#include <utility>
+#include <hexa/basic_types.hpp>
+#include <hexa/wfpos.hpp>
+
+namespace hexa
+{
+
+/** The chunks a player has asked for, but hasn't received yet.
+ *  Requests are handed out closest first, where chunks in front of the
+ *  player count as closer than chunks behind them.  The order is updated
+ *  whenever the player moves to another chunk or turns around, and
+ *  requests that have fallen out of range are dropped.
+ *
+ *  Until the first call to set_view(), requests come out in the order
+ *  they were made. */
+class chunk_request_queue
+{
+public:
+    struct request
+    {
+        chunk_coordinates position;
+        /** The version of the surface the player already has. */
+        uint32_t version;
+    };
+
+public:
+    /** Constructor.
+     * @param max_distance  Requests for chunks at this Manhattan distance
+     *                      from the player or beyond are dropped */
+    chunk_request_queue(uint32_t max_distance = 64);
+
+    /** Add a request.  If the chunk was already requested, only the
+     ** version is updated.
+     *  Once the view is known, the request is put in its place right
+     *  away, or dropped if it is out of range. */
+    void push(const chunk_coordinates& pos, uint32_t version);
+
+    /** Take the most urgent request.
+     * @param next  Receives the request
+     * @return False if there are no requests left that are in range */
+    bool pop(request& next);
+
+    /** Tell the queue where the player is, and where they're looking. */
+    void set_view(const wfpos& position, const yaw_pitch& heading);
+
+    bool empty() const { return pending_.empty(); }
+
+    size_t size() const { return pending_.size(); }
+
+    /** How urgent a request is; lower is more urgent.  This is the
+     ** distance to the chunk in chunks, up to twice as long for chunks
+     ** behind the player. */
+    float cost(const chunk_coordinates& pos) const;
+
+private:
+    /** Drop the requests that are out of range, and sort the rest. */
+    void sort();
+
+    /** A requested position, and its cost at the time it was sorted. */
+    typedef std::pair<float, chunk_coordinates> entry;
+
+    /** The order of order_: most urgent last. */
+    static bool less_urgent(const entry& a, const entry& b)
+    {
+        return a.first > b.first;
+    }
+
+private:
+    uint32_t max_distance_;
+    bool have_view_;
+    bool sorted_;
+    /** The chunk the player is in. */
+    chunk_coordinates center_;
+    /** The player's position relative to the corner of center_, measured
+     ** in chunks. */
+    vector offset_;
+    /** The direction the player is looking in. */
+    vector heading_;
+
+    /** The requested positions.  Once sorted, the most urgent one is at
+     ** the back. */
+    std::deque<entry> order_;
+    /** The requested version of every position in order_. */
+    std::unordered_map<chunk_coordinates, uint32_t> pending_;
+};
+
+} // namespace hexa
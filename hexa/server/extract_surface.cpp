@@ -21,10 +21,9 @@
 
 #include "extract_surface.hpp"
 
+#include <array>
 #include <cassert>
-#include <hexa/voxel_range.hpp>
-
-using namespace boost::range;
+#include <cstdint>
 
 namespace hexa
 {
@@ -32,164 +31,325 @@ namespace hexa
 namespace
 {
 
-std::vector<chunk_index> chunk_outer_shell;
-std::vector<chunk_index> chunk_inner_core;
-}
-
-void init_surface_extraction()
+/** The block types of a chunk, with a border of one block on every side.
+ *  The border is copied from the six neighboring chunks; the blocks at
+ *  the edges and corners are left as air, since extracting the surface
+ *  never needs them.  Core and border blocks are looked up the same way,
+ *  without having to find the chunk they're in first. */
+class padded_blocks
 {
-    chunk_outer_shell.reserve(512 + 448 + 392);
+public:
+    /** The length of the buffer along every axis. */
+    static const int size = chunk_size + 2;
 
-    // +x and -x sides
-    for (int8_t y(0); y < chunk_size; ++y) {
-        for (int8_t z(0); z < chunk_size; ++z) {
-            chunk_outer_shell.push_back({0, y, z});
-            chunk_outer_shell.push_back({chunk_size - 1, y, z});
-        }
+    padded_blocks(const world_subsection_read& terrain);
+
+    /** The position of a block in the buffer.  Every coordinate goes from
+     ** -1 to chunk_size. */
+    static int index(int x, int y, int z)
+    {
+        return (x + 1) + (y + 1) * size + (z + 1) * size * size;
     }
 
-    // +y and -y sides
-    for (int8_t z(0); z < chunk_size; ++z) {
-        for (int8_t x(1); x < chunk_size - 1; ++x) {
-            chunk_outer_shell.push_back({x, 0, z});
-            chunk_outer_shell.push_back({x, chunk_size - 1, z});
-        }
+    static int index(const chunk_index& i) { return index(i.x, i.y, i.z); }
+
+    /** The distance in the buffer between a block and its neighbor. */
+    static int offset(int dir)
+    {
+        const auto& d(dir_vector[dir]);
+        return d.x + d.y * size + d.z * size * size;
+    }
+
+    uint16_t operator[](int i) const { return types_[i]; }
+
+    uint16_t operator()(int x, int y, int z) const
+    {
+        return types_[index(x, y, z)];
     }
 
-    // +z and -z sides
-    for (int8_t y(1); y < chunk_size - 1; ++y) {
-        for (int8_t x(1); x < chunk_size - 1; ++x) {
-            chunk_outer_shell.push_back({x, y, 0});
-            chunk_outer_shell.push_back({x, y, chunk_size - 1});
+private:
+    std::array<uint16_t, size * size * size> types_;
+};
+
+padded_blocks::padded_blocks(const world_subsection_read& terrain)
+{
+    types_.fill(type::air);
+
+    const chunk& center(terrain.get_chunk({0, 0, 0}));
+    auto src(center.begin());
+    for (int z(0); z < chunk_size; ++z) {
+        for (int y(0); y < chunk_size; ++y) {
+            auto dest(types_.begin() + index(0, y, z));
+            for (int x(0); x < chunk_size; ++x, ++src)
+                *dest++ = src->type;
         }
     }
-    std::sort(chunk_outer_shell.begin(), chunk_outer_shell.end());
 
-    chunk_inner_core.reserve(2744);
-    for (int8_t z(1); z < chunk_size - 1; ++z) {
-        for (int8_t y(1); y < chunk_size - 1; ++y) {
-            for (int8_t x(1); x < chunk_size - 1; ++x) {
-                chunk_inner_core.push_back({x, y, z});
-            }
+    // Add the outer layer of the six neighboring chunks.
+    const int last(chunk_size - 1);
+    const chunk& px(terrain.get_chunk({1, 0, 0}));
+    const chunk& mx(terrain.get_chunk({-1, 0, 0}));
+    const chunk& py(terrain.get_chunk({0, 1, 0}));
+    const chunk& my(terrain.get_chunk({0, -1, 0}));
+    const chunk& pz(terrain.get_chunk({0, 0, 1}));
+    const chunk& mz(terrain.get_chunk({0, 0, -1}));
+
+    for (int a(0); a < chunk_size; ++a) {
+        for (int b(0); b < chunk_size; ++b) {
+            // a and b are y and z for the x neighbors, and so on.
+            types_[index(chunk_size, a, b)] = px(0, a, b).type;
+            types_[index(-1, a, b)] = mx(last, a, b).type;
+            types_[index(a, chunk_size, b)] = py(a, 0, b).type;
+            types_[index(a, -1, b)] = my(a, last, b).type;
+            types_[index(a, b, chunk_size)] = pz(a, b, 0).type;
+            types_[index(a, b, -1)] = mz(a, b, last).type;
         }
     }
 }
 
-surface extract_opaque_surface(const world_subsection_read& terrain)
-{
-    assert(!chunk_outer_shell.empty());
-    assert(!chunk_inner_core.empty());
+/** A row of blocks along the x axis, as a bitmask.
+ *  Bit x + 1 stands for the block at x, so there is room for the
+ *  neighboring block on either side of the chunk.  This matches the
+ *  layout of padded_blocks. */
+typedef uint32_t row;
 
-    surface result;
-    result.reserve(256);
+const int rows = padded_blocks::size;
 
-    // Cache the center chunk
-    const chunk& center_chunk(terrain.get_chunk({0, 0, 0}));
+/** A chunk and its direct neighbors, converted to bitmasks.
+ *  There is one row for every y and z coordinate, again with a border of
+ *  one block.  The visible faces of a whole row can then be found by
+ *  comparing it to the rows around it.  Only solid is needed for the
+ *  border; the others are only ever looked at inside the chunk. */
+class chunk_masks
+{
+public:
+    chunk_masks(const padded_blocks& blocks);
+
+    /** Visually solid blocks. */
+    row solid(int y, int z) const { return solid_[z + 1][y + 1]; }
+    /** Blocks that are neither air, transparent, nor custom. */
+    row opaque(int y, int z) const { return opaque_[z + 1][y + 1]; }
+    /** Transparent blocks that are not custom. */
+    row transparent(int y, int z) const { return transparent_[z + 1][y + 1]; }
+    /** Custom blocks. */
+    row custom(int y, int z) const { return custom_[z + 1][y + 1]; }
+
+    /** True if there are any transparent blocks in the chunk. */
+    bool any_transparent() const { return any_transparent_; }
+
+    /** The blocks in a row that have a face in a given direction that
+     ** is not covered by a visually solid block. */
+    row exposed(row blocks, int y, int z, int dir) const
+    {
+        switch (dir) {
+        case 0:
+            return blocks & ~(solid(y, z) >> 1);
+        case 1:
+            return blocks & ~(solid(y, z) << 1);
+        case 2:
+            return blocks & ~solid(y + 1, z);
+        case 3:
+            return blocks & ~solid(y - 1, z);
+        case 4:
+            return blocks & ~solid(y, z + 1);
+        default:
+            return blocks & ~solid(y, z - 1);
+        }
+    }
 
-    for (chunk_index i : chunk_outer_shell) {
-        uint16_t type(center_chunk[i].type);
-        if (type == type::air)
-            continue;
+    /** The blocks in a row with at least one exposed face. */
+    row exposed(row blocks, int y, int z) const
+    {
+        row s(solid(y, z));
+        return blocks & ~((s >> 1) & (s << 1) & solid(y + 1, z)
+                          & solid(y - 1, z) & solid(y, z + 1)
+                          & solid(y, z - 1));
+    }
 
-        if (material_prop[type].is_custom_block()) {
-            result.emplace_back(i, 0x3f, type);
-        } else if (!type::is_transparent(type)) {
-            uint8_t dirs(0);
-            for (uint8_t dir(0); dir < 6; ++dir) {
-                uint16_t other_type(terrain[i + dir_vector[dir]].type);
+private:
+    typedef std::array<std::array<row, rows>, rows> plane;
 
-                if (!type::is_visually_solid(other_type))
-                    dirs += (1 << dir);
-            }
+    plane solid_;
+    plane opaque_;
+    plane transparent_;
+    plane custom_;
+    bool any_transparent_;
+};
 
-            if (dirs != 0)
-                result.emplace_back(i, dirs, type);
+chunk_masks::chunk_masks(const padded_blocks& blocks)
+    : any_transparent_(false)
+{
+    const row inside(((1u << chunk_size) - 1) << 1);
+
+    for (int z(0); z < rows; ++z) {
+        for (int y(0); y < rows; ++y) {
+            row s(0), o(0), t(0), c(0);
+            int i(padded_blocks::index(-1, y - 1, z - 1));
+            for (int x(0); x < rows; ++x, ++i) {
+                uint16_t type(blocks[i]);
+                uint8_t flags(material_flags[type]);
+                row bit(1u << x);
+                row present(type != type::air ? bit : 0);
+
+                s |= (flags & material_flag::visually_solid) ? bit : 0;
+                if (flags & material_flag::custom_model)
+                    c |= present;
+                else if (flags & material_flag::transparent)
+                    t |= present;
+                else
+                    o |= present;
+            }
+            solid_[z][y] = s;
+            opaque_[z][y] = o & inside;
+            transparent_[z][y] = t & inside;
+            custom_[z][y] = c & inside;
         }
     }
 
-    for (chunk_index i : chunk_inner_core) {
-        uint16_t type(center_chunk[i].type);
-        if (type == type::air)
-            continue;
-
-        if (material_prop[type].is_custom_block()) {
-            result.emplace_back(i, 0x3f, type);
-        } else if (!type::is_transparent(type)) {
-            uint8_t dirs(0);
-            for (uint8_t dir(0); dir < 6; ++dir) {
-                uint16_t other_type(center_chunk[i + dir_vector[dir]].type);
+    for (int z(1); z <= chunk_size; ++z) {
+        for (int y(1); y <= chunk_size; ++y)
+            any_transparent_ |= transparent_[z][y] != 0;
+    }
+}
 
-                if (!type::is_visually_solid(other_type))
-                    dirs += (1 << dir);
-            }
+inline int lowest_bit(row r)
+{
+    assert(r != 0);
+#if defined(__GNUC__) && !defined(HEXA_FORCE_SW_BITCOUNT)
+    return __builtin_ctz(r);
+#else
+    int result(0);
+    for (; (r & 1) == 0; r >>= 1)
+        ++result;
+    return result;
+#endif
+}
 
-            if (dirs != 0)
-                result.emplace_back(i, dirs, type);
+/** Call a function for every block in a chunk that has its bit set.
+ *  The blocks on the outside of the chunk come first, followed by the
+ *  ones on the inside.  Both are sorted in the usual order, z first, x
+ *  last.  This is the order the surfaces have always been built in;
+ *  keeping it this way means the light maps that are stored together
+ *  with the surfaces stay valid.
+ * @param mask  Returns the row bitmask for a given y and z
+ * @param op    Called with every chunk_index */
+template <typename Mask, typename Op>
+void for_each_block(Mask mask, Op op)
+{
+    const int last(chunk_size - 1);
+    const row all(((1u << chunk_size) - 1) << 1);
+    const row sides((1u << 1) | (1u << chunk_size));
+
+    auto emit = [&](row bits, int y, int z) {
+        for (; bits; bits &= bits - 1)
+            op(chunk_index(lowest_bit(bits) - 1, y, z));
+    };
+
+    // The outer shell.
+    for (int z(0); z < chunk_size; ++z) {
+        for (int y(0); y < chunk_size; ++y) {
+            bool edge(z == 0 || z == last || y == 0 || y == last);
+            emit(mask(y, z) & (edge ? all : sides), y, z);
         }
     }
 
-    return result;
+    // The inner core.
+    for (int z(1); z < last; ++z) {
+        for (int y(1); y < last; ++y)
+            emit(mask(y, z) & all & ~sides, y, z);
+    }
 }
 
-surface extract_transparent_surface(const world_subsection_read& terrain)
+surface opaque_surface(const padded_blocks& blocks,
+                       const chunk_masks& masks)
 {
-    assert(!chunk_outer_shell.empty());
-    assert(!chunk_inner_core.empty());
-
     surface result;
+    result.reserve(256);
 
-    // Cache the center chunk
-    const chunk& center_chunk(terrain.get_chunk({0, 0, 0}));
-
-    for (chunk_index i : chunk_outer_shell) {
-        uint16_t type(center_chunk[i].type);
-        if (type == type::air)
-            continue;
+    for_each_block(
+        [&](int y, int z) {
+            return masks.custom(y, z)
+                   | masks.exposed(masks.opaque(y, z), y, z);
+        },
+        [&](const chunk_index& i) {
+            uint16_t type(blocks[padded_blocks::index(i)]);
+            row bit(2u << i.x);
+            if (masks.custom(i.y, i.z) & bit) {
+                result.emplace_back(i, 0x3f, type);
+                return;
+            }
+            uint8_t dirs(0);
+            for (int dir(0); dir < 6; ++dir) {
+                if (masks.exposed(bit, i.y, i.z, dir))
+                    dirs |= 1 << dir;
+            }
+            result.emplace_back(i, dirs, type);
+        });
 
-        const auto& m(material_prop[type]);
-        if (!m.is_transparent() || m.is_custom_block())
-            continue;
+    return result;
+}
 
-        uint8_t dirs(0);
-        for (uint8_t dir(0); dir < 6; ++dir) {
-            uint16_t other_type(terrain[i + dir_vector[dir]].type);
+surface transparent_surface(const padded_blocks& blocks,
+                            const chunk_masks& masks)
+{
+    surface result;
+    if (!masks.any_transparent())
+        return result;
+
+    // The bitmasks only rule out the faces that are covered by a solid
+    // block.  Faces between two transparent blocks still need to be
+    // checked one by one.
+    for_each_block(
+        [&](int y, int z) {
+            return masks.exposed(masks.transparent(y, z), y, z);
+        },
+        [&](const chunk_index& i) {
+            int index(padded_blocks::index(i));
+            uint16_t type(blocks[index]);
+            const auto& m(material_prop[type]);
+            row bit(2u << i.x);
 
-            if (type != other_type && !type::is_visually_solid(other_type)
-                && m.textures[dir]
-                   != material_prop[other_type].textures[dir ^ 1]) {
-                dirs += (1 << dir);
+            uint8_t dirs(0);
+            for (int dir(0); dir < 6; ++dir) {
+                if (!masks.exposed(bit, i.y, i.z, dir))
+                    continue;
+
+                uint16_t other_type(
+                    blocks[index + padded_blocks::offset(dir)]);
+                if (type != other_type
+                    && m.textures[dir]
+                       != material_prop[other_type].textures[dir ^ 1]) {
+                    dirs |= 1 << dir;
+                }
             }
-        }
-
-        if (dirs != 0)
-            result.emplace_back(i, dirs, type);
-    }
 
-    for (chunk_index i : chunk_inner_core) {
-        uint16_t type(center_chunk[i].type);
-        if (type == type::air)
-            continue;
+            if (dirs != 0)
+                result.emplace_back(i, dirs, type);
+        });
 
-        const auto& m(material_prop[type]);
-        if (!m.is_transparent() || m.is_custom_block())
-            continue;
+    return result;
+}
 
-        uint8_t dirs(0);
-        for (uint8_t dir(0); dir < 6; ++dir) {
-            uint16_t other_type(center_chunk[i + dir_vector[dir]].type);
+} // anonymous namespace
 
-            if (type != other_type && !type::is_visually_solid(other_type)
-                && m.textures[dir]
-                   != material_prop[other_type].textures[dir ^ 1]) {
-                dirs += (1 << dir);
-            }
-        }
+surface extract_opaque_surface(const world_subsection_read& terrain)
+{
+    padded_blocks blocks(terrain);
+    return opaque_surface(blocks, chunk_masks(blocks));
+}
 
-        if (dirs != 0)
-            result.emplace_back(i, dirs, type);
-    }
+surface extract_transparent_surface(const world_subsection_read& terrain)
+{
+    padded_blocks blocks(terrain);
+    return transparent_surface(blocks, chunk_masks(blocks));
+}
 
-    return result;
+surface_data extract_surface(const world_subsection_read& terrain)
+{
+    padded_blocks blocks(terrain);
+    chunk_masks masks(blocks);
+    return surface_data(opaque_surface(blocks, masks),
+                        transparent_surface(blocks, masks));
 }
 
 } // namespace hexa
@@ -28,9 +28,6 @@
 namespace hexa
 {
 
-/** Initialize the lookup tables. */
-void init_surface_extraction();
-
 /** Find all potentially visible opaque faces in a chunk.
  *  If two solid blocks are right next to each other, the two touching
  *  faces will never be visible.  This function will only return faces
@@ -57,4 +54,13 @@ surface extract_opaque_surface(const world_subsection_read& terrain);
  * @return The potentially visible surface */
 surface extract_transparent_surface(const world_subsection_read& terrain);
 
+/** Find both the opaque and the transparent surface of a chunk.
+ *  This gives the same results as calling extract_opaque_surface() and
+ *  extract_transparent_surface(), but only has to look at the blocks
+ *  once.
+ * @param terrain  The chunk to determine the surface of, with its
+ *                 six immediate neighboring chunks
+ * @return The potentially visible surface */
+surface_data extract_surface(const world_subsection_read& terrain);
+
 } // namespace hexa
@@ -33,6 +33,8 @@
 
 #include "../world.hpp"
 #include "../world_lightmap_access.hpp"
+#include "batch_cast.hpp"
+#include "ray_bundle_cache.hpp"
 
 using namespace boost;
 using namespace boost::property_tree;
@@ -45,11 +47,6 @@ typedef std::array<unsigned int, 3> triangle;
 namespace
 {
 
-float opacity(uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
-
 std::vector<vector> golden_spiral(int count)
 {
     // Based on an implementation by Patrick Boucher.
@@ -73,6 +70,10 @@ std::vector<vector> golden_spiral(int count)
     return result;
 }
 
+// The ray length and the number of rays for every detail level.
+const std::array<std::pair<float, unsigned int>, 3> levels{
+    {{10.f, 10}, {30.f, 40}, {60.f, 100}}};
+
 } // anonymous namespace
 
 ////////////////////////////////////////////////////////////////////////////
@@ -81,9 +82,32 @@ ambient_occlusion_lightmap::ambient_occlusion_lightmap(world& c,
                                                        const ptree& config)
     : lightmap_generator_i(c, config)
 {
-    detail_levels_.emplace_back(precalc(10, 10));
-    detail_levels_.emplace_back(precalc(30, 40));
-    detail_levels_.emplace_back(precalc(60, 100));
+    // Tracing the rays takes a while, so they are kept on disk.  The
+    // key has to change whenever any of the parameters below do.
+    auto file(ray_bundle_cache_file("ambient_occlusion"));
+    std::string key("ambient_occlusion");
+    for (auto& l : levels)
+        key += (format(" %1$.9g:%2%") % l.first % l.second).str();
+
+    if (!load_ray_bundles(file, key, detail_levels_)) {
+        for (auto& l : levels) {
+            auto level(precalc(l.first, l.second));
+            flat_rays compiled;
+            for (int d = 0; d < 6; ++d)
+                compiled[d] = flat_ray_bundle(level[d]);
+
+            detail_levels_.emplace_back(std::move(compiled));
+        }
+        store_ray_bundles(file, key, detail_levels_);
+    }
+
+    for (auto& level : detail_levels_) {
+        aabb<world_vector> reach(world_vector(0, 0, 0));
+        for (auto& r : level)
+            reach = reach + r.reach();
+
+        reach_.emplace_back(reach);
+    }
 }
 
 ambient_occlusion_lightmap::rays
@@ -128,45 +152,6 @@ ambient_occlusion_lightmap::~ambient_occlusion_lightmap()
 {
 }
 
-float ambient_occlusion_lightmap::recurse(const ray_bundle& r, float ray_power,
-                                          const world_coordinates& blk,
-                                          world_lightmap_access& data,
-                                          bool first) const
-{
-    float temp = 0.0f;
-    bool should_recurse = true;
-
-    for (auto& voxel : r.trunk) {
-        auto type = data[blk + voxel].type;
-
-        // If the very first block we traverse is a custom block, we
-        // skip it.
-        if (first) {
-            first = false;
-            if (material_prop[type].is_custom_block())
-                continue;
-        }
-
-        temp += opacity(type);
-        if (temp >= 1.0f) {
-            should_recurse = false;
-            break;
-        }
-    }
-
-    ray_power -= std::min(temp, 1.0f) * r.weight;
-
-    if (ray_power <= 0.01)
-        return 0.0;
-
-    if (should_recurse) {
-        for (auto& s : r.branches)
-            ray_power = recurse(s, ray_power, blk, data, first);
-    }
-
-    return ray_power;
-}
-
 void ambient_occlusion_lightmap::generate(world_lightmap_access& data,
                                                const chunk_coordinates& pos,
                                                const surface& s,
@@ -176,29 +161,46 @@ void ambient_occlusion_lightmap::generate(world_lightmap_access& data,
     assert(phase < detail_levels_.size());
     trace("for %1%", world_vector(pos - world_chunk_center));
 
-    auto lmi = std::begin(lightchunk);
+    // All rays point upwards, so we can stop tracing once they've
+    // reached the open sky.
+    uint32_t sky = data.get_sky_height(pos, reach_[phase]);
+
+    auto opacity_op = [&](const world_coordinates& p, bool first) {
+        auto type = data[p].type;
+
+        // If the very first block we traverse is a custom block, we
+        // skip it.
+        if (first && type::is_custom_block(type))
+            return 0.0f;
+
+        return type::opacity(type);
+    };
+
+    // Sort the faces by direction, so they can be cast in batches.
+    std::array<std::vector<pending_face>, 5> todo;
+    size_t i(0);
     for (faces f : s) {
         world_coordinates blk(pos * chunk_size + f.pos);
 
         for (int d = 0; d < 5; ++d) {
-            if (f[d]) {
-                const ray_bundle& r(detail_levels_[phase][d]);
-                float light_level(recurse(r, r.weight, blk, data));
-
-                light_level *= 1.0f + d * 0.05f;
-                light_level = clamp(light_level, 0.0f, 1.0f);
-                lmi->ambient = light_level * 255.0f + 0.49f;
-                ++lmi;
-            }
+            if (f[d])
+                todo[d].push_back({blk, i++});
         }
 
         // Downward side is always dark.
-        if (f[5]) {
-            lmi->ambient = 0;
-            ++lmi;
-        }
+        if (f[5])
+            lightchunk.data[i++].ambient = 0;
+    }
+    assert(i == lightchunk.size());
+
+    for (int d = 0; d < 5; ++d) {
+        batch_cast(data, detail_levels_[phase][d], todo[d], sky, opacity_op,
+                   [&](size_t idx, float light_level) {
+            light_level *= 1.0f + d * 0.05f;
+            light_level = clamp(light_level, 0.0f, 1.0f);
+            lightchunk.data[idx].ambient = light_level * 255.0f + 0.49f;
+        });
     }
-    assert(lmi == std::end(lightchunk));
     trace("done with %1%", world_vector(pos - world_chunk_center));
 }
 
@@ -37,7 +37,10 @@ class neighborhood;
 class ambient_occlusion_lightmap : public lightmap_generator_i
 {
     typedef std::array<ray_bundle, 6> rays;
-    std::vector<rays> detail_levels_;
+    typedef std::array<flat_ray_bundle, 6> flat_rays;
+    std::vector<flat_rays> detail_levels_;
+    /** The blocks a detail level can reach, relative to the face. */
+    std::vector<aabb<world_vector>> reach_;
 
 public:
     ambient_occlusion_lightmap(world& cache,
@@ -51,12 +54,13 @@ public:
 
     unsigned int phases() const { return 3; }
 
+    aabb<world_vector> reach(unsigned int phase) const override
+    {
+        return reach_[phase];
+    }
+
 private:
     rays precalc(float length, unsigned int count) const;
-
-    float recurse(const ray_bundle& r, float ray_power,
-                  const world_coordinates& blk, world_lightmap_access& data,
-                  bool first = true) const;
 };
 
 } // namespace hexa
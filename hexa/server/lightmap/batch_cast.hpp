@@ -0,0 +1,104 @@
+//---------------------------------------------------------------------------
+/// \file   server/lightmap/batch_cast.hpp
+/// \brief  Cast a ray bundle from many faces, a batch at a time.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/block_types.hpp>
+#include <hexa/ray_batch.hpp>
+#include <hexa/ray_bundle.hpp>
+
+#include "../world_lightmap_access.hpp"
+
+namespace hexa
+{
+
+/** A face that still has to be lit. */
+struct pending_face
+{
+    /** The position of the block. */
+    world_coordinates pos;
+    /** The index of the face in the light map. */
+    size_t index;
+};
+
+/** Cast a ray bundle from a list of faces, using ray_batch.
+ *  The voxel buffer of \a data must have been set up for the bundle's
+ *  reach; faces that lie outside of it fall back to
+ *  flat_ray_bundle::cast().  Only the chunks that the rays of a face can
+ *  get to are loaded, and the ones that haven't been generated yet are
+ *  treated as air.
+ * @param data   The world
+ * @param r      The ray bundle
+ * @param faces  The faces to light
+ * @param sky    Every voxel at this z-coordinate or above is clear
+ * @param op     The opacity function, as used by flat_ray_bundle::cast().
+ *               The batches only use it for the first voxel of a ray.
+ * @param out    Called with the light map index and the remaining light
+ *               of every face */
+template <typename Op, typename Out>
+void batch_cast(world_lightmap_access& data, const flat_ray_bundle& r,
+                const std::vector<pending_face>& faces, uint32_t sky, Op op,
+                Out out)
+{
+    if (faces.empty())
+        return;
+
+    const int width(ray_batch::width);
+    auto& buf(data.buffer());
+    ray_batch batch(r, buf.stride_y(), buf.stride_z());
+    const ray_batch::volume vol{buf.light_mask(), buf.types(),
+                                material_opacity.data()};
+
+    int32_t index[width];
+    uint32_t z[width];
+    float first[width], result[width];
+    size_t lm[width];
+    int count(0);
+
+    auto flush = [&] {
+        batch.cast(vol, index, z, sky, first, count, result);
+        for (int l(0); l < count; ++l)
+            out(lm[l], result[l]);
+
+        count = 0;
+    };
+
+    for (auto& f : faces) {
+        if (!buf.contains(f.pos)) {
+            out(f.index, r.cast(f.pos, sky, op));
+            continue;
+        }
+        data.load_buffer(f.pos, r.reach());
+        index[count] = buf.index(f.pos);
+        z[count] = f.pos.z;
+        first[count] = op(f.pos + batch.first_voxel(), true);
+        lm[count] = f.index;
+        if (++count == width)
+            flush();
+    }
+    if (count > 0)
+        flush();
+}
+
+} // namespace hexa
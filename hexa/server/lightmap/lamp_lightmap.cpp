@@ -23,6 +23,7 @@
 
 #include <algorithm>
 #include <array>
+#include <unordered_map>
 #include <unordered_set>
 #include <iostream>
 
@@ -44,16 +45,6 @@ using namespace boost::property_tree;
 namespace hexa
 {
 
-namespace
-{
-
-float opacity(uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
-
-} // anonymous namespace
-
 ////////////////////////////////////////////////////////////////////////////
 
 lamp_lightmap::lamp_lightmap(world& c, const ptree& conf)
@@ -67,23 +58,80 @@ lamp_lightmap::~lamp_lightmap()
 
 struct lamp
 {
-    lamp(vector p, float s)
+    lamp(vector p, float s, uint32_t n)
         : pos(p + vector(0.5, 0.5, 0.5))
         , str(s)
+        , id(n)
     {
     }
 
     vector pos;
     float str;
+    /** Numbers the lamps of a job, for the occlusion cache. */
+    uint32_t id;
+};
+
+/** All lamps in one of the surrounding chunks. */
+struct lamp_bucket
+{
+    lamp_bucket(vector corner)
+        : first(corner)
+        , second(corner + vector(chunk_size, chunk_size, chunk_size))
+        , max_str(0.0f)
+    {
+    }
+
+    vector first, second;
+    float max_str;
+    std::vector<lamp> lamps;
 };
 
+namespace
+{
+
+// Lamps never get brighter than this multiplier allows.
+const float boost = 6.0f;
+
+// A lamp that adds less than this doesn't make a visible difference in
+// the light map, which only has 8 bits per channel.
+const float cutoff = 0.25f / 255.0f;
+
+/** The squared distance beyond which a lamp of a given strength adds
+ ** less than the cutoff to a face. */
+float squared_radius(float strength)
+{
+    return strength * boost / cutoff;
+}
+
+/** Squared distance between a point and a box. */
+float box_distance(const vector& p, const lamp_bucket& b)
+{
+    float result(0.0f);
+    for (int i(0); i < 3; ++i) {
+        float d(std::max(std::max(b.first[i] - p[i], p[i] - b.second[i]),
+                         0.0f));
+        result += d * d;
+    }
+    return result;
+}
+
+/** Check if a box lies completely behind a plane. */
+bool behind(const vector& p, const vector& normal, const lamp_bucket& b)
+{
+    vector farthest;
+    for (int i(0); i < 3; ++i)
+        farthest[i] = normal[i] > 0 ? b.second[i] : b.first[i];
+
+    return dot_prod(farthest - p, normal) <= 0;
+}
+
+} // anonymous namespace
+
 void lamp_lightmap::generate(world_lightmap_access& data,
                                   const chunk_coordinates& pos,
                                   const surface& s, lightmap_hr& lightchunk,
                                   unsigned int phase) const
 {
-    static const float boost = 6.0f;
-
     if (s.empty())
         return;
 
@@ -94,35 +142,50 @@ void lamp_lightmap::generate(world_lightmap_access& data,
     // chunk we're making a lightmap for (a 5x5x5 Moore neighborhood).
     // Put all the block types in a flat array (we'll need to access them
     // quite often, this speeds up the traversal) and place the point light
-    // sources.
+    // sources.  The lamps are kept in one bucket per chunk, so whole
+    // chunks of lamps can be skipped at once if they're out of range or
+    // behind a face.
     //
-    std::vector<lamp> lamps;
+    std::vector<lamp_bucket> buckets;
+    uint32_t lamp_count(0);
     chunk_base<block, chunk_size * 5> nbh;
     for (auto i : cube_range<block_vector>(2)) {
         auto& cp(data.get_surface(pos + i));
 
         block_vector origin(i * chunk_size + no);
-        for (auto& face : cp.opaque) {
+        lamp_bucket bucket(vector(i * chunk_size));
+        auto add = [&](const faces& face) {
             block_vector pos(origin + face.pos);
             nbh[pos] = face.type;
 
-            uint8_t strength(material_prop[face.type].light_emission);
-            if (strength)
-                lamps.push_back(lamp(pos - no, strength / 255.f));
-        }
-        for (auto& face : cp.transparent) {
-            block_vector pos(origin + face.pos);
-            nbh[face.pos] = face.type;
+            uint8_t strength(type::light_emission(face.type));
+            if (strength) {
+                bucket.lamps.emplace_back(pos - no, strength / 255.f,
+                                          lamp_count++);
+                bucket.max_str = std::max(bucket.max_str, strength / 255.f);
+            }
+        };
 
-            uint8_t strength(material_prop[face.type].light_emission);
-            if (strength)
-                lamps.push_back(lamp(pos - no, strength / 255.f));
-        }
+        for (auto& face : cp.opaque)
+            add(face);
+
+        for (auto& face : cp.transparent)
+            add(face);
+
+        if (!bucket.lamps.empty())
+            buckets.emplace_back(std::move(bucket));
     }
 
-    if (lamps.empty())
+    if (buckets.empty())
         return;
 
+    // Every face sends its rays from the middle of the block in front of
+    // it.  Faces that look out into the same block share that starting
+    // point, so the occlusion between it and a lamp is only traced once.
+    // The key is the lamp's id and the block's index in nbh.
+    const uint64_t nbh_volume(nbh.volume());
+    std::unordered_map<uint64_t, float> occlusion;
+
     auto lmi(std::begin(lightchunk));
     for (const faces& f : s) {
         for (int d = 0; d < 6; ++d) {
@@ -131,37 +194,66 @@ void lamp_lightmap::generate(world_lightmap_access& data,
 
             vector normal = dir_vector[d];
             vector o = vector{f.pos} + half + (normal * 0.51f);
+            vector3<int> front(vector3<int>(f.pos) + dir_vector[d] + no);
+            vector start(vector(front - no) + half);
+            uint64_t front_idx(front.x + front.y * nbh.length()
+                               + front.z * nbh.area());
 
             float light_level = 0.0f;
 
-            for (auto& lamp : lamps) {
-                const vector& lp = lamp.pos;
-                auto ilp = floor(lp);
-
-                if (ilp == f.pos) {
-                    light_level = 1;
-                    break;
+            for (auto& bucket : buckets) {
+                // The center chunk is never culled; it can hold a lamp
+                // in the face's own block.
+                bool center(bucket.first == vector(0, 0, 0));
+                if (!center
+                    && (box_distance(o, bucket)
+                            > squared_radius(bucket.max_str)
+                        || behind(o, normal, bucket))) {
+                    continue;
                 }
 
-                float weight = lamp.str * dot_prod(normalize(lp - o), normal)
-                              / squared_distance(lp, o);
-                if (weight <= 0)
-                    continue;
+                for (auto& lamp : bucket.lamps) {
+                    const vector& lp = lamp.pos;
+                    auto ilp = floor(lp);
 
-                float power(1.0f);
-                // Follow the line from the middle of the face to the lamp.
-                // Stop right before the lamp block is found.  Decrease the
-                // light power for every block that is not completely
-                // transparent.
-                voxel_raycast(o, lp, [&](vector3<int> rv) {
-                    return rv == ilp || (power -= opacity(nbh[rv + no])) <= 0;
-                });
-
-                if (power > 0) {
-                    light_level += power * weight * boost;
-                    if (light_level >= 1)
+                    if (ilp == f.pos) {
+                        light_level = 1;
                         break;
+                    }
+
+                    vector to_lamp(lp - o);
+                    float dist_sq(squared_length(to_lamp));
+                    if (dist_sq > squared_radius(lamp.str)
+                        || dot_prod(to_lamp, normal) <= 0) {
+                        continue;
+                    }
+
+                    float weight = lamp.str * dot_prod(normalize(to_lamp),
+                                                       normal) / dist_sq;
+
+                    auto cached(occlusion.emplace(
+                        lamp.id * nbh_volume + front_idx, 1.0f));
+                    float& power(cached.first->second);
+                    if (cached.second) {
+                        // Follow the line from the block in front of the
+                        // face to the lamp.  Stop right before the lamp
+                        // block is found.  Decrease the light power for
+                        // every block that is not completely transparent.
+                        voxel_raycast(start, lp, [&](vector3<int> rv) {
+                            return rv == ilp
+                                   || (power -= type::opacity(nbh[rv + no]))
+                                          <= 0;
+                        });
+                    }
+
+                    if (power > 0) {
+                        light_level += power * weight * boost;
+                        if (light_level >= 1)
+                            break;
+                    }
                 }
+                if (light_level >= 1)
+                    break;
             }
 
             light_level = clamp(light_level, 0.0f, 1.0f);
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <boost/property_tree/ptree.hpp>
+#include <hexa/aabb.hpp>
 #include <hexa/basic_types.hpp>
 #include <hexa/lightmap.hpp>
 #include <hexa/surface.hpp>
@@ -66,6 +67,16 @@ public:
      *  function should return the number of phases this generator supports. */
     virtual unsigned int phases() const { return 1; }
 
+    /** The blocks this generator looks up through world_lightmap_access,
+     ** relative to a block in the chunk.
+     *  This is used to set up the voxel buffer in world_lightmap_access.
+     *  Generators that fetch their data in another way can leave this
+     *  as it is. */
+    virtual aabb<world_vector> reach(unsigned int phase) const
+    {
+        return aabb<world_vector>(world_vector(0, 0, 0));
+    }
+
 protected:
     /** The game world. */
     world& cache_;
@@ -78,6 +78,7 @@ void radiosity_lightmap::generate(world_lightmap_access& data,
     std::array<float, 6> irr_sun, irr_ambient, irr_artificial;
     vector half {0.5f, 0.5f, 0.5f};
     auto lmi = std::begin(lightchunk);
+    surface_index index (s);
     for (const faces& f : s)
     {
         fill(irr_sun, 0.f);
@@ -90,11 +91,11 @@ void radiosity_lightmap::generate(world_lightmap_access& data,
             if (sp == f.pos)
                 continue;
 
-            auto found (find(s, sp));
-            if (found == s.end())
+            auto found (index.find(sp));
+            if (found == surface_index::not_found)
                 continue;
 
-            auto& other (*found);
+            auto& other (s[found]);
             for (int i = 0; i < 6; ++i)
             {
                 if (!f[i])
@@ -119,8 +120,7 @@ void radiosity_lightmap::generate(world_lightmap_access& data,
 
                     float intensity = dp1 * dp2 / squared_length(conn);
 
-                    auto dist = std::distance(std::begin(s), found);
-                    auto& olm = lightchunk.data[dist];
+                    auto& olm = lightchunk.data[index.find(other.pos, j)];
 
                     irr_sun[i] += olm.sunlight * intensity;
                     irr_ambient[i] += olm.ambient * intensity;
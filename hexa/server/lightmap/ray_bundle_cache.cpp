@@ -0,0 +1,142 @@
+//---------------------------------------------------------------------------
+// server/lightmap/ray_bundle_cache.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "ray_bundle_cache.hpp"
+
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+
+#include <hexa/algorithm.hpp>
+#include <hexa/log.hpp>
+#include <hexa/os.hpp>
+#include <hexa/serialize.hpp>
+#include <hexa/voxel_algorithm.hpp>
+
+#include "../random.hpp"
+
+namespace fs = boost::filesystem;
+
+namespace hexa
+{
+
+namespace
+{
+
+// A fingerprint of the code that traces, compiles, and stores the rays.
+// A small, fixed bundle is put through all three steps; if any of them
+// changes in a way that affects the result, so does the fingerprint, and
+// the old cache files are ignored.
+uint32_t code_fingerprint()
+{
+    ray_bundle probe;
+    vector origin(0.5f, 0.5f, 0.5f);
+    for (auto& dir : {vector(3.3f, -1.7f, 9.1f), vector(-6.2f, 2.9f, 4.4f),
+                      vector(0.4f, 7.3f, 2.6f)})
+        probe.add(voxel_raycast(origin, origin + dir), dir.z);
+
+    probe.normalize_weight();
+
+    flat_ray_bundle compiled(probe);
+    auto buf(serialize(compiled));
+    return fnv_hash(buf.data(), buf.size());
+}
+
+} // anonymous namespace
+
+fs::path ray_bundle_cache_file(const std::string& name)
+{
+    return app_user_dir() / "cache" / (name + ".rays");
+}
+
+bool load_ray_bundles(const fs::path& file, const std::string& key,
+                      std::vector<flat_ray_set>& levels)
+{
+    if (!fs::exists(file))
+        return false;
+
+    try {
+        auto data(file_contents(file));
+        std::vector<char> buf(data.begin(), data.end());
+        auto ar(make_deserializer(buf));
+
+        uint32_t fingerprint, count;
+        std::string stored_key;
+        ar(fingerprint);
+        if (fingerprint != code_fingerprint())
+            return false;
+
+        ar(stored_key);
+        if (stored_key != key)
+            return false;
+
+        // Every bundle takes at least two counts and a bounding box.
+        ar(count).expect(size_t(count) * 6 * 32);
+        // Not using the std::array overload of the deserializer here; it
+        // expects at least sizeof(flat_ray_bundle) bytes per element.
+        std::vector<flat_ray_set> result(count);
+        for (auto& level : result) {
+            for (auto& r : level) {
+                ar(r);
+                if (!r.is_valid())
+                    throw std::runtime_error("corrupt ray bundle");
+            }
+        }
+
+        levels = std::move(result);
+        return true;
+    } catch (std::exception& e) {
+        log_msg("Cannot read ray cache %1%: %2%", file.string(), e.what());
+    }
+    return false;
+}
+
+void store_ray_bundles(const fs::path& file, const std::string& key,
+                       const std::vector<flat_ray_set>& levels)
+{
+    std::vector<char> buf;
+    auto ar(make_serializer(buf));
+    ar(code_fingerprint())(key)(uint32_t(levels.size()));
+    for (auto& level : levels) {
+        for (auto& r : level)
+            ar(r);
+    }
+
+    try {
+        if (file.has_parent_path())
+            fs::create_directories(file.parent_path());
+
+        // Write to a temporary file first, so other servers starting at
+        // the same time never see a half-written cache.
+        fs::path temp(file);
+        temp += fs::unique_path(".%%%%-%%%%");
+        {
+            std::ofstream str(temp.string(), std::ios::binary);
+            str.write(buf.data(), buf.size());
+            if (!str)
+                throw std::runtime_error("write failed");
+        }
+        fs::rename(temp, file);
+    } catch (std::exception& e) {
+        log_msg("Cannot write ray cache %1%: %2%", file.string(), e.what());
+    }
+}
+
+} // namespace hexa
@@ -0,0 +1,65 @@
+//---------------------------------------------------------------------------
+/// \file   server/lightmap/ray_bundle_cache.hpp
+/// \brief  Keep precomputed ray bundles on disk between server runs.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+#include <hexa/ray_bundle.hpp>
+
+namespace hexa
+{
+
+/** One flat ray bundle for every face direction. */
+typedef std::array<flat_ray_bundle, 6> flat_ray_set;
+
+/** The file a light generator's ray bundles are cached in.
+ *  These live in the "cache" directory under app_user_dir().
+ * @param name  Name of the light generator, e.g. "sun" */
+boost::filesystem::path ray_bundle_cache_file(const std::string& name);
+
+/** Load cached ray bundles.
+ *  The file also records the key it was stored with.  If that doesn't
+ *  match, if the code that traces and stores the rays has changed since
+ *  the file was written, or if a bundle in it doesn't pass
+ *  flat_ray_bundle::is_valid(), the file is ignored.
+ * @param file    The cache file
+ * @param key     Describes all parameters that went into the bundles
+ * @param levels  The bundles are put in here
+ * @return True if the cache could be used */
+bool load_ray_bundles(const boost::filesystem::path& file,
+                      const std::string& key,
+                      std::vector<flat_ray_set>& levels);
+
+/** Store ray bundles in a cache file.
+ *  Errors are only logged; the server can run without a cache.
+ * @param file    The cache file
+ * @param key     Describes all parameters that went into the bundles
+ * @param levels  The bundles to store */
+void store_ray_bundles(const boost::filesystem::path& file,
+                       const std::string& key,
+                       const std::vector<flat_ray_set>& levels);
+
+} // namespace hexa
@@ -23,13 +23,17 @@
 
 #include <algorithm>
 #include <array>
+#include <boost/format.hpp>
 
 #include <hexa/voxel_algorithm.hpp>
 #include <hexa/voxel_range.hpp>
 #include <hexa/trace.hpp>
 
 #include "../world.hpp"
+#include "../sky_heightmap.hpp"
 #include "../world_lightmap_access.hpp"
+#include "batch_cast.hpp"
+#include "ray_bundle_cache.hpp"
 
 using namespace boost::property_tree;
 
@@ -41,10 +45,8 @@ typedef std::array<unsigned int, 3> triangle;
 namespace
 {
 
-float opacity(uint16_t t)
-{
-    return 1.0f - (material_prop[t].transparency / 255.f);
-}
+// The length of the rays for every detail level.
+const std::array<float, 3> ray_lengths{{10.f, 60.f, 200.f}};
 
 } // anonymous namespace
 
@@ -55,9 +57,33 @@ sun_lightmap::sun_lightmap(world& c, const ptree& conf)
     , direction_(-0.4f, 0.75f)
     , radius_(3.0f * 0.01745f)
 {
-    detail_levels_.emplace_back(generate(10, 0));
-    detail_levels_.emplace_back(generate(60, 1));
-    detail_levels_.emplace_back(generate(200, 2));
+    // Tracing the rays takes a while, so they are kept on disk.  The
+    // key has to change whenever any of the parameters below do.
+    auto file(ray_bundle_cache_file("sun"));
+    std::string key((boost::format("sun %.9g %.9g %.9g") % direction_.x
+                     % direction_.y % radius_).str());
+    for (auto len : ray_lengths)
+        key += (boost::format(" %.9g") % len).str();
+
+    if (!load_ray_bundles(file, key, detail_levels_)) {
+        for (size_t i(0); i < ray_lengths.size(); ++i) {
+            auto level(generate(ray_lengths[i], i));
+            flat_rays compiled;
+            for (int d(0); d < 6; ++d)
+                compiled[d] = flat_ray_bundle(level[d]);
+
+            detail_levels_.emplace_back(std::move(compiled));
+        }
+        store_ray_bundles(file, key, detail_levels_);
+    }
+
+    for (auto& level : detail_levels_) {
+        aabb<world_vector> reach(world_vector(0, 0, 0));
+        for (auto& r : level)
+            reach = reach + r.reach();
+
+        reach_.emplace_back(reach);
+    }
 }
 
 sun_lightmap::~sun_lightmap()
@@ -122,43 +148,6 @@ sun_lightmap::rays sun_lightmap::generate(float raylen, size_t count) const
     return result;
 }
 
-float sun_lightmap::recurse(const ray_bundle& r, float ray_power,
-                            const world_coordinates& blk,
-                            world_lightmap_access& data, bool first) const
-{
-    float temp(0.0f);
-    bool should_recurse(true);
-    for (auto& voxel : r.trunk) {
-        auto type(data[blk + voxel].type);
-
-        // If the very first block we traverse is a custom block, we
-        // skip it.
-        if (first) {
-            first = false;
-            if (material_prop[type].is_custom_block())
-                continue;
-        }
-
-        temp += opacity(type);
-        if (temp >= 1.0f) {
-            should_recurse = false;
-            break;
-        }
-    }
-
-    ray_power -= std::min(temp, 1.0f) * r.weight;
-
-    if (ray_power <= 0.01)
-        return 0.0;
-
-    if (should_recurse) {
-        for (auto& s : r.branches)
-            ray_power = recurse(s, ray_power, blk, data, first);
-    }
-
-    return ray_power;
-}
-
 void sun_lightmap::generate(world_lightmap_access& data,
                                  const chunk_coordinates& pos,
                                  const surface& s, lightmap_hr &lightchunk,
@@ -167,8 +156,34 @@ void sun_lightmap::generate(world_lightmap_access& data,
     trace((boost::format("for %1%") % world_vector(pos - world_chunk_center))
               .str());
 
-    auto lmi = std::begin(lightchunk);
+    // Find the height above which every ray in this chunk only travels
+    // through open sky.  Rays are cut off there.
+    uint32_t sky(data.get_sky_height(pos, reach_[phase]));
+
+    // The same, for every block column on its own.  In uneven terrain,
+    // this lets a lot more faces skip the ray casting.
+    auto open_sky(data.get_sky_heights(pos, reach_[phase]));
 
+    auto opacity_op = [&](const world_coordinates& p, bool first) {
+        auto type(data[p].type);
+
+        // If the very first block we traverse is a custom block, we
+        // skip it.
+        if (first && type::is_custom_block(type))
+            return 0.0f;
+
+        return type::opacity(type);
+    };
+
+    auto store = [&](size_t i, float light_level) {
+        lightchunk.data[i].sunlight = clamp(light_level, 0.0f, 1.0f) * 255.0f
+                                      + 0.49f;
+    };
+
+    // Faces that are fully exposed are done right away, the rest are
+    // sorted by direction and cast in batches.
+    std::array<std::vector<pending_face>, 6> todo;
+    size_t i(0);
     for (faces f : s) {
         world_coordinates blk = pos * chunk_size + f.pos;
 
@@ -176,13 +191,20 @@ void sun_lightmap::generate(world_lightmap_access& data,
             if (!f[d])
                 continue;
 
-            const ray_bundle& r = detail_levels_[phase][d];
-            float light_level = recurse(r, r.weight, blk, data);
-            lmi->sunlight = clamp(light_level, 0.0f, 1.0f) * 255.0f + 0.49f;
-            ++lmi;
+            const flat_ray_bundle& r = detail_levels_[phase][d];
+            if (blk.z + r.reach().first.z >= open_sky(f.pos.x, f.pos.y))
+                store(i, r.weight() <= 0.01 ? 0.0f : r.weight());
+            else
+                todo[d].push_back({blk, i});
+
+            ++i;
         }
     }
-    assert(lmi == std::end(lightchunk));
+    assert(i == lightchunk.size());
+
+    for (int d(0); d < 6; ++d)
+        batch_cast(data, detail_levels_[phase][d], todo[d], sky, opacity_op,
+                   store);
     trace((boost::format("done with %1%")
            % world_vector(pos - world_chunk_center)).str());
 
@@ -39,7 +39,10 @@ class neighborhood;
 class sun_lightmap : public lightmap_generator_i
 {
     typedef std::array<ray_bundle, 6> rays;
-    std::vector<rays> detail_levels_;
+    typedef std::array<flat_ray_bundle, 6> flat_rays;
+    std::vector<flat_rays> detail_levels_;
+    /** The blocks a detail level can reach, relative to the face. */
+    std::vector<aabb<world_vector>> reach_;
 
 public:
     sun_lightmap(world& cache, const boost::property_tree::ptree& conf);
@@ -52,13 +55,15 @@ public:
 
     unsigned int phases() const override { return 3; }
 
+    aabb<world_vector> reach(unsigned int phase) const override
+    {
+        return reach_[phase];
+    }
+
 private:
     void add(rays& r, float length, yaw_pitch dir) const;
     rays generate(float len, size_t count) const;
 
-    float recurse(const ray_bundle& r, float ray_power,
-                  const world_coordinates& blk, world_lightmap_access& data,
-                  bool first = true) const;
 
 private:
     yaw_pitch direction_;
@@ -668,7 +668,7 @@ void lua::define_material(uint16_t mat_id, const object& specs)
         return;
 
     material_definitions[mat_id] = specs;
-    material& data(register_new_material(mat_id));
+    material data(register_new_material(mat_id));
 
     for (luabind::iterator i(specs), end; i != end; ++i) {
         std::string key = object_cast<std::string>(i.key());
@@ -769,6 +769,8 @@ void lua::define_material(uint16_t mat_id, const object& specs)
             cb_on_remove[mat_id] = *i;
         }
     }
+
+    register_new_material(mat_id, std::move(data));
 }
 
 int lua::define_component(const std::string& name, int type)
@@ -56,7 +56,6 @@
 #include <hexa/log.hpp>
 
 #include "clock.hpp"
-#include "extract_surface.hpp"
 #include "globals.hpp"
 #include "init_terrain_generators.hpp"
 #include "lua.hpp"
@@ -65,6 +64,7 @@
 #include "opencl.hpp"
 #include "server_entity_system.hpp"
 #include "server_registration.hpp"
+#include "tick_scheduler.hpp"
 #include "udp_server.hpp"
 #include "world.hpp"
 
@@ -86,47 +86,43 @@ static std::string default_db_path()
 
 std::atomic<bool> lolquit(false);
 
-void physics(server_entity_system& s, world& w)
+void physics(server_entity_system& s, world& w, tick_profile& profile,
+             tick_scheduler::clock::duration interval)
 {
-    using namespace std::chrono;
+    enum { motion, collision, friction };
+
+    // After a stall, catch up on at most five ticks; the world would
+    // otherwise keep lagging behind while the steps pile up.
+    tick_scheduler ticks(interval, 5);
+    const double step(boost::chrono::duration<double>(interval).count());
 
-    milliseconds tick(50);
-    auto last_tick(steady_clock::now());
     while (!lolquit.load()) {
-        std::this_thread::sleep_for(tick);
-        auto current_time(steady_clock::now());
-        auto delta_tick(current_time - last_tick);
-        last_tick = current_time;
-        double delta(duration_cast<microseconds>(delta_tick).count() * 1.0e-6);
-
-        {
-            auto read_world(w.acquire_read_access());
-            auto write_lock(s.acquire_write_lock());
-            while (delta > 0) {
-                constexpr double max_step = 0.05;
-                double step;
-                if (delta > max_step) {
-                    step = max_step;
-                    delta -= max_step;
-                } else if (delta < 0.001) {
-                    break;
-                } else {
-                    step = delta;
-                    delta = 0;
-                }
-                system_gravity(s, step);
-                system_walk(s, step);
-                system_motion(s, step);
-                system_terrain_collision(
-                    s, [&](chunk_coordinates c)
-                           -> boost::optional<const surface_data&> {
-                           return read_world.get_surface(c);
-                       },
-                    [&](chunk_coordinates c) {
-                        return read_world.is_air_chunk(c);
-                    });
-                system_terrain_friction(s, step);
-            }
+        auto skipped_before(ticks.skipped());
+        unsigned int count(ticks.wait());
+        profile.add_skipped(ticks.skipped() - skipped_before);
+
+        auto read_world(w.acquire_read_access());
+        auto write_lock(s.acquire_write_lock());
+        for (unsigned int i(0); i < count; ++i) {
+            auto timer(profile.start());
+            system_gravity(s, step);
+            system_walk(s, step);
+            system_motion(s, step);
+            timer.lap(motion);
+
+            system_terrain_collision(
+                s, [&](chunk_coordinates c)
+                       -> boost::optional<const surface_data&> {
+                       return read_world.get_surface(c);
+                   },
+                [&](chunk_coordinates c) {
+                    return read_world.is_air_chunk(c);
+                });
+            timer.lap(collision);
+
+            system_terrain_friction(s, step);
+            timer.lap(friction);
+            timer.finish();
         }
     }
 }
@@ -168,37 +164,54 @@ int main(int argc, char* argv[])
     setup_minidump("hexahedra-server");
     auto& vm(global_settings);
 
+    // clang-format off
     po::options_description generic("Command line options");
-    generic.add_options()("version,v",
-                          "print version string")("help", "show help message");
+    generic.add_options()
+        ("version,v", "print version string")
+        ("help", "show help message");
 
     po::options_description config("Configuration");
-    config.add_options()(
-        "mode", po::value<std::string>()->default_value("multiplayer"),
-        "server game mode")("max-players",
-                            po::value<unsigned int>()->default_value(10),
-                            "maximum number of players")(
-        "port", po::value<unsigned short>()->default_value(15556),
-        "server port number")("server-name",
-                              po::value<std::string>()->default_value("Foo"),
-                              "server name")(
-        "hostname", po::value<std::string>()->default_value(""),
-        "publish server info with this domain name instead of my IP address")(
-        "register",
-        po::value<std::string>()->implicit_value(DEFAULT_AUTH_URL),
-        "register on a master server")(
-        "passphrase", "generate the private key from a passphrase")(
-        "uid", po::value<std::string>()->default_value("nobody"),
-        "drop to this user id after initialising the server")(
-        "chroot", po::value<std::string>()->default_value(""),
-        "chroot to this path after initialising the server")(
-        "datadir", po::value<std::string>()->default_value(GAME_DATA_PATH),
-        "the data directory")(
-        "dbdir", po::value<std::string>()->default_value(default_db_path()),
-        "the server database directory")(
-        "game", po::value<std::string>()->default_value("defaultgame"),
-        "which game to start")("log", po::value<bool>()->default_value(true),
-                               "log debug info to file")("console", "Start a command-line administration console");
+    config.add_options()
+        ("mode", po::value<std::string>()->default_value("multiplayer"),
+         "server game mode")
+        ("max-players", po::value<unsigned int>()->default_value(10),
+         "maximum number of players")
+        ("port", po::value<unsigned short>()->default_value(15556),
+         "server port number")
+        ("server-name", po::value<std::string>()->default_value("Foo"),
+         "server name")
+        ("hostname", po::value<std::string>()->default_value(""),
+         "publish server info with this domain name instead of my IP address")
+        ("register",
+         po::value<std::string>()->implicit_value(DEFAULT_AUTH_URL),
+         "register on a master server")
+        ("passphrase", "generate the private key from a passphrase")
+        ("uid", po::value<std::string>()->default_value("nobody"),
+         "drop to this user id after initialising the server")
+        ("chroot", po::value<std::string>()->default_value(""),
+         "chroot to this path after initialising the server")
+        ("datadir", po::value<std::string>()->default_value(GAME_DATA_PATH),
+         "the data directory")
+        ("dbdir", po::value<std::string>()->default_value(default_db_path()),
+         "the server database directory")
+        ("game", po::value<std::string>()->default_value("defaultgame"),
+         "which game to start")
+        ("progressive-lighting", po::value<bool>()->default_value(true),
+         "send a quick light map first, and refine it later")
+        ("net-budget", po::value<unsigned int>()->default_value(5),
+         "milliseconds spent handling incoming packets in one go")
+        ("peer-bandwidth", po::value<unsigned int>()->default_value(256),
+         "maximum upload speed per player, in kB/s")
+        ("aoi-radius", po::value<unsigned int>()->default_value(160),
+         "players get updates about entities within this many blocks")
+        ("tick-rate", po::value<unsigned int>()->default_value(20),
+         "physics updates per second")
+        ("offline-auth", "disable authentication for players connecting "
+                         "from localhost (for load tests)")
+        ("log", po::value<bool>()->default_value(true),
+         "log debug info to file")
+        ("console", "Start a command-line administration console");
+    // clang-format on
 
     po::options_description cmdline;
     cmdline.add(generic).add(config);
@@ -321,8 +334,6 @@ int main(int argc, char* argv[])
         // Start the game clock
         clock::init();
 
-        init_surface_extraction();
-
         // Set up the game world
         // hexa::network::connections_t players;
         fs::path db_file{dbdir / "world.leveldb"};
@@ -333,9 +344,15 @@ int main(int argc, char* argv[])
         persistence_leveldb db_per(db_file);
         hexa::server_entity_system entities;
         hexa::world world(db_per);
+        world.set_progressive_lighting(vm["progressive-lighting"].as<bool>());
         hexa::lua scripting(entities, world);
         hexa::network server(vm["port"].as<unsigned short>(), world, entities,
                              scripting);
+        server.set_poll_budget(
+            boost::chrono::milliseconds(vm["net-budget"].as<unsigned int>()));
+        auto bandwidth(vm["peer-bandwidth"].as<unsigned int>() * 1024);
+        server.set_bandwidth(bandwidth, bandwidth / 4);
+        server.set_aoi_radius(vm["aoi-radius"].as<unsigned int>());
 
         scripting.uglyhack(&server);
 
@@ -362,9 +379,18 @@ int main(int argc, char* argv[])
         log_msg("Read entity database");
         db_per.retrieve(entities);
 
+        tick_scheduler::clock::duration tick_interval(
+            boost::chrono::microseconds(
+                1000000 / std::max(1u, vm["tick-rate"].as<unsigned int>())));
+        tick_profile physics_profile("physics", tick_interval,
+                                     {"motion", "collision", "friction"});
+        server.watch(physics_profile);
+
         std::thread gameloop(
             [&] { server.run(get_server_private_key(), server_id); });
-        std::thread physics_thread([&] { physics(entities, world); });
+        std::thread physics_thread([&] {
+            physics(entities, world, physics_profile, tick_interval);
+        });
         log_msg("All systems go");
 
         if (vm.count("console")) {
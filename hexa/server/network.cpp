@@ -21,6 +21,8 @@
 
 #include "network.hpp"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
 #include <iostream>
 #include <map>
@@ -76,6 +78,63 @@ message_t make(const packet& p)
     return new_msg;
 }
 
+/** Serialize a message that goes out to several connections. */
+template <class message_t>
+shared_payload share_packet(message_t& m)
+{
+    return std::make_shared<const binary_data>(serialize_packet(m));
+}
+
+/** Terrain within this Manhattan distance (in chunks) from a player goes
+ ** out with a higher priority than terrain further away. */
+const uint32_t near_terrain_distance = 6;
+
+/** The number of requested chunks that can be generated for a single
+ ** player at the same time. */
+const unsigned int max_generating = 4;
+
+/** Terrain requests are held back while there are more than this many
+ ** bytes waiting to be sent to a player.  As long as they are not sent,
+ ** they can still be sorted again when the player moves. */
+const size_t stream_backlog = 32 * 1024;
+
+/** Entities have to be this many blocks beyond the AOI radius before a
+ ** player stops receiving updates about them. */
+const uint32_t aoi_margin = 16;
+
+/** The number of unacknowledged entity snapshots the server remembers
+ ** per player.  Acknowledgements for older ones are ignored. */
+const size_t snapshot_history = 64;
+
+/** How long a surface can wait for others to be bundled with. */
+const milliseconds surface_batch_window(20);
+
+/** A player's surfaces are sent right away once this many are waiting. */
+const size_t surface_batch_max = 32;
+
+/** The largest surface_batch the server will make, in bytes.  ENet
+ ** splits it into fragments that fit in the MTU. */
+const size_t surface_batch_budget = 16 * 1024;
+
+/** A pass through the network loop that takes longer than this counts
+ ** as an overrun. */
+const milliseconds loop_budget(50);
+
+/** How often the tick profiles are checked for overruns. */
+const seconds profile_interval(60);
+
+/** The number of threads that check logins.  They spend most of their
+ ** time waiting for the authentication server. */
+const size_t login_threads = 4;
+
+/** How long to wait for the authentication server, in milliseconds. */
+const unsigned int auth_timeout = 5000;
+
+/** Players are kicked if their login hasn't been checked by then.  This
+ ** is longer than auth_timeout, because after a restart the logins can
+ ** pile up in the queue. */
+const seconds login_timeout(15);
+
 } // anonymous namespace
 
 //---------------------------------------------------------------------------
@@ -86,8 +145,16 @@ network::network(uint16_t port, world& w, server_entity_system& entities,
     , world_(w)
     , es_(entities)
     , lua_(scripting)
+    , auth_workers_(login_threads)
+    , login_tickets_(0)
+    , poll_budget_(milliseconds(5))
+    , profile_("network", loop_budget,
+               {"packets", "replication", "cleanup", "jobs", "terrain"})
+    , aoi_radius_(160)
     , running_(false)
 {
+    watched_.push_back(&profile_);
+
     world_.on_update_surface.connect(
         [&](chunk_coordinates pos) { on_update_surface(pos); });
 
@@ -117,13 +184,25 @@ void network::run(const crypto::private_key& privkey,
 
     log_msg("Network running, server ID %1% on %2%", base58_encode(my_id_), auth_url_);
 
+    auth_.reset(new authenticator(
+        my_private_key_, "https://" + auth_url_ + "/api/1/users/",
+        global_settings.count("offline-auth") > 0, auth_timeout));
+
     running_.store(true);
-    int count(0);
-    // auto last_tick (steady_clock::now());
-    // auto started (last_tick);
+    tick_scheduler physics_updates(milliseconds(200));
+    tick_scheduler entity_updates(milliseconds(900));
+    tick_scheduler cache_cleanup(seconds(2));
+    tick_scheduler profile_check(profile_interval);
+
+    enum { packets, replication, cleanup, run_jobs, terrain };
 
     while (true) {
-        poll(1);
+        // Lua scripts are called from the packet handlers, so they are
+        // timed as part of the first phase.
+        auto timer(profile_.start());
+        poll(1, poll_budget_);
+        timer.lap(packets);
+        auto now(steady_clock::now());
         /*
                 auto current_time (steady_clock::now());
                 auto delta (current_time - last_tick);
@@ -153,29 +232,10 @@ void network::run(const crypto::private_key& privkey,
         }
 */
         // Send changes in the entity system
-        ++count;
-        // count = total_seconds * 20;
-        if (count % 200 == 0) {
-            // trace("network tick");
-
-            msg::entity_update_physics msg;
-            auto lock(es_.acquire_read_lock());
-
-            es_.for_each<wfpos, vector>(
-                entity_system::c_position, entity_system::c_velocity,
-                [&](es::storage::iterator i, wfpos& p_, vector& v_) {
-                    msg.updates.emplace_back(i->first, p_, v_);
-                    return false;
-                });
-
-            auto n(clock::now());
-            for (auto& c : connections_) {
-                msg.timestamp = n - conn_info_[c.second].clock_offset;
-                send(c.second, serialize_packet(msg), msg.method());
-            }
-        }
+        if (physics_updates.due(now))
+            replicate_entities();
 
-        if (count % 899 == 0) {
+        if (entity_updates.due(now)) {
             auto lock(es_.acquire_read_lock());
             for (auto i(es_.begin()); i != es_.end(); ++i) {
                 if (es_.check_dirty(i)) {
@@ -192,15 +252,17 @@ void network::run(const crypto::private_key& privkey,
                     auto conn(connections_.find(i->first));
                     if (conn != connections_.end())
                         send(conn->first, serialize_packet(upd_msg),
-                             upd_msg.method());
+                             upd_msg.method(), send_priority::entity);
                 }
             }
         }
+        timer.lap(replication);
 
         // Flush caches every now and then
-        if (count % 2077 == 0) {
+        if (cache_cleanup.due(now)) {
             world_.cleanup();
         }
+        timer.lap(cleanup);
 
         while (!jobs.empty()) {
             auto job(jobs.pop());
@@ -213,21 +275,187 @@ void network::run(const crypto::private_key& privkey,
                 return;
 
             case job::lightmap:
+                send_lightmap(job.pos);
                 break;
 
             case job::surface_and_lightmap:
                 send_surface(job.pos, job.dest);
                 break;
 
+            case job::requested_surface: {
+                auto found(conn_info_.find(job.dest));
+                if (found == conn_info_.end())
+                    break;
+
+                if (found->second.generating > 0)
+                    --found->second.generating;
+
+                send_surface(job.pos, job.dest);
+                break;
+            }
+
             case job::entity_info:
                 break;
             }
 
             trace("network job finished");
         }
+
+        finished_login done;
+        while (finished_logins_.try_pop(done)) {
+            try {
+                finish_login(done);
+            } catch (std::exception& e) {
+                log_msg("Could not log in player: %1%", e.what());
+                kick_player(done.conn, "Cannot log in player");
+            }
+        }
+        expire_logins(now);
+        timer.lap(run_jobs);
+
+        stream_terrain();
+        flush_surfaces(steady_clock::now());
+        timer.lap(terrain);
+        timer.finish();
+
+        if (profile_check.due(now)) {
+            for (auto p : watched_) {
+                if (p->fell_behind())
+                    log_msg("Falling behind: %1%", p->report(true));
+                else
+                    p->reset();
+            }
+        }
+    }
+}
+
+void network::replicate_entities()
+{
+    auto lock(es_.acquire_read_lock());
+
+    aoi_.clear();
+    es_.for_each<wfpos>(entity_system::c_position,
+                        [&](es::storage::iterator i, wfpos& p_) {
+        aoi_.set(i->first, p_.int_pos());
+        return false;
+    });
+
+    std::unordered_map<uint32_t, msg::entity_update_physics::value> moving;
+    es_.for_each<wfpos, vector>(
+        entity_system::c_position, entity_system::c_velocity,
+        [&](es::storage::iterator i, wfpos& p_, vector& v_) {
+            moving[i->first] = {i->first, p_, v_};
+            return false;
+        });
+
+    auto introduce = [&](uint32_t e, msg::entity_update& upd) {
+        auto found(moving.find(e));
+        msg::entity_update::value rec;
+        rec.entity_id = e;
+        rec.component_id = entity_system::c_boundingbox;
+        rec.data = serialize_c(vector(0.4f, 0.4f, 1.7f));
+        upd.updates.push_back(rec);
+        rec.component_id = entity_system::c_position;
+        rec.data = serialize_c(es_.get<wfpos>(e, entity_system::c_position));
+        upd.updates.push_back(rec);
+        rec.component_id = entity_system::c_velocity;
+        rec.data = serialize_c(found != moving.end() ? found->second.velocity
+                                                     : vector(0, 0, 0));
+        upd.updates.push_back(rec);
+    };
+
+    auto n(clock::now());
+    for (auto& c : connections_) {
+        auto& info(conn_info_[c.second]);
+        world_coordinates center;
+        if (!aoi_.find(c.first, center))
+            continue;
+
+        msg::entity_update enter;
+        info.visible.update(aoi_, center, aoi_radius_, aoi_margin,
+                            [&](uint32_t e) {
+            introduce(e, enter);
+            info.acked_motion.erase(e);
+            info.unacked_motion.erase(e);
+        },
+                            [&](uint32_t e) {
+            msg::entity_delete leave;
+            leave.entity_id = e;
+            send(c.second, serialize_packet(leave), leave.method(),
+                 send_priority::entity);
+            info.acked_motion.erase(e);
+            info.unacked_motion.erase(e);
+        });
+
+        if (!enter.updates.empty()) {
+            send(c.second, serialize_packet(enter), enter.method(),
+                 send_priority::entity);
+        }
+
+        if (msg::supports_entity_snapshots(info.protocol_version)) {
+            send_snapshot(c.second, center, moving);
+            continue;
+        }
+
+        msg::entity_update_physics msg;
+        for (auto e : info.visible.entities()) {
+            auto found(moving.find(e));
+            if (found != moving.end())
+                msg.updates.push_back(found->second);
+        }
+        if (msg.updates.empty())
+            continue;
+
+        msg.timestamp = n - info.clock_offset;
+        send(c.second, serialize_packet(msg), msg.method(),
+             send_priority::entity);
     }
 }
 
+void network::send_snapshot(
+    ENetPeer* conn, const world_coordinates& center,
+    const std::unordered_map<uint32_t, msg::entity_update_physics::value>&
+        moving)
+{
+    auto& info(conn_info_[conn]);
+
+    // Snapshots are unreliable.  An entity is sent if it differs from
+    // what the player has acknowledged, and also if it was part of a
+    // snapshot that may have been lost, even if it has moved back since.
+    std::vector<quantized_motion> changed;
+    for (auto e : info.visible.entities()) {
+        auto found(moving.find(e));
+        if (found == moving.end())
+            continue;
+
+        auto& upd(found->second);
+        auto q(quantize(e, upd.pos, upd.velocity));
+        auto acked(info.acked_motion.find(e));
+        if (acked != info.acked_motion.end() && acked->second == q
+            && info.unacked_motion.count(e) == 0) {
+            continue;
+        }
+        changed.push_back(q);
+    }
+    if (changed.empty())
+        return;
+
+    uint32_t seq(info.next_snapshot++);
+    for (auto& q : changed)
+        info.unacked_motion[q.entity] = seq;
+
+    msg::entity_snapshot msg;
+    msg.sequence = seq;
+    msg.timestamp = clock::now() - info.clock_offset;
+    msg.base = center >> cnkshift;
+    msg.entities = encode_snapshot(msg.base, changed);
+    send(conn, serialize_packet(msg), msg.method(), send_priority::entity);
+
+    info.unacked_snapshots.push_back({seq, std::move(changed)});
+    if (info.unacked_snapshots.size() > snapshot_history)
+        info.unacked_snapshots.pop_front();
+}
+
 void network::stop()
 {
     jobs.push({job::quit, chunk_coordinates(), nullptr});
@@ -243,21 +471,39 @@ void network::on_connect(ENetPeer* c)
     }
     log_msg("New connection.");
     conn_info_[c].clock_offset = clock::now();
+    conn_info_[c].generating = 0;
+    conn_info_[c].next_snapshot = 0;
+    conn_info_[c].login_pending = false;
 }
 
 void network::on_disconnect(ENetPeer* c)
 {
-    auto& info = conn_info_[c];
-    log_msg("Disconnect player %1%", info.entity);
-    deactivate_player(info.entity);
-    connections_.erase(info.entity);
-    conn_info_.erase(c);
+    auto found = conn_info_.find(c);
+    if (found == conn_info_.end())
+        return;
+
+    auto entity = found->second.entity;
+    conn_info_.erase(found);
+
+    // Connections that never got as far as logging in have no entity.
+    auto player = connections_.find(entity);
+    if (player == connections_.end() || player->second != c) {
+        log_msg("Connection closed before logging in");
+        return;
+    }
 
+    log_msg("Disconnect player %1%", entity);
+    deactivate_player(entity);
+    connections_.erase(player);
+
+    // Only the players that could see it need to know it's gone.
     msg::entity_delete msg;
-    msg.entity_id = info.entity;
-    auto packet = serialize_packet(msg);
-    for (auto& conn : connections_)
-        send(conn.second, packet, msg.method());
+    msg.entity_id = entity;
+    auto packet = share_packet(msg);
+    for (auto& conn : connections_) {
+        if (conn_info_[conn.second].visible.erase(entity))
+            send(conn.second, packet, msg.method(), send_priority::entity);
+    }
 }
 
 void network::on_receive(ENetPeer* c, packet p)
@@ -313,6 +559,9 @@ void network::on_receive(ENetPeer* c, packet p)
         case msg::console::msg_id:
             console(info);
             break;
+        case msg::snapshot_ack::msg_id:
+            snapshot_ack(info);
+            break;
 
         default:
             unknown(info);
@@ -326,44 +575,60 @@ void network::on_receive(ENetPeer* c, packet p)
 }
 
 void network::send_encrypted(ENetPeer* dest, const binary_data& msg,
-                             msg::reliability method) const
+                             msg::reliability method,
+                             send_priority prio) const
+{
+    send_encrypted(dest, std::make_shared<const binary_data>(msg), method,
+                   prio);
+}
+
+shared_payload network::encrypt_for(ENetPeer* dest,
+                                    const shared_payload& payload) const
 {
     auto found_info = conn_info_.find(dest);
     if (found_info == conn_info_.end()
         || !found_info->second.cipher.is_ready()) {
-        // No encryption required, send straight away.
-        send(dest, msg, method);
-    } else {
-        // Encrypt it before sending.
-        auto& info = found_info->second;
-        binary_data encrypt(msg.size() + 5);
-        encrypt[0] = 0xff;
-        uint32_t timer = clock::client_time(info.clock_offset);
-        *(reinterpret_cast<uint32_t*>(&encrypt[1])) = timer;
-
-        crypto::buffer iv = info.iv;
-        *reinterpret_cast<uint32_t*>(&iv[0]) ^= timer;
-
-        info.cipher.encrypt(iv, &msg[0], msg.size(), &encrypt[5]);
-        send(dest, encrypt, method);
+        // No encryption required.
+        return payload;
     }
+
+    auto& msg = *payload;
+    auto& info = found_info->second;
+    binary_data encrypt(msg.size() + 5);
+    encrypt[0] = 0xff;
+    uint32_t timer = clock::client_time(info.clock_offset);
+    *(reinterpret_cast<uint32_t*>(&encrypt[1])) = timer;
+
+    crypto::buffer iv = info.iv;
+    *reinterpret_cast<uint32_t*>(&iv[0]) ^= timer;
+
+    info.cipher.encrypt(iv, &msg[0], msg.size(), &encrypt[5]);
+    return std::make_shared<const binary_data>(std::move(encrypt));
+}
+
+void network::send_encrypted(ENetPeer* dest, const shared_payload& payload,
+                             msg::reliability method,
+                             send_priority prio) const
+{
+    send(dest, encrypt_for(dest, payload), method, prio);
 }
 
 bool network::send(uint32_t entity, const binary_data& msg,
-                   msg::reliability method) const
+                   msg::reliability method, send_priority prio) const
 {
     auto found = connections_.find(entity);
     bool have_connection = (found != connections_.end());
     if (have_connection)
-        send_encrypted(found->second, msg, method);
+        send_encrypted(found->second, msg, method, prio);
 
     return have_connection;
 }
 
 void network::broadcast(const binary_data& msg, msg::reliability method) const
 {
+    auto payload(std::make_shared<const binary_data>(msg));
     for (auto& conn : connections_)
-        send_encrypted(conn.second, msg, method);
+        send_encrypted(conn.second, payload, method);
 }
 
 template <typename type>
@@ -380,19 +645,56 @@ void network::send_surface(const chunk_coordinates& cpos)
 
     msg::surface_update reply;
     reply.position = cpos;
-    reply.terrain = proxy.get_compressed_surface(cpos);
     reply.light = proxy.get_compressed_lightmap(cpos);
-    assert(count_faces(unpack_as<surface_data>(proxy.get_compressed_surface(cpos)).opaque) == unpack_as<light_data>(proxy.get_compressed_lightmap(cpos)).opaque.size());
-    assert(count_faces(unpack_as<surface_data>(proxy.get_compressed_surface(cpos)).transparent) == unpack_as<light_data>(proxy.get_compressed_lightmap(cpos)).transparent.size());
+    assert(count_faces(proxy.get_surface(cpos).opaque) == unpack_as<light_data>(reply.light).opaque.size());
+    assert(count_faces(proxy.get_surface(cpos).transparent) == unpack_as<light_data>(reply.light).transparent.size());
 
+    // Build the packet once for every surface encoding that is needed.
+    std::array<shared_payload, 2> packets;
     for (auto& conn : connections_) {
-        auto plr_pos = es_.get<wfpos>(conn.first, entity_system::c_position);
-        auto dist = manhattan_distance(cpos, plr_pos.pos / chunk_size);
-        if (dist < 64)
-            send(conn.second, serialize_packet(reply), reply.method());
+        if (!in_range(conn.first, cpos))
+            continue;
+
+        auto enc(surface_encoding_for(conn.second));
+        auto& packet(packets[static_cast<size_t>(enc)]);
+        if (!packet) {
+            reply.terrain = proxy.get_compressed_surface(cpos, enc);
+            packet = share_packet(reply);
+        }
+        send(conn.second, packet, reply.method(),
+             terrain_priority(conn.second, cpos), {cpos});
+
+        auto info(conn_info_.find(conn.second));
+        if (info != conn_info_.end())
+            info->second.sent_surfaces.insert(cpos);
     }
 }
 
+send_priority network::terrain_priority(ENetPeer* conn,
+                                        const chunk_coordinates& pos) const
+{
+    auto found(conn_info_.find(conn));
+    if (found == conn_info_.end()
+        || connections_.count(found->second.entity) == 0)
+        return send_priority::far_terrain;
+
+    auto plr_pos = es_.get<wfpos>(found->second.entity,
+                                  entity_system::c_position);
+    return manhattan_distance(pos, plr_pos.pos / chunk_size)
+                   <= near_terrain_distance
+               ? send_priority::near_terrain
+               : send_priority::far_terrain;
+}
+
+surface_encoding network::surface_encoding_for(ENetPeer* conn) const
+{
+    auto found(conn_info_.find(conn));
+    if (found == conn_info_.end())
+        return surface_encoding::face_list;
+
+    return msg::surface_encoding_for(found->second.protocol_version);
+}
+
 void network::send_surface_queue(const chunk_coordinates& cpos, ENetPeer* dest)
 {
     trace("new job: surface %1%", world_vector(cpos - world_chunk_center));
@@ -401,20 +703,163 @@ void network::send_surface_queue(const chunk_coordinates& cpos, ENetPeer* dest)
 
 void network::send_surface(const chunk_coordinates& cpos, ENetPeer* dest)
 {
+    auto found(conn_info_.find(dest));
+    if (found != conn_info_.end()
+        && msg::supports_surface_batches(found->second.protocol_version)) {
+        auto& pending(found->second.pending_surfaces);
+        if (std::find(pending.begin(), pending.end(), cpos) != pending.end())
+            return;
+
+        trace("bundle surface %1%", world_vector(cpos - world_chunk_center));
+        if (pending.empty())
+            found->second.pending_since = steady_clock::now();
+
+        pending.push_back(cpos);
+        return;
+    }
+
     trace("send surface %1%", world_vector(cpos - world_chunk_center));
     auto proxy = world_.acquire_read_access();
 
     msg::surface_update reply;
     reply.position = cpos;
-    reply.terrain = proxy.get_compressed_surface(cpos);
+    reply.terrain
+        = proxy.get_compressed_surface(cpos, surface_encoding_for(dest));
     reply.light = proxy.get_compressed_lightmap(cpos);
     assert(count_faces(proxy.get_surface(cpos).opaque) == proxy.get_lightmap(cpos).opaque.size());
     assert(count_faces(proxy.get_surface(cpos).transparent) == proxy.get_lightmap(cpos).transparent.size());
 
-    send(dest, serialize_packet(reply), reply.method());
+    send(dest, serialize_packet(reply), reply.method(),
+         terrain_priority(dest, cpos), {cpos});
+    if (found != conn_info_.end())
+        found->second.sent_surfaces.insert(cpos);
+
+    if (!proxy.is_lightmap_final(cpos))
+        refine_lightmap(cpos);
+
     trace("send surface %1% done", world_vector(cpos - world_chunk_center));
 }
 
+void network::flush_surfaces(steady_clock::time_point now)
+{
+    for (auto& c : conn_info_) {
+        auto& info(c.second);
+        if (!info.pending_surfaces.empty()
+            && (info.pending_surfaces.size() >= surface_batch_max
+                || now - info.pending_since >= surface_batch_window)) {
+            send_surface_batches(c.first);
+        }
+    }
+}
+
+void network::send_surface_batches(ENetPeer* dest)
+{
+    auto& info(conn_info_[dest]);
+    auto& pending(info.pending_surfaces);
+    auto enc(surface_encoding_for(dest));
+    auto proxy = world_.acquire_read_access();
+
+    msg::surface_batch batch;
+    size_t bytes(0);
+    send_priority prio(send_priority::far_terrain);
+
+    auto flush = [&] {
+        if (batch.surfaces.empty())
+            return;
+
+        std::vector<chunk_coordinates> chunks;
+        for (auto& rec : batch.surfaces)
+            chunks.push_back(rec.position);
+
+        send(dest, serialize_packet(batch), batch.method(), prio,
+             std::move(chunks));
+        batch.surfaces.clear();
+        bytes = 0;
+        prio = send_priority::far_terrain;
+    };
+
+    for (auto& cpos : pending) {
+        msg::surface_batch::record rec;
+        rec.position = cpos;
+        rec.terrain = proxy.get_compressed_surface(cpos, enc);
+        rec.light = proxy.get_compressed_lightmap(cpos);
+
+        size_t size(rec.terrain.buf.size() + rec.light.buf.size() + 20);
+        if (bytes + size > surface_batch_budget)
+            flush();
+
+        bytes += size;
+        prio = std::min(prio, terrain_priority(dest, cpos));
+        batch.surfaces.emplace_back(std::move(rec));
+        info.sent_surfaces.insert(cpos);
+
+        if (!proxy.is_lightmap_final(cpos))
+            refine_lightmap(cpos);
+    }
+    flush();
+
+    trace("sent %1% bundled surfaces", pending.size());
+    pending.clear();
+}
+
+void network::send_lightmap(const chunk_coordinates& cpos)
+{
+    trace("broadcast lightmap %1%", world_vector(cpos - world_chunk_center));
+    auto proxy = world_.acquire_read_access();
+
+    msg::lightmap_update reply;
+    reply.position = cpos;
+    reply.data = proxy.get_compressed_lightmap(cpos);
+    auto packet = share_packet(reply);
+
+    // Only players that already got the surface can use the light map.
+    // Those that are still waiting for it will get the new light map
+    // along with the surface.
+    bool anyone(false);
+    for (auto& conn : connections_) {
+        auto info(conn_info_.find(conn.second));
+        if (info == conn_info_.end())
+            continue;
+
+        auto& sent(info->second.sent_surfaces);
+        if (!in_range(conn.first, cpos)) {
+            sent.erase(cpos);
+            continue;
+        }
+        if (sent.count(cpos) == 0)
+            continue;
+
+        send(conn.second, packet, reply.method(),
+             terrain_priority(conn.second, cpos), {cpos});
+        anyone = true;
+    }
+
+    // Only keep going if someone is still around to see it.  If not, the
+    // next player to request this chunk will restart the refinement.
+    refining_.erase(cpos);
+    if (anyone && !proxy.is_lightmap_final(cpos))
+        refine_lightmap(cpos);
+}
+
+void network::refine_lightmap(const chunk_coordinates& cpos)
+{
+    if (!refining_.insert(cpos).second)
+        return;
+
+    // Every phase is a separate low priority job, so requests for new
+    // terrain can go first.
+    workers_.enqueue_idle([=] {
+        world_.acquire_read_access().refine_lightmap(cpos);
+        jobs.push({job::lightmap, cpos, nullptr});
+    });
+}
+
+bool network::in_range(uint32_t entity, const chunk_coordinates& cpos) const
+{
+    auto plr_pos = es_.get<wfpos>(entity, entity_system::c_position);
+    return manhattan_distance(cpos, plr_pos.pos / chunk_size) < 64;
+}
+
 void network::send_coarse_height(chunk_coordinates pos)
 {
     trace("broadcast heightmap %1%",
@@ -423,8 +868,10 @@ void network::send_coarse_height(chunk_coordinates pos)
     msg::heightmap_update heights;
     heights.data.emplace_back(pos, pos.z);
 
+    auto packet = share_packet(heights);
     for (auto& conn : connections_) {
-        send(conn.second, serialize_packet(heights), heights.method());
+        send(conn.second, packet, heights.method(),
+             send_priority::near_terrain);
     }
     trace("broadcast heightmap %1% done",
           map_rel_coordinates(pos - map_chunk_center));
@@ -439,7 +886,8 @@ void network::send_height(const map_coordinates& cpos, ENetPeer* dest)
     trace("send height %1%", map_rel_coordinates(cpos - map_chunk_center));
     msg::heightmap_update heights;
     heights.data.emplace_back(cpos, height);
-    send(dest, serialize_packet(heights), heights.method());
+    send(dest, serialize_packet(heights), heights.method(),
+         send_priority::near_terrain);
 }
 
 void network::kick_player(ENetPeer* dest, const std::string& kickmsg)
@@ -447,8 +895,10 @@ void network::kick_player(ENetPeer* dest, const std::string& kickmsg)
     log_msg("Kick player: %1%", kickmsg);
     msg::kick reply;
     reply.reason = kickmsg;
-    send_encrypted(dest, serialize_packet(reply), reply.method());
-    disconnect(dest);
+
+    // The send queue of this connection is about to be thrown away, so
+    // the kick message has to bypass it.
+    disconnect(dest, encrypt_for(dest, share_packet(reply)));
     on_disconnect(dest);
 }
 
@@ -462,16 +912,21 @@ void network::knock(packet_info& info)
         return;
     }
 
-    if (msg.minimum_version > 1) {
-        kick_player(info.conn, "Server only supports protocol version 1");
-        conn_info_.erase(info.conn);
-        disconnect(info.conn);
+    if (msg.minimum_version > msg::current_protocol_version
+        || msg.maximum_version < msg::oldest_protocol_version) {
+        kick_player(info.conn,
+                    (boost::format("Server only supports protocol versions "
+                                   "%1% to %2%")
+                     % int(msg::oldest_protocol_version)
+                     % int(msg::current_protocol_version)).str());
         return;
     }
 
     // Greet the new player with the server name and our public key.
     msg::handshake m;
-    m.protocol_version = 1;
+    m.protocol_version
+        = std::min(msg.maximum_version, msg::current_protocol_version);
+    conn_info_[info.conn].protocol_version = m.protocol_version;
     m.server_name = "LOL server";
     m.server_id = my_id_;
     m.auth_url = auth_url_;
@@ -505,13 +960,7 @@ void network::knock(packet_info& info)
 
 void network::login(packet_info& info)
 {
-    using namespace crypto;
-
     auto msg = make<msg::login>(info.p);
-
-    world_coordinates start_pos(world_center);
-    wfpos start_pos_sub;
-    auto player_name = msg.name;
     bool hashed_id = false;
 
     // If no player ID was given, generate one by hashing the client's
@@ -520,7 +969,7 @@ void network::login(packet_info& info)
         auto& addr = info.conn->address.host;
         auto ptr = reinterpret_cast<uint8_t*>(&addr);
         crypto::buffer b(ptr, ptr + sizeof(addr));
-        auto hash = sha256(b);
+        auto hash = crypto::sha256(b);
         hash.resize(8);
         std::copy(hash.begin(), hash.end(), std::back_inserter(msg.uid));
         hashed_id = true;
@@ -531,7 +980,7 @@ void network::login(packet_info& info)
         return;
     }
 
-    log_msg("player '%1%' tries to login", player_name);
+    log_msg("player '%1%' tries to login", msg.name);
     auto& cinfo = conn_info_[info.conn];
 
     if (msg.mode == 0) {
@@ -540,107 +989,115 @@ void network::login(packet_info& info)
             kick_player(info.conn, "Server is not in singleplayer mode");
             return;
         }
-        info.plr = 0;
+        enter_world(info.conn, 0, msg.name);
 
     } else if (msg.mode == 1) {
         // Multiplayer mode
-        try {
-            if (global_settings["mode"].as<std::string>() == "singleplayer")
-                throw "Server is not running in multiplayer mode";
+        if (global_settings["mode"].as<std::string>() == "singleplayer") {
+            kick_player(info.conn,
+                        "Server is not running in multiplayer mode");
+            return;
+        }
+        if (cinfo.login_pending) {
+            log_msg("Ignoring login, the previous one is still being checked");
+            return;
+        }
 
-            if (msg.public_key.size() != 33)
-                throw "No valid UID or public key";
+        // The key agreement and the authentication server are too slow
+        // for the network thread.  The outcome comes back through
+        // finished_logins_, and is handled in finish_login().
+        auto ticket = ++login_tickets_;
+        cinfo.login_pending = true;
+        cinfo.login_ticket = ticket;
+        cinfo.login_deadline = steady_clock::now() + login_timeout;
+
+        login_request req{std::move(msg), hashed_id,
+                           info.conn->address.host, cinfo.iv};
+        auto conn = info.conn;
+        auth_workers_.enqueue([=] {
+            finished_logins_.push({conn, ticket, auth_->check(req)});
+        });
 
-            auto their_pubkey = public_key_from_binary(msg.public_key);
-            if (!crypto::is_valid(their_pubkey))
-                throw "Public key is not valid";
+    } else {
+        kick_player(info.conn, "Not a valid login method");
+    }
+}
 
-            auto shared_secret = crypto::ecdh(their_pubkey, my_private_key_);
-            // The shared secret is too wide for our purposes, use only the
-            // lowest 128 bits.
-            shared_secret.erase(shared_secret.begin() + 16,
-                                shared_secret.end());
-            cinfo.cipher.set_key(x_or(shared_secret, cinfo.iv));
+void network::finish_login(const finished_login& done)
+{
+    auto found = conn_info_.find(done.conn);
+    if (found == conn_info_.end() || !found->second.login_pending
+        || found->second.login_ticket != done.ticket) {
+        // The player left, or was kicked, while we were busy.
+        trace("Dropping the outcome of login %1%", done.ticket);
+        return;
+    }
 
-            if (sha256(concat(shared_secret, cinfo.iv)) != msg.mac) {
-                throw "Could not authenticate player";
-            } else {
-                log_msg("MAC is OK");
-            }
+    auto& cinfo = found->second;
+    cinfo.login_pending = false;
 
-            login_type login_method = login_type::anonymous_guest;
-            if (!hashed_id) {
-                // This is a registered user ID, run a few checks first.
-                std::string url{"https://" + auth_url_ + "/api/1/users/"};
-                auto res = rest::get(url + base58_encode(msg.uid));
-                if (res.status_code == 200) {
-                    if (from_json(res.json.get_child("users.pubkey")) != their_pubkey)
-                        throw "Could not authenticate player";
-
-                    player_name = res.json.get("users.username", player_name);
-                    login_method = login_type::authenticated;
-                } else if (res.status_code == 404) {
-                    throw "Player ID does not exist";
-                }
-            }
+    auto& result = done.result;
+    if (!result.is_ok()) {
+        kick_player(done.conn, result.error);
+        return;
+    }
+    log_msg("MAC is OK");
+    cinfo.cipher.set_key(result.key);
 
-            if (player_name.empty()) {
-                auto nr = fnv_hash(info.conn->address.host) % 1000;
-                player_name = "Guest" + std::to_string(nr);
-                login_method = login_type::anonymous_guest;
-            } else if (player_name.size() > 24) {
-                throw "Player name is too long";
-            } else {
-                login_method = login_type::named_guest;
+    int count(0);
+    es::storage::iterator iter;
+    es_.for_each<player_data>(
+        server_entity_system::c_player_data,
+        [&](es::storage::iterator i, player_data& pd) {
+            trace("Check against %1%...", pd.id);
+            if (pd.id == result.uid) {
+                ++count;
+                iter = i;
             }
+            return false;
+        });
 
-            int found(0);
-            es::storage::iterator iter;
-            uint64_t player_uid
-                = *reinterpret_cast<const uint64_t*>(&msg.uid[0]);
-
-            es_.for_each<player_data>(
-                server_entity_system::c_player_data,
-                [&](es::storage::iterator i, player_data& pd) {
-                    trace("Check against %1%...", pd.id);
-                    if (pd.id == player_uid) {
-                        ++found;
-                        iter = i;
-                    }
-                    return false;
-                });
+    es::entity plr;
+    if (count == 0) {
+        trace("Log in new player with uid %1%", result.uid);
+        plr = es_.new_entity();
+        es_.set(plr, server_entity_system::c_player_data,
+                player_data{result.uid, result.method});
+    } else {
+        trace("Log in existing player with uid %1%", result.uid);
+        if (count > 1)
+            trace("ERROR: Found more than one, actually");
 
-            if (found == 0) {
-                trace("Log in new player with uid %1%", player_uid);
-                info.plr = es_.new_entity();
-                es_.set(info.plr, server_entity_system::c_player_data,
-                        player_data{player_uid, login_method});
-            } else {
-                trace("Log in existing player with uid %1%", player_uid);
-                if (found > 1)
-                    trace("ERROR: Found more than one, actually");
+        plr = iter->first;
+        reactivate_player(plr, result.method);
+    }
 
-                info.plr = iter->first;
-                reactivate_player(info.plr, login_method);
-            }
-        } catch (const char* msg) {
-            kick_player(info.conn, msg);
-            return;
-        } catch (...) {
-            kick_player(info.conn, "Cannot log in player");
-            return;
-        }
-    } else {
-        kick_player(info.conn, "Not a valid login method");
-        return;
+    enter_world(done.conn, plr, result.name);
+}
+
+void network::expire_logins(steady_clock::time_point now)
+{
+    std::vector<ENetPeer*> expired;
+    for (auto& c : conn_info_) {
+        if (c.second.login_pending && now > c.second.login_deadline)
+            expired.push_back(c.first);
     }
+    for (auto conn : expired)
+        kick_player(conn, "Login timed out");
+}
+
+void network::enter_world(ENetPeer* conn, es::entity plr,
+                          const std::string& player_name)
+{
+    world_coordinates start_pos(world_center);
+    wfpos start_pos_sub;
 
-    conn_info_[info.conn].entity = info.plr;
-    connections_[info.plr] = info.conn;
+    conn_info_[conn].entity = plr;
+    connections_[plr] = conn;
 
-    log_msg("player %1% (%2%) logged in", info.plr, player_name);
+    log_msg("player %1% (%2%) logged in", plr, player_name);
 
-    auto pi = es_.make(info.plr);
+    auto pi = es_.make(plr);
     es_.set(pi, server_entity_system::c_name, player_name);
 
     if (es_.entity_has_component(pi, entity_system::c_position)) {
@@ -700,26 +1157,26 @@ void network::login(packet_info& info)
         {
             auto write_lock = es_.acquire_write_lock();
 
-            es_.set(info.plr, server_entity_system::c_position, start_pos_sub);
-            es_.set(info.plr, server_entity_system::c_velocity,
+            es_.set(plr, server_entity_system::c_position, start_pos_sub);
+            es_.set(plr, server_entity_system::c_velocity,
                     vector(0, 0, 0));
-            es_.set(info.plr, server_entity_system::c_boundingbox,
+            es_.set(plr, server_entity_system::c_boundingbox,
                     vector(0.4f, 0.4f, 1.73f));
-            es_.set(info.plr, server_entity_system::c_lookat, yaw_pitch(0, 0));
+            es_.set(plr, server_entity_system::c_lookat, yaw_pitch(0, 0));
         }
     }
 
     // Log in
-    log_msg("send greeting to player %1%", info.plr);
+    log_msg("send greeting to player %1%", plr);
 
     msg::setup reply;
     reply.position = start_pos;
-    reply.entity_id = info.plr;
-    reply.client_time = clock::client_time(conn_info_[info.conn].clock_offset);
-    send_encrypted(info.conn, serialize_packet(reply), reply.method());
+    reply.entity_id = plr;
+    reply.client_time = clock::client_time(conn_info_[conn].clock_offset);
+    send_encrypted(conn, serialize_packet(reply), reply.method());
 
     // Send height maps
-    log_msg("send height maps to player %1%", info.plr);
+    log_msg("send height maps to player %1%", plr);
     chunk_coordinates pcp(start_pos / chunk_size);
     int hmr(12);
     msg::heightmap_update heights;
@@ -733,9 +1190,10 @@ void network::login(packet_info& info)
                 heights.data.emplace_back(mc, height);
         }
     }
-    send(info.conn, serialize_packet(heights), heights.method());
+    send(conn, serialize_packet(heights), heights.method(),
+         send_priority::near_terrain);
 
-    log_msg("send terrain to player %1%", info.plr);
+    log_msg("send terrain to player %1%", plr);
 
     // Send the surrounding terrain
 
@@ -749,16 +1207,16 @@ void network::login(packet_info& info)
     trace("Request terrain %1% for player", pcp);
     workers_.enqueue([=] {
         prepare_for_player(world_, pcp);
-        send_surface_queue(pcp, info.conn);
+        send_surface_queue(pcp, conn);
     });
 
-    log_msg("send position to player %1%", info.plr);
+    log_msg("send position to player %1%", plr);
 
     // Send the position to the player
     msg::entity_update posmsg;
     msg::entity_update::value rec;
 
-    rec.entity_id = info.plr;
+    rec.entity_id = plr;
     rec.component_id = entity_system::c_position;
     rec.data = serialize_c(start_pos_sub);
     posmsg.updates.push_back(rec);
@@ -775,43 +1233,16 @@ void network::login(packet_info& info)
     rec.data = serialize_c(vector(0, 0, 0));
     posmsg.updates.push_back(rec);
 
-    for (auto& conn : connections_) {
-        if (conn.first == info.plr)
-            continue;
-
-        log_msg("inform player %1% of player %2%", conn.first, info.plr);
-        send_encrypted(conn.second, serialize_packet(posmsg), msg::reliable);
-    }
-
-    {
-        auto read_lock(es_.acquire_read_lock());
-
-        es_.for_each<wfpos>(entity_system::c_position,
-                            [&](es::storage::iterator i, wfpos& p_) {
-            if (info.plr == i->first)
-                return false;
-
-            log_msg("inform player %1% of player %2%", info.plr, i->first);
-            rec.entity_id = i->first;
-            rec.component_id = entity_system::c_boundingbox;
-            rec.data = serialize_c(vector(0.4f, 0.4f, 1.7f));
-            posmsg.updates.push_back(rec);
-            rec.component_id = entity_system::c_position;
-            rec.data = serialize_c(wfpos(p_));
-            posmsg.updates.push_back(rec);
-            rec.component_id = entity_system::c_velocity;
-            rec.data = serialize_c(vector(0, 0, 0));
-            posmsg.updates.push_back(rec);
-
-            return false;
-        });
-    }
+    // Other players, and the other entities around this one, are
+    // introduced by replicate_entities() once they are in range.
+    conn_info_[conn].visible.insert(plr);
 
-    send_encrypted(info.conn, serialize_packet(posmsg), msg::reliable);
+    send_encrypted(conn, serialize_packet(posmsg), msg::reliable,
+                   send_priority::entity);
 
     try {
         auto lock(es_.acquire_write_lock());
-        lua_.player_logged_in(info.plr);
+        lua_.player_logged_in(plr);
     } catch (luabind::error&) {
         log_msg("Lua error while logging in: %1%", lua_.get_error());
     } catch (std::exception& e) {
@@ -820,7 +1251,7 @@ void network::login(packet_info& info)
         log_msg("Unknown error while logging in.");
     }
 
-    log_msg("player %1% is logged in", info.plr);
+    log_msg("player %1% is logged in", plr);
 }
 
 void network::logout(const packet_info& info)
@@ -866,49 +1297,78 @@ void network::req_chunks(const packet_info& info)
 {
     auto msg(make<msg::request_surfaces>(info.p));
 
+    // The requests are handled in stream_terrain(), in order of
+    // distance to the player.
+    auto& requests(conn_info_[info.conn].requests);
     for (auto& req : msg.requests) {
         trace("request for surface %1%",
               world_rel_coordinates(req.position - world_chunk_center));
-        try {
-            auto pos(req.position);
-            if (is_air_chunk(req.position, coarse_height(world_, pos))) {
-                trace("air chunk, sending coarse height");
-                send_height(pos, info.conn);
-                continue;
-            }
+        requests.push(req.position, req.version);
+    }
+}
 
-            bool chunk_ok;
-            bool light_ok;
+void network::stream_terrain()
+{
+    for (auto& c : conn_info_) {
+        ENetPeer* conn(c.first);
+        auto& info(c.second);
+        if (info.requests.empty())
+            continue;
 
-            {
-                auto proxy(world_.acquire_read_access());
+        if (connections_.count(info.entity)) {
+            auto lock(es_.acquire_read_lock());
+            info.requests.set_view(
+                es_.get<wfpos>(info.entity, entity_system::c_position),
+                es_.get<yaw_pitch>(info.entity, entity_system::c_lookat));
+        }
 
-                if (proxy.is_surface_available(pos)
-                    && req.version == proxy.get_surface(pos).version) {
+        chunk_request_queue::request req;
+        while (info.generating < max_generating
+               && info.pending_surfaces.size() < surface_batch_max
+               && queued_bytes(conn) < stream_backlog
+               && info.requests.pop(req)) {
+            try {
+                auto pos(req.position);
+                if (is_air_chunk(pos, coarse_height(world_, pos))) {
+                    trace("air chunk, sending coarse height");
+                    send_height(pos, conn);
                     continue;
                 }
 
-                chunk_ok = proxy.is_chunk_available(req.position);
-                light_ok = proxy.is_lightmap_available(req.position);
-            }
+                bool chunk_ok;
+                bool light_ok;
 
-            // If all the data we need is available, send it immediately.
-            // Otherwise, send a job down the queue and ask the terrain
-            // generator to call us back when it's done.
-            //
-            if (chunk_ok && light_ok) {
-                trace("sending surface right away");
-                send_surface(req.position, info.conn);
-            } else {
-                trace("generate surface and lightmap");
-                workers_.enqueue([=] {
-                    prepare_for_player(world_, req.position);
-                    send_surface_queue(req.position, info.conn);
-                });
+                {
+                    auto proxy(world_.acquire_read_access());
+
+                    if (proxy.is_surface_available(pos)
+                        && req.version == proxy.get_surface(pos).version) {
+                        continue;
+                    }
+
+                    chunk_ok = proxy.is_chunk_available(pos);
+                    light_ok = proxy.is_lightmap_available(pos);
+                }
+
+                // If all the data we need is available, send it
+                // immediately.  Otherwise, ask the terrain generator to
+                // send a job down the queue when it's done.
+                //
+                if (chunk_ok && light_ok) {
+                    trace("sending surface right away");
+                    send_surface(pos, conn);
+                } else {
+                    trace("generate surface and lightmap");
+                    ++info.generating;
+                    workers_.enqueue([=] {
+                        prepare_for_player(world_, pos);
+                        jobs.push({job::requested_surface, pos, conn});
+                    });
+                }
+            } catch (std::exception& e) {
+                log_msg("Cannot provide surface data at %1%, because: %2%",
+                        req.position, std::string(e.what()));
             }
-        } catch (std::exception& e) {
-            log_msg("Cannot provide surface data at %1%, because: %2%",
-                    req.position, std::string(e.what()));
         }
     }
 }
@@ -967,6 +1427,37 @@ void network::console(const packet_info& info)
     lua_.console(info.plr, msg.text);
 }
 
+void network::snapshot_ack(const packet_info& info)
+{
+    auto msg(make<msg::snapshot_ack>(info.p));
+    auto& conn(conn_info_[info.conn]);
+    auto& history(conn.unacked_snapshots);
+
+    // Acknowledgements can arrive out of order, or for snapshots that
+    // are no longer remembered.  Those are ignored; the player will ack
+    // a later one.
+    while (!history.empty() && history.front().sequence < msg.sequence)
+        history.pop_front();
+
+    if (history.empty() || history.front().sequence != msg.sequence)
+        return;
+
+    // The player ignores snapshots older than the newest one it has, so
+    // every entity that was sent in this one is now up to date.
+    for (auto& q : history.front().entities) {
+        if (!conn.visible.contains(q.entity))
+            continue;
+
+        conn.acked_motion[q.entity] = q;
+        auto sent(conn.unacked_motion.find(q.entity));
+        if (sent != conn.unacked_motion.end()
+            && sent->second == msg.sequence) {
+            conn.unacked_motion.erase(sent);
+        }
+    }
+    history.pop_front();
+}
+
 void network::unknown(const packet_info& info)
 {
     log_msg("Unknown packet type %1% received", (int)info.p.message_type());
@@ -1121,7 +1612,18 @@ bool network::reactivate_player(uint32_t entity, login_type logged)
 std::string network::exec(const std::string& cmd)
 {
     if (cmd == "help")
-        return "You're on your own, buddy.";
+        return "ticks    show how long the server loops take";
+
+    if (cmd == "ticks") {
+        std::string result;
+        for (auto p : watched_) {
+            if (!result.empty())
+                result += '\n';
+
+            result += p->report();
+        }
+        return result;
+    }
 
     return "Syntax error.";
 }
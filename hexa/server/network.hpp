@@ -22,8 +22,10 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <boost/thread.hpp>
 #include <boost/signals2.hpp>
@@ -32,11 +34,17 @@
 
 #include <hexa/concurrent_queue.hpp>
 #include <hexa/crypto.hpp>
+#include <hexa/entity_snapshot.hpp>
 #include <hexa/ray.hpp>
+#include <hexa/surface.hpp>
 #include <hexa/threadpool.hpp>
 
+#include "aoi_grid.hpp"
+#include "authenticator.hpp"
+#include "chunk_request_queue.hpp"
 #include "player.hpp"
 #include "server_entity_system.hpp"
+#include "tick_scheduler.hpp"
 #include "udp_server.hpp"
 
 namespace hexa
@@ -55,7 +63,13 @@ public:
 public:
     struct job
     {
-        enum type_t { lightmap, surface_and_lightmap, entity_info, quit };
+        enum type_t {
+            lightmap,
+            surface_and_lightmap,
+            requested_surface,
+            entity_info,
+            quit
+        };
 
         type_t type;
         chunk_coordinates pos;
@@ -74,15 +88,43 @@ public:
              const crypto::buffer& server_id);
     void stop();
 
+    /** Set the time the network loop can spend handling incoming events
+     ** in one go, before the periodic tasks and jobs get their turn. */
+    void set_poll_budget(boost::chrono::steady_clock::duration budget)
+    {
+        poll_budget_ = budget;
+    }
+
+    /** Set the distance, in blocks, within which players receive
+     ** updates about other entities. */
+    void set_aoi_radius(uint32_t blocks) { aoi_radius_ = blocks; }
+
+    /** Include the numbers of another loop in the reports about falling
+     ** behind.  Has to be called before run(). */
+    void watch(tick_profile& profile) { watched_.push_back(&profile); }
+
     void on_connect(ENetPeer* c);
     void on_disconnect(ENetPeer* c);
     void on_receive(ENetPeer* c, packet p);
 
     bool send(uint32_t entity, const binary_data& msg,
-              msg::reliability method) const;
+              msg::reliability method,
+              send_priority prio = send_priority::control) const;
 
     void send_encrypted(ENetPeer* dest, const binary_data& msg,
-                        msg::reliability method) const;
+                        msg::reliability method,
+                        send_priority prio = send_priority::control) const;
+
+    /** Encrypt a message for a connection, if its encryption has been
+     ** set up.  If not, the message is returned as it is. */
+    shared_payload encrypt_for(ENetPeer* dest,
+                               const shared_payload& payload) const;
+
+    /** Send a message that may also go out to other connections.  It is
+     ** only copied if it has to be encrypted. */
+    void send_encrypted(ENetPeer* dest, const shared_payload& payload,
+                        msg::reliability method,
+                        send_priority prio = send_priority::control) const;
 
     void broadcast(const binary_data& msg, msg::reliability method) const;
 
@@ -108,13 +150,59 @@ private:
     void look_at(const packet_info& p);
     void motion(const packet_info& p);
     void console(const packet_info& p);
+    void snapshot_ack(const packet_info& p);
     void unknown(const packet_info& p);
 
+private:
+    /** The outcome of a login check, on its way back from a worker. */
+    struct finished_login
+    {
+        ENetPeer* conn;
+        uint32_t ticket;
+        login_result result;
+    };
+
+    /** Called once a multiplayer login has been checked. */
+    void finish_login(const finished_login& done);
+    /** Kick the players whose login took too long to check. */
+    void expire_logins(boost::chrono::steady_clock::time_point now);
+    /** Set up a player that just logged in, and send them the world
+     ** around them. */
+    void enter_world(ENetPeer* conn, es::entity plr,
+                     const std::string& player_name);
+
 private:
     void tick();
+    /** Send players the position and velocity of the entities around
+     ** them.  Entities that come into range are introduced first, and
+     ** the ones that went out of range are deleted. */
+    void replicate_entities();
+    /** Send a player the entities that moved since the last snapshot
+     ** the player acknowledged. */
+    void send_snapshot(
+        ENetPeer* conn, const world_coordinates& center,
+        const std::unordered_map<uint32_t, msg::entity_update_physics::value>&
+            moving);
     void send_surface(const chunk_coordinates& pos);
     void send_surface_queue(const chunk_coordinates& pos, ENetPeer* dest);
     void send_surface(const chunk_coordinates& pos, ENetPeer* dest);
+    /** Work through the terrain requests of every player, most urgent
+     ** first. */
+    void stream_terrain();
+    /** Send the surfaces that are waiting to be bundled, if it's time.
+     ** @param now  The current time */
+    void flush_surfaces(boost::chrono::steady_clock::time_point now);
+    /** Send all surfaces that are waiting for a player, in as few
+     ** surface_batch messages as possible. */
+    void send_surface_batches(ENetPeer* dest);
+    void send_lightmap(const chunk_coordinates& pos);
+    void refine_lightmap(const chunk_coordinates& pos);
+    bool in_range(uint32_t entity, const chunk_coordinates& pos) const;
+    /** How urgently a player needs terrain at a given position. */
+    send_priority terrain_priority(ENetPeer* conn,
+                                   const chunk_coordinates& pos) const;
+    /** The surface encoding a client can read. */
+    surface_encoding surface_encoding_for(ENetPeer* conn) const;
     void send_coarse_height(chunk_coordinates pos);
     void send_height(const map_coordinates& pos, ENetPeer* dest);
     void kick_player(ENetPeer* dest, const std::string& kickmsg);
@@ -133,6 +221,19 @@ private:
     crypto::buffer my_public_key_;
     crypto::buffer my_id_;
     std::string auth_url_;
+    std::unique_ptr<authenticator> auth_;
+    concurrent_queue<finished_login> finished_logins_;
+    /** Checks logins; declared after everything the workers use, so it
+     ** is shut down first. */
+    threadpool auth_workers_;
+    uint32_t login_tickets_;
+
+    /** An entity snapshot that is waiting for an acknowledgement. */
+    struct sent_snapshot
+    {
+        uint32_t sequence;
+        std::vector<quantized_motion> entities;
+    };
 
     struct connection_info
     {
@@ -140,6 +241,41 @@ private:
         uint32_t entity;
         binary_data iv;
         crypto::aes cipher;
+        /** The protocol version agreed on in the handshake. */
+        uint8_t protocol_version;
+        /** Chunks the player asked for, but hasn't been sent yet. */
+        chunk_request_queue requests;
+        /** The number of requested chunks that are being generated. */
+        unsigned int generating;
+        /** The entities the player receives updates about. */
+        aoi_subscription visible;
+        /** The motion of the visible entities, as of the last entity
+         ** snapshot the player acknowledged.  New snapshots are deltas
+         ** against this. */
+        std::unordered_map<uint32_t, quantized_motion> acked_motion;
+        /** Entities that were sent in a snapshot that hasn't been
+         ** acknowledged yet, and the sequence number of that snapshot.
+         *  They keep being sent until it is. */
+        std::unordered_map<uint32_t, uint32_t> unacked_motion;
+        /** The snapshots sent since the last acknowledgement, oldest
+         ** first. */
+        std::deque<sent_snapshot> unacked_snapshots;
+        /** The sequence number of the next entity snapshot. */
+        uint32_t next_snapshot;
+        /** Surfaces waiting to be sent in a surface_batch. */
+        std::vector<chunk_coordinates> pending_surfaces;
+        /** When the first of pending_surfaces was added. */
+        boost::chrono::steady_clock::time_point pending_since;
+        /** The chunks whose surface has been handed to the send queue.
+         *  Light map updates only go out for these, so they never arrive
+         *  before the surface they belong to. */
+        std::unordered_set<chunk_coordinates> sent_surfaces;
+        /** Set while a worker checks the player's login. */
+        bool login_pending;
+        /** Tells this login apart from earlier ones on the same peer. */
+        uint32_t login_ticket;
+        /** The player is kicked if the login hasn't been checked by then. */
+        boost::chrono::steady_clock::time_point login_deadline;
     };
 
     std::unordered_map<ENetPeer*, connection_info> conn_info_;
@@ -148,6 +284,21 @@ private:
     // std::unordered_map<ENetPeer*, uint32_t> entities_;
     std::unordered_map<uint32_t, ENetPeer*> connections_;
 
+    boost::chrono::steady_clock::duration poll_budget_;
+
+    /** How long the phases of the network loop take. */
+    tick_profile profile_;
+    /** The network loop itself, and the other loops that are reported on,
+     ** such as physics. */
+    std::vector<tick_profile*> watched_;
+
+    /** Where all entities are, rebuilt every physics update. */
+    aoi_grid aoi_;
+    uint32_t aoi_radius_;
+
+    /** Chunks with a light map that is being refined in the background. */
+    std::unordered_set<chunk_coordinates> refining_;
+
     std::atomic<bool> running_;
 };
 
@@ -0,0 +1,254 @@
+//---------------------------------------------------------------------------
+/// \file   server/send_scheduler.hpp
+/// \brief  Outgoing message queues with priorities and bandwidth limits.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <boost/chrono.hpp>
+#include <hexa/basic_types.hpp>
+#include <hexa/protocol.hpp>
+
+namespace hexa
+{
+
+/** A serialized message.  The same payload can be queued for any number
+ ** of connections without being copied. */
+typedef std::shared_ptr<const binary_data> shared_payload;
+
+/** How urgent an outgoing message is. */
+enum class send_priority : uint8_t {
+    /** Logins, chat, and everything else that doesn't fit below. */
+    control = 0,
+    /** Entity positions and state. */
+    entity = 1,
+    /** Terrain close to the player. */
+    near_terrain = 2,
+    /** Terrain further away. */
+    far_terrain = 3
+};
+
+/** Queues outgoing messages per connection, and decides what can be sent.
+ *  Every connection gets a bandwidth budget, measured in bytes per
+ *  second.  Messages are handed out in order of priority; within the same
+ *  priority they stay in the order they were queued in.  Messages about
+ *  the same chunk always keep their order, though: a light map never
+ *  overtakes the surface it belongs to.  If an earlier message about a
+ *  chunk is still waiting in a lower priority, the new one joins it
+ *  there.  Control messages
+ *  always go out right away, but they do count towards the budget.  A
+ *  message is sent as soon as there is any budget left, which may take
+ *  it below zero, so a message that is bigger than the burst size won't
+ *  get stuck.
+ *
+ *  This class is not thread-safe.
+ * @param peer_t  Identifies a connection */
+template <typename peer_t>
+class send_scheduler
+{
+public:
+    typedef boost::chrono::steady_clock clock;
+
+    /** A message that is ready to go out. */
+    struct item
+    {
+        peer_t peer;
+        shared_payload data;
+        msg::reliability method;
+        /** The chunks the message is about. */
+        std::vector<chunk_coordinates> chunks;
+    };
+
+public:
+    /** Constructor.
+     * @param bytes_per_second  The budget of every connection
+     * @param burst             How many bytes a connection can save up
+     *                          while it's idle */
+    send_scheduler(size_t bytes_per_second, size_t burst)
+        : rate_(bytes_per_second)
+        , burst_(burst)
+        , next_(0)
+    {
+    }
+
+    void set_budget(size_t bytes_per_second, size_t burst)
+    {
+        rate_ = bytes_per_second;
+        burst_ = burst;
+    }
+
+    /** Queue a message.
+     * @param chunks  The chunks the message is about.  It won't be sent
+     *                before any earlier message about one of these. */
+    void push(peer_t peer, send_priority prio, shared_payload data,
+              msg::reliability method, clock::time_point now = clock::now(),
+              std::vector<chunk_coordinates> chunks = {})
+    {
+        auto found(peers_.find(peer));
+        if (found == peers_.end()) {
+            found = peers_.emplace(peer, connection(burst_, now)).first;
+            order_.push_back(peer);
+        }
+        auto& c(found->second);
+
+        size_t queue(static_cast<size_t>(prio));
+        for (auto& pos : chunks) {
+            auto waiting(c.chunks.find(pos));
+            if (waiting != c.chunks.end())
+                queue = std::max(queue, waiting->second.queue);
+        }
+        for (auto& pos : chunks) {
+            auto& waiting(c.chunks[pos]);
+            waiting.queue = std::max(waiting.queue, queue);
+            ++waiting.count;
+        }
+
+        c.queues[queue].push_back(
+            {peer, std::move(data), method, std::move(chunks)});
+    }
+
+    /** Forget everything about a connection. */
+    void remove(peer_t peer)
+    {
+        if (peers_.erase(peer) == 0)
+            return;
+
+        order_.erase(std::find(order_.begin(), order_.end(), peer));
+        if (next_ >= order_.size())
+            next_ = 0;
+    }
+
+    /** Take all messages that can be sent right now.
+     *  Every call starts with the next connection in line, so they all
+     *  get their turn first. */
+    std::vector<item> take(clock::time_point now = clock::now())
+    {
+        std::vector<item> result;
+        for (size_t n(0); n < order_.size(); ++n) {
+            auto& c(peers_.at(order_[(next_ + n) % order_.size()]));
+            c.refill(now, rate_, burst_);
+            for (size_t p(0); p < c.queues.size(); ++p) {
+                auto& q(c.queues[p]);
+                while (!q.empty() && (p == 0 || c.tokens > 0)) {
+                    c.tokens -= q.front().data->size();
+                    c.forget_chunks(q.front());
+                    result.emplace_back(std::move(q.front()));
+                    q.pop_front();
+                }
+            }
+        }
+        if (!order_.empty())
+            next_ = (next_ + 1) % order_.size();
+
+        return result;
+    }
+
+    /** Check if there are any messages waiting. */
+    bool empty() const
+    {
+        for (auto& p : peers_) {
+            for (auto& q : p.second.queues) {
+                if (!q.empty())
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /** The number of bytes waiting to be sent to a connection. */
+    size_t queued_bytes(peer_t peer) const
+    {
+        auto found(peers_.find(peer));
+        if (found == peers_.end())
+            return 0;
+
+        size_t result(0);
+        for (auto& q : found->second.queues) {
+            for (auto& i : q)
+                result += i.data->size();
+        }
+        return result;
+    }
+
+private:
+    /** Where the messages about a chunk are waiting. */
+    struct chunk_queue
+    {
+        /** The lowest priority queue holding any of them. */
+        size_t queue;
+        /** How many there are. */
+        size_t count;
+
+        chunk_queue()
+            : queue(0)
+            , count(0)
+        {
+        }
+    };
+
+    struct connection
+    {
+        std::array<std::deque<item>, 4> queues;
+        /** The chunks that queued messages are about. */
+        std::unordered_map<chunk_coordinates, chunk_queue> chunks;
+        /** Bytes that can still be sent.  Can go below zero. */
+        double tokens;
+        clock::time_point last_refill;
+
+        connection(size_t burst, clock::time_point now)
+            : tokens(burst)
+            , last_refill(now)
+        {
+        }
+
+        void refill(clock::time_point now, size_t rate, size_t burst)
+        {
+            if (now <= last_refill)
+                return;
+
+            boost::chrono::duration<double> elapsed(now - last_refill);
+            tokens = std::min<double>(tokens + elapsed.count() * rate, burst);
+            last_refill = now;
+        }
+
+        void forget_chunks(const item& i)
+        {
+            for (auto& pos : i.chunks) {
+                auto found(chunks.find(pos));
+                if (--found->second.count == 0)
+                    chunks.erase(found);
+            }
+        }
+    };
+
+    size_t rate_;
+    size_t burst_;
+    std::unordered_map<peer_t, connection> peers_;
+    /** All connections, in the order they take turns in. */
+    std::vector<peer_t> order_;
+    size_t next_;
+};
+
+} // namespace hexa
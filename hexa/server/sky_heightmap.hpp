@@ -0,0 +1,110 @@
+//---------------------------------------------------------------------------
+/// \file   server/sky_heightmap.hpp
+/// \brief  Per-column sky exposure, used to speed up the sunlight.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+
+namespace hexa
+{
+
+/** The sky exposure of a 16x16 map column.
+ *  For every block column, this stores the lowest world z-coordinate from
+ *  which all blocks up to the sky are fully transparent.  It is one above
+ *  the highest non-transparent block in that column, or a conservative
+ *  (higher) estimate if the column wasn't scanned deep enough.
+ *  The value \a undefined_height means nothing is known about the column. */
+class sky_heightmap
+{
+    std::array<uint32_t, chunk_area> buf_;
+    uint32_t max_;
+
+public:
+    sky_heightmap() { clear(); }
+
+    /** Forget everything we know about the column. */
+    void clear(uint32_t v = undefined_height)
+    {
+        buf_.fill(v);
+        max_ = v;
+    }
+
+    uint32_t operator()(uint32_t x, uint32_t y) const
+    {
+        return buf_[x + y * chunk_size];
+    }
+
+    uint32_t& operator()(uint32_t x, uint32_t y)
+    {
+        return buf_[x + y * chunk_size];
+    }
+
+    /** Recalculate max() after the heights were changed. */
+    void update_max() { max_ = *std::max_element(buf_.begin(), buf_.end()); }
+
+    /** The highest sky height of all columns.  Every block at or above
+     *  this z-coordinate is fully transparent. */
+    uint32_t max() const { return max_; }
+};
+
+/** For every block column of a chunk, find the highest value in a
+ ** window of columns.
+ *  This is used to find the height above which all rays starting from a
+ *  block column are in the open.
+ * @param grid    The values of an area of (chunk_size - 1 + w) by
+ *                (chunk_size - 1 + h) columns, row by row
+ * @param w, h    The size of the window
+ * @return For column (x, y), the highest value in the window that starts
+ *         at (x, y) in the grid */
+inline sky_heightmap window_max(const std::vector<uint32_t>& grid, uint32_t w,
+                                uint32_t h)
+{
+    const uint32_t width(chunk_size - 1 + w), height(chunk_size - 1 + h);
+    assert(w > 0 && h > 0 && grid.size() == size_t(width) * height);
+
+    // Take the maximum along the rows first, then along the columns.
+    std::vector<uint32_t> rows(size_t(chunk_size) * height);
+    for (uint32_t y(0); y < height; ++y) {
+        auto row(grid.begin() + size_t(y) * width);
+        for (uint32_t x(0); x < chunk_size; ++x)
+            rows[x + y * chunk_size] = *std::max_element(row + x, row + x + w);
+    }
+
+    sky_heightmap result;
+    for (uint32_t y(0); y < chunk_size; ++y) {
+        for (uint32_t x(0); x < chunk_size; ++x) {
+            uint32_t m(0);
+            for (uint32_t i(0); i < h; ++i)
+                m = std::max(m, rows[x + (y + i) * chunk_size]);
+
+            result(x, y) = m;
+        }
+    }
+    result.update_max();
+    return result;
+}
+
+} // namespace hexa
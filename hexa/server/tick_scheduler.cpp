@@ -0,0 +1,169 @@
+//---------------------------------------------------------------------------
+// server/tick_scheduler.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "tick_scheduler.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <boost/format.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+
+using namespace boost::chrono;
+using boost::format;
+
+namespace hexa
+{
+
+tick_scheduler::tick_scheduler(clock::duration interval,
+                               unsigned int max_catch_up,
+                               clock::time_point start)
+    : interval_(interval)
+    , max_catch_up_(std::max(1u, max_catch_up))
+    , next_(start)
+    , ticks_(0)
+    , skipped_(0)
+{
+    assert(interval > clock::duration::zero());
+}
+
+unsigned int tick_scheduler::due(clock::time_point now)
+{
+    if (now < next_)
+        return 0;
+
+    uint64_t behind((now - next_) / interval_ + 1);
+    unsigned int run(std::min<uint64_t>(behind, max_catch_up_));
+
+    next_ += interval_ * behind;
+    ticks_ += run;
+    skipped_ += behind - run;
+
+    return run;
+}
+
+unsigned int tick_scheduler::wait()
+{
+    while (true) {
+        unsigned int count(due(clock::now()));
+        if (count > 0)
+            return count;
+
+        boost::this_thread::sleep_until(next_);
+    }
+}
+
+//---------------------------------------------------------------------------
+
+namespace
+{
+
+double msec(tick_profile::clock::duration d)
+{
+    return duration<double, boost::milli>(d).count();
+}
+
+} // anonymous namespace
+
+tick_profile::tick_profile(const std::string& name, clock::duration budget,
+                           const std::vector<std::string>& phases)
+    : name_(name)
+    , budget_(budget)
+    , phase_names_(phases)
+{
+    if (phases.size() > max_phases)
+        throw std::runtime_error("too many phases in tick profile " + name);
+
+    clear();
+}
+
+void tick_profile::add_skipped(uint64_t count)
+{
+    if (count == 0)
+        return;
+
+    boost::lock_guard<boost::mutex> lock(lock_);
+    skipped_ += count;
+}
+
+bool tick_profile::fell_behind() const
+{
+    boost::lock_guard<boost::mutex> lock(lock_);
+    return overruns_ > 0 || skipped_ > 0;
+}
+
+std::string tick_profile::report(bool reset_afterwards)
+{
+    boost::lock_guard<boost::mutex> lock(lock_);
+
+    double avg(ticks_ > 0 ? msec(tick_.total) / ticks_ : 0.0);
+    std::string result(
+        (format("%1%: %2% ticks, %3% over %4% ms, %5% skipped; "
+                "avg %6$.2f ms, max %7$.2f ms")
+         % name_ % ticks_ % overruns_ % msec(budget_) % skipped_ % avg
+         % msec(tick_.max)).str());
+
+    for (size_t i(0); i < phase_names_.size(); ++i) {
+        auto& p(phases_[i]);
+        double phase_avg(ticks_ > 0 ? msec(p.total) / ticks_ : 0.0);
+        result += (format("; %1% %2$.2f/%3$.2f") % phase_names_[i]
+                   % phase_avg % msec(p.max)).str();
+    }
+
+    if (reset_afterwards)
+        clear();
+
+    return result;
+}
+
+void tick_profile::record(const std::array<clock::duration, max_phases>& laps,
+                          clock::duration total)
+{
+    boost::lock_guard<boost::mutex> lock(lock_);
+
+    ++ticks_;
+    if (total > budget_)
+        ++overruns_;
+
+    tick_.total += total;
+    tick_.max = std::max(tick_.max, total);
+    for (size_t i(0); i < phase_names_.size(); ++i) {
+        phases_[i].total += laps[i];
+        phases_[i].max = std::max(phases_[i].max, laps[i]);
+    }
+}
+
+void tick_profile::reset()
+{
+    boost::lock_guard<boost::mutex> lock(lock_);
+    clear();
+}
+
+void tick_profile::clear()
+{
+    ticks_ = overruns_ = skipped_ = 0;
+    tick_ = {clock::duration::zero(), clock::duration::zero()};
+    for (auto& p : phases_)
+        p = {clock::duration::zero(), clock::duration::zero()};
+}
+
+} // namespace hexa
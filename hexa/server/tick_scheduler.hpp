@@ -0,0 +1,180 @@
+//---------------------------------------------------------------------------
+/// \file   server/tick_scheduler.hpp
+/// \brief  Running tasks at a fixed rate, and timing them.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace hexa
+{
+
+/** Decides when a task that runs at a fixed rate is due.
+ *  Tick n is due at start + n * interval, so the rate does not drift with
+ *  the time the ticks themselves take.  If the task falls behind, up to
+ *  max_catch_up ticks are run back to back.  Any ticks beyond that are
+ *  skipped and counted, and the ticks after that are due on the same grid
+ *  as before.
+ *
+ *  This class is not thread-safe. */
+class tick_scheduler
+{
+public:
+    typedef boost::chrono::steady_clock clock;
+
+public:
+    /** Constructor.
+     * @param interval      Time between two ticks
+     * @param max_catch_up  The most ticks that are run at once after
+     *                      falling behind; 1 means missed ticks are
+     *                      always skipped
+     * @param start         When the first tick is due */
+    tick_scheduler(clock::duration interval, unsigned int max_catch_up = 1,
+                   clock::time_point start = clock::now());
+
+    /** Find out how many ticks are due, and mark them as done.
+     * @return The number of ticks to run now; zero if it is too early */
+    unsigned int due(clock::time_point now);
+
+    /** Sleep until the next tick is due.
+     * @return The number of ticks to run, at least one */
+    unsigned int wait();
+
+    /** When the next tick is due. */
+    clock::time_point next_tick() const { return next_; }
+
+    clock::duration interval() const { return interval_; }
+
+    /** The number of ticks that were run. */
+    uint64_t ticks() const { return ticks_; }
+
+    /** The number of ticks that were skipped. */
+    uint64_t skipped() const { return skipped_; }
+
+private:
+    clock::duration interval_;
+    unsigned int max_catch_up_;
+    clock::time_point next_;
+    uint64_t ticks_;
+    uint64_t skipped_;
+};
+
+/** Keeps track of how long the ticks of a loop take, split up in phases.
+ *  The numbers cover the ticks since the last reset.  A tick that takes
+ *  longer than the budget counts as an overrun.
+ *
+ *  The loop itself records the ticks, while the numbers can be read from
+ *  any other thread. */
+class tick_profile
+{
+public:
+    typedef boost::chrono::steady_clock clock;
+
+    /** The most phases a tick can be split up in. */
+    static const size_t max_phases = 8;
+
+    /** Times a single tick.  Every call to lap() adds the time since the
+     ** previous lap to a phase. */
+    class timer
+    {
+    public:
+        timer(tick_profile& profile)
+            : profile_(profile)
+            , begin_(clock::now())
+            , last_(begin_)
+        {
+            laps_.fill(clock::duration::zero());
+        }
+
+        /** Mark the end of a phase. */
+        void lap(size_t phase)
+        {
+            auto now(clock::now());
+            laps_[phase] += now - last_;
+            last_ = now;
+        }
+
+        /** Record the tick. */
+        void finish() { profile_.record(laps_, last_ - begin_); }
+
+    private:
+        tick_profile& profile_;
+        clock::time_point begin_;
+        clock::time_point last_;
+        std::array<clock::duration, max_phases> laps_;
+    };
+
+public:
+    /** Constructor.
+     * @param name    Shows up in the reports
+     * @param budget  Ticks that take longer than this are overruns
+     * @param phases  The names of the phases, at most max_phases */
+    tick_profile(const std::string& name, clock::duration budget,
+                 const std::vector<std::string>& phases);
+
+    /** Start timing a tick. */
+    timer start() { return timer(*this); }
+
+    /** Count ticks that were skipped because the loop fell behind. */
+    void add_skipped(uint64_t count);
+
+    /** Check if there were any overruns or skipped ticks. */
+    bool fell_behind() const;
+
+    /** A one-line summary of the numbers.
+     * @param reset_afterwards  Start counting from zero afterwards */
+    std::string report(bool reset_afterwards = false);
+
+    /** Start counting from zero. */
+    void reset();
+
+    const std::string& name() const { return name_; }
+
+private:
+    void record(const std::array<clock::duration, max_phases>& laps,
+                clock::duration total);
+
+    void clear();
+
+private:
+    struct stats
+    {
+        clock::duration total;
+        clock::duration max;
+    };
+
+    std::string name_;
+    clock::duration budget_;
+    std::vector<std::string> phase_names_;
+
+    mutable boost::mutex lock_;
+    uint64_t ticks_;
+    uint64_t overruns_;
+    uint64_t skipped_;
+    stats tick_;
+    std::array<stats, max_phases> phases_;
+};
+
+} // namespace hexa
@@ -21,6 +21,7 @@
 
 #include "udp_server.hpp"
 
+#include <map>
 #include <stdexcept>
 #include <string>
 #include <boost/format.hpp>
@@ -28,12 +29,15 @@
 #include <hexa/log.hpp>
 
 using boost::format;
+using namespace boost::chrono;
 
 namespace hexa
 {
 
 udp_server::udp_server(uint16_t port, uint16_t max_users)
     : sv_(nullptr)
+    , outbox_(256 * 1024, 64 * 1024)
+    , sending_(true)
 {
 #ifdef ENET_IPV6
     addr_.host = in6addr_any;
@@ -48,73 +52,224 @@ udp_server::udp_server(uint16_t port, uint16_t max_users)
         throw std::runtime_error(
             (format("failed to open port %1% (do you already have a server "
                     "running?)") % port).str());
+
+    send_thread_ = boost::thread([=] { send_loop(); });
 }
 
 udp_server::~udp_server()
 {
+    {
+        boost::lock_guard<boost::mutex> lock(outbox_mutex_);
+        sending_.store(false);
+    }
+    outbox_cond_.notify_one();
+    send_thread_.join();
+
     enet_host_destroy(sv_);
 }
 
-void udp_server::poll(uint16_t milliseconds)
+size_t udp_server::poll(uint16_t milliseconds,
+                        steady_clock::duration budget)
+{
+    auto deadline(steady_clock::now() + budget);
+    size_t count(0);
+    while (service(count == 0 ? milliseconds : 0)) {
+        ++count;
+        if (steady_clock::now() >= deadline)
+            break;
+    }
+    return count;
+}
+
+bool udp_server::service(uint32_t milliseconds)
 {
     ENetEvent ev;
     int result = 0;
+    bool closing(false);
     {
         boost::lock_guard<boost::mutex> lock(enet_mutex_);
         result = enet_host_service(sv_, &ev, milliseconds);
+        if (result > 0) {
+            closing = closing_.count(ev.peer) > 0;
+            if (ev.type == ENET_EVENT_TYPE_CONNECT
+                || ev.type == ENET_EVENT_TYPE_DISCONNECT)
+                closing_.erase(ev.peer);
+        }
     }
 
     if (result < 0)
         throw std::runtime_error(
             (format("network error %1%") % -result).str());
 
+    if (result == 0)
+        return false;
+
     switch (ev.type) {
     case ENET_EVENT_TYPE_CONNECT:
         on_connect(ev.peer);
         break;
 
     case ENET_EVENT_TYPE_RECEIVE:
-        on_receive(ev.peer, packet(ev.packet->data, ev.packet->dataLength));
+        if (!closing)
+            on_receive(ev.peer,
+                       packet(ev.packet->data, ev.packet->dataLength));
         enet_packet_destroy(ev.packet);
         break;
 
     case ENET_EVENT_TYPE_DISCONNECT:
+        {
+            boost::lock_guard<boost::mutex> lock(outbox_mutex_);
+            outbox_.remove(ev.peer);
+            dropped_.insert(ev.peer);
+        }
         on_disconnect(ev.peer);
         break;
 
     case ENET_EVENT_TYPE_NONE:
         break;
     }
+    return true;
+}
+
+void udp_server::send(ENetPeer* peer, shared_payload msg,
+                      msg::reliability method, send_priority prio,
+                      std::vector<chunk_coordinates> chunks) const
+{
+    auto now(steady_clock::now());
+    {
+        boost::lock_guard<boost::mutex> lock(outbox_mutex_);
+        outbox_.push(peer, prio, std::move(msg), method, now,
+                     std::move(chunks));
+    }
+    outbox_cond_.notify_one();
 }
 
-void udp_server::send(ENetPeer* peer, const binary_data& msg,
-                      msg::reliability method) const
+void udp_server::send(ENetPeer* peer, binary_data msg,
+                      msg::reliability method, send_priority prio,
+                      std::vector<chunk_coordinates> chunks) const
 {
-    uint32_t flags(0);
+    send(peer, std::make_shared<const binary_data>(std::move(msg)), method,
+         prio, std::move(chunks));
+}
 
-    switch (method) {
-    case msg::unreliable:
-        flags = ENET_PACKET_FLAG_UNSEQUENCED;
-        break;
-    case msg::reliable:
-    case msg::sequenced:
-        flags = ENET_PACKET_FLAG_RELIABLE;
-        break;
+void udp_server::set_bandwidth(size_t bytes_per_second, size_t burst)
+{
+    boost::lock_guard<boost::mutex> lock(outbox_mutex_);
+    outbox_.set_budget(bytes_per_second, burst);
+}
+
+size_t udp_server::queued_bytes(ENetPeer* dest) const
+{
+    boost::lock_guard<boost::mutex> lock(outbox_mutex_);
+    return outbox_.queued_bytes(dest);
+}
+
+void udp_server::send_loop()
+{
+    while (true) {
+        std::vector<send_scheduler<ENetPeer*>::item> batch;
+        {
+            boost::unique_lock<boost::mutex> lock(outbox_mutex_);
+            while (sending_.load() && outbox_.empty())
+                outbox_cond_.wait(lock);
+
+            if (!sending_.load())
+                return;
+
+            batch = outbox_.take();
+            dropped_.clear();
+        }
+
+        if (batch.empty()) {
+            // Everything that's left has to wait for its budget.
+            boost::this_thread::sleep_for(milliseconds(5));
+            continue;
+        }
+
+        send_now(batch);
     }
+}
+
+void udp_server::send_now(
+    const std::vector<send_scheduler<ENetPeer*>::item>& batch) const
+{
+    // ENet keeps a reference count in every packet, so one packet can be
+    // sent to any number of peers.
+    std::map<std::pair<const binary_data*, msg::reliability>, ENetPacket*>
+        packets;
+
+    boost::lock_guard<boost::mutex> lock(enet_mutex_);
 
-    auto pkt(enet_packet_create(&msg[0], msg.size(), flags));
+    // disconnect() holds enet_mutex_ as well, so it cannot drop a
+    // connection while this batch is going out.
+    std::set<ENetPeer*> dropped;
     {
-        boost::lock_guard<boost::mutex> lock(enet_mutex_);
-        auto res = enet_peer_send(peer, 0, pkt);
+        boost::lock_guard<boost::mutex> outbox_lock(outbox_mutex_);
+        dropped.swap(dropped_);
+    }
+
+    for (auto& i : batch) {
+        if (dropped.count(i.peer))
+            continue;
+
+        auto& pkt(packets[std::make_pair(i.data.get(), i.method)]);
+        if (pkt == nullptr) {
+            uint32_t flags(0);
+            switch (i.method) {
+            case msg::unreliable:
+                flags = ENET_PACKET_FLAG_UNSEQUENCED;
+                break;
+            case msg::reliable:
+            case msg::sequenced:
+                flags = ENET_PACKET_FLAG_RELIABLE;
+                break;
+            }
+            pkt = enet_packet_create(i.data->data(), i.data->size(), flags);
+        }
+
+        auto res = enet_peer_send(i.peer, 0, pkt);
         if (res != 0)
             log_msg("udp_server send failed with code %1%", -res);
     }
+
+    // Packets that didn't go out to anyone are still ours to clean up.
+    for (auto& p : packets) {
+        if (p.second->referenceCount == 0)
+            enet_packet_destroy(p.second);
+    }
+
+    enet_host_flush(sv_);
 }
 
-void udp_server::disconnect(ENetPeer* peer)
+void udp_server::disconnect(ENetPeer* peer, shared_payload farewell)
 {
     log_msg("udp_server disconnect");
-    enet_peer_disconnect_now(peer, 0);
+
+    // Always lock enet_mutex_ before outbox_mutex_, like send_now() does.
+    boost::lock_guard<boost::mutex> lock(enet_mutex_);
+    if (closing_.count(peer))
+        return;
+
+    {
+        boost::lock_guard<boost::mutex> outbox_lock(outbox_mutex_);
+        outbox_.remove(peer);
+        dropped_.insert(peer);
+    }
+
+    if (!farewell) {
+        enet_peer_disconnect_now(peer, 0);
+        return;
+    }
+
+    // ENet only closes the connection once everything that was queued
+    // before the disconnect has been delivered.
+    auto pkt(enet_packet_create(farewell->data(), farewell->size(),
+                                ENET_PACKET_FLAG_RELIABLE));
+    if (enet_peer_send(peer, 0, pkt) != 0)
+        enet_packet_destroy(pkt);
+
+    enet_peer_disconnect_later(peer, 0);
+    closing_.insert(peer);
 }
 
 } // namespace hexa
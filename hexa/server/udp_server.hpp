@@ -21,11 +21,18 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <atomic>
+#include <set>
 #include <vector>
+#include <boost/chrono.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <enet/enet.h>
 #include <hexa/protocol.hpp>
 
+#include "send_scheduler.hpp"
+
 namespace hexa
 {
 
@@ -35,23 +42,90 @@ public:
     udp_server(uint16_t port, uint16_t max_users = 32);
     virtual ~udp_server();
 
-    void poll(uint16_t milliseconds);
+    /** Handle incoming network events.
+     *  Waits for the first event, and then keeps handling the ones that
+     *  are already waiting, until there are none left or the time budget
+     *  has been used up.
+     * @param milliseconds  How long to wait for the first event
+     * @param budget        How much time can be spent in total.  With
+     *                      the default of zero, only one event is handled.
+     * @return The number of events that were handled */
+    size_t poll(uint16_t milliseconds,
+                boost::chrono::steady_clock::duration budget
+                = boost::chrono::steady_clock::duration::zero());
+
+    /** Queue a message.
+     *  Messages are sent from a separate thread, in order of priority, and
+     *  within the bandwidth budget of the connection.
+     * @param chunks  The chunks the message is about; see
+     *                send_scheduler::push() */
+    void send(ENetPeer* dest, shared_payload msg, msg::reliability method,
+              send_priority prio = send_priority::control,
+              std::vector<chunk_coordinates> chunks = {}) const;
+
+    /** Queue a message.  Prefer the shared_payload version when the same
+     ** message goes out to several connections. */
+    void send(ENetPeer* dest, binary_data msg, msg::reliability method,
+              send_priority prio = send_priority::control,
+              std::vector<chunk_coordinates> chunks = {}) const;
 
-    void send(ENetPeer* dest, const binary_data& msg,
-              msg::reliability method) const;
+    /** Set the bandwidth budget of every connection.
+     * @param bytes_per_second  The budget
+     * @param burst             How many bytes can be sent in one go after
+     *                          a connection has been idle for a while */
+    void set_bandwidth(size_t bytes_per_second, size_t burst);
+
+    /** The number of bytes that are waiting to be sent to a connection. */
+    size_t queued_bytes(ENetPeer* dest) const;
 
     void broadcast(const binary_data& msg, msg::reliability method) const;
 
-    void disconnect(ENetPeer* peer);
+    /** Drop a connection.
+     *  Messages that are still waiting for this connection are thrown
+     *  away, including the ones the send thread is about to hand to
+     *  ENet.  Anything the connection sends after this is ignored.
+     * @param peer      The connection
+     * @param farewell  If given, this message skips the send queue and
+     *                  goes straight to ENet, and the connection is only
+     *                  closed once it has been delivered.  Use this to
+     *                  tell the player why they were dropped. */
+    void disconnect(ENetPeer* peer, shared_payload farewell = nullptr);
 
     virtual void on_connect(ENetPeer* peer) = 0;
     virtual void on_receive(ENetPeer* peer, packet pkt) = 0;
     virtual void on_disconnect(ENetPeer* peer) = 0;
 
+private:
+    /** Handle a single event.
+     * @return False if no event came in before the timeout */
+    bool service(uint32_t milliseconds);
+
+    /** Hand a batch of messages to ENet.  Every payload is turned into
+     ** a single ENet packet, no matter how many connections it goes to.
+     *  Messages for connections that were dropped after the batch was
+     *  taken from the outbox are skipped. */
+    void send_now(
+        const std::vector<send_scheduler<ENetPeer*>::item>& batch) const;
+
+    /** The send thread. */
+    void send_loop();
+
 private:
     ENetAddress addr_;
     ENetHost* sv_;
     mutable boost::mutex enet_mutex_;
+
+    mutable send_scheduler<ENetPeer*> outbox_;
+    mutable boost::mutex outbox_mutex_;
+    mutable boost::condition_variable outbox_cond_;
+    /** Connections dropped since the send thread took its last batch.
+     *  Guarded by outbox_mutex_. */
+    mutable std::set<ENetPeer*> dropped_;
+    /** Connections that are waiting for their farewell message to be
+     ** delivered before they are closed.  Guarded by enet_mutex_. */
+    std::set<ENetPeer*> closing_;
+    std::atomic<bool> sending_;
+    boost::thread send_thread_;
 };
 
 } // namespace hexa
@@ -0,0 +1,104 @@
+//---------------------------------------------------------------------------
+// server/voxel_buffer.cpp
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include "voxel_buffer.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace hexa
+{
+
+voxel_buffer::voxel_buffer()
+{
+    clear();
+}
+
+void voxel_buffer::clear()
+{
+    reset({0, 0, 0}, {0, 0, 0});
+}
+
+void voxel_buffer::reset(const chunk_coordinates& first,
+                         const chunk_coordinates& size)
+{
+    first_chunk_ = first;
+    chunks_ = size;
+    origin_ = first * chunk_size;
+    size_ = size * chunk_size;
+    stride_y_ = size_.x;
+    stride_z_ = size_t(size_.x) * size_.y;
+
+    size_t volume(stride_z_ * size_.z);
+    if (types_.size() < volume) {
+        types_.resize(volume);
+        light_mask_.resize(volume / 16);
+    }
+
+    loaded_.assign(size_t(size.x) * size.y * size.z, 0);
+}
+
+chunk_coordinates voxel_buffer::slot_position(size_t slot) const
+{
+    size_t layer(size_t(chunks_.x) * chunks_.y);
+    return first_chunk_ + chunk_coordinates(slot % chunks_.x,
+                                            (slot % layer) / chunks_.x,
+                                            slot / layer);
+}
+
+void voxel_buffer::load(size_t slot, const chunk& cnk)
+{
+    assert(slot < loaded_.size());
+
+    size_t corner(index(slot_position(slot) * chunk_size));
+    auto src(cnk.begin());
+    for (uint32_t z(0); z < chunk_size; ++z) {
+        for (uint32_t y(0); y < chunk_size; ++y) {
+            size_t dest(corner + y * stride_y_ + z * stride_z_);
+            uint16_t bits(0);
+            for (uint32_t x(0); x < chunk_size; ++x, ++src) {
+                uint16_t type(src->type);
+                types_[dest + x] = type;
+                if (material_opacity[type] != 0)
+                    bits |= 1 << x;
+            }
+            light_mask_[dest >> 4] = bits;
+        }
+    }
+    loaded_[slot] = 1;
+}
+
+void voxel_buffer::load_empty(size_t slot)
+{
+    assert(slot < loaded_.size());
+
+    size_t corner(index(slot_position(slot) * chunk_size));
+    for (uint32_t z(0); z < chunk_size; ++z) {
+        for (uint32_t y(0); y < chunk_size; ++y) {
+            size_t dest(corner + y * stride_y_ + z * stride_z_);
+            std::fill_n(types_.begin() + dest, chunk_size, type::air);
+            light_mask_[dest >> 4] = 0;
+        }
+    }
+    loaded_[slot] = 1;
+}
+
+} // namespace hexa
@@ -0,0 +1,145 @@
+//---------------------------------------------------------------------------
+/// \file   server/voxel_buffer.hpp
+/// \brief  A contiguous copy of a part of the world, for light maps.
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/chunk.hpp>
+
+namespace hexa
+{
+
+/** A box-shaped part of the world, copied into one contiguous array.
+ *  Light map generators look up a lot of blocks around the chunk they're
+ *  working on, and their rays cross chunk borders all the time.  This
+ *  buffer covers the chunk and everything the rays can reach, so a lookup
+ *  is just a bit of index arithmetic.
+ *
+ *  The buffer is laid out as one big array, but it is filled chunk by
+ *  chunk: either the first time a block in that chunk is looked up, or
+ *  when a batch of rays is about to start from a face that has the chunk
+ *  within reach.  That way, chunks that are out of reach of every face are
+ *  not loaded (or generated).
+ *
+ *  Next to the block types, it keeps a bitmask of all blocks that stop
+ *  any light at all: everything except air and fully transparent
+ *  materials.  Every 16 blocks along the x-axis share one 16-bit word.
+ *  Together with the types, this is the volume ray_batch works on. */
+class voxel_buffer
+{
+public:
+    voxel_buffer();
+
+    /** Set up the buffer for a new job, and mark everything as unloaded.
+     *  Memory is only reallocated if the new box is bigger than any of
+     *  the previous ones.
+     * @param first  The first chunk
+     * @param size   The size of the box, in chunks */
+    void reset(const chunk_coordinates& first, const chunk_coordinates& size);
+
+    /** Make the buffer empty. */
+    void clear();
+
+    /** Check if a position lies inside the buffer. */
+    bool contains(const world_coordinates& pos) const
+    {
+        return pos.x - origin_.x < size_.x && pos.y - origin_.y < size_.y
+               && pos.z - origin_.z < size_.z;
+    }
+
+    /** Get the index of a position in the buffer.
+     * @pre contains(pos) */
+    size_t index(const world_coordinates& pos) const
+    {
+        return (pos.x - origin_.x) + (pos.y - origin_.y) * stride_y_
+               + (pos.z - origin_.z) * stride_z_;
+    }
+
+    /** Get the chunk slot that holds a position.
+     * @pre contains(pos) */
+    size_t slot(const world_coordinates& pos) const
+    {
+        return ((pos.x - origin_.x) >> cnkshift)
+               + ((pos.y - origin_.y) >> cnkshift) * chunks_.x
+               + ((pos.z - origin_.z) >> cnkshift) * chunks_.x * chunks_.y;
+    }
+
+    /** The number of chunk slots. */
+    size_t slots() const { return loaded_.size(); }
+
+    /** The number of chunk slots along every axis. */
+    chunk_coordinates chunks() const { return chunks_; }
+
+    /** The position of the first voxel in the buffer. */
+    world_coordinates origin() const { return origin_; }
+
+    /** Check if a chunk slot has been filled. */
+    bool is_loaded(size_t slot) const { return loaded_[slot] != 0; }
+
+    /** The position of the chunk that goes into a given slot. */
+    chunk_coordinates slot_position(size_t slot) const;
+
+    /** Copy a chunk into its slot. */
+    void load(size_t slot, const chunk& cnk);
+
+    /** Fill a chunk slot with air. */
+    void load_empty(size_t slot);
+
+    /** Get the block at a given index.
+     * @pre The chunk slot has been loaded. */
+    block operator[](size_t idx) const { return types_[idx]; }
+
+    /** Check if the block at a given index stops any light.
+     * @pre The chunk slot has been loaded. */
+    bool blocks_light(size_t idx) const
+    {
+        return (light_mask_[idx >> 4] >> (idx & 15)) & 1;
+    }
+
+    /** The material of every block. */
+    const uint16_t* types() const { return types_.data(); }
+
+    /** The bitmask of blocks that stop any light.  \sa blocks_light() */
+    const uint16_t* light_mask() const { return light_mask_.data(); }
+
+    /** Step size in the array when moving one block along the y-axis. */
+    size_t stride_y() const { return stride_y_; }
+
+    /** Step size in the array when moving one block along the z-axis. */
+    size_t stride_z() const { return stride_z_; }
+
+private:
+    world_coordinates origin_;
+    world_coordinates size_;
+    chunk_coordinates first_chunk_;
+    chunk_coordinates chunks_;
+    size_t stride_y_;
+    size_t stride_z_;
+
+    std::vector<uint16_t> types_;
+    std::vector<uint16_t> light_mask_;
+    std::vector<uint8_t> loaded_;
+};
+
+} // namespace hexa
@@ -38,7 +38,10 @@
 using namespace boost::adaptors;
 using namespace boost::range;
 
-constexpr uint8_t finished_phase = 0xff;
+/** How many chunks below the coarse height are scanned when building the
+ ** sky height map.  Only the topmost one is generated if needed; the ones
+ ** below it are only scanned if they already exist. */
+constexpr uint32_t sky_scan_depth = 4;
 
 namespace hexa
 {
@@ -61,6 +64,17 @@ type unpack_as(const compressed_data& data)
     return deserialize_as<type>(decompress(data));
 }
 
+compressed_data pack(const surface_data& data, surface_encoding enc)
+{
+    return compress(encode_surface(data, enc));
+}
+
+template <>
+surface_data unpack_as<surface_data>(const compressed_data& data)
+{
+    return decode_surface(decompress(data));
+}
+
 uint8_t value_convert(uint8_t base, uint8_t radiosity)
 {
     int val = base;
@@ -100,6 +114,7 @@ light_data convert_to_client_lightmap(const light_data_hr& l)
 world::world(persistent_storage_i& storage)
     : storage_(storage)
     , seed_{0}
+    , progressive_lighting_{false}
 {
     empty.clear();
 }
@@ -129,6 +144,15 @@ void world::add_lightmap_generator(std::unique_ptr<lightmap_generator_i>&& gen)
     lightgen_.emplace_back(std::move(gen));
 }
 
+unsigned int world::lightmap_phases() const
+{
+    unsigned int result(1);
+    for (auto& gen : lightgen_)
+        result = std::max(result, gen->phases());
+
+    return result;
+}
+
 void world::cleanup()
 {
     ///\todo Implement cleanup()
@@ -240,13 +264,19 @@ const surface_data& world::get_surface(chunk_coordinates pos)
     } else {
         // Build a surface and store it.
         srf = build_surface(pos);
-        storage_.store(store_surface, pos, pack(srf));
+        storage_.store(store_surface, pos,
+                       pack(srf, storage_.surface_format()));
     }
 
     return srf;
 }
 
 light_data world::get_client_lightmap(chunk_coordinates pos)
+{
+    return convert_to_client_lightmap(get_server_lightmap(pos));
+}
+
+const light_data_hr& world::get_server_lightmap(chunk_coordinates pos)
 {
     assert(pos.x < chunk_world_limit.x);
     assert(pos.y < chunk_world_limit.y);
@@ -256,16 +286,40 @@ light_data world::get_client_lightmap(chunk_coordinates pos)
 
     auto i = lightmaps_.try_get(pos);
     if (i)
-        return convert_to_client_lightmap(*i);
+        return *i;
 
     auto& lm = lightmaps_[pos];
     if (storage_.is_available(store_light, pos)) {
         lm = unpack_as<light_data_hr>(storage_.retrieve(store_light, pos));
     } else {
-        lm = generate_lightmap(pos);
+        lm = generate_lightmap(pos, progressive_lighting_
+                                        ? 0
+                                        : lightmap_phases() - 1);
         storage_.store(store_light, pos, pack(lm));
     }
-    return convert_to_client_lightmap(lm);
+    return lm;
+}
+
+bool world::is_lightmap_final(chunk_coordinates pos)
+{
+    // Light maps with phase 0 were stored before the phases were kept
+    // track of; these were always generated at full quality.
+    auto phase(get_server_lightmap(pos).phase);
+    return phase == 0 || phase >= lightmap_phases();
+}
+
+bool world::refine_lightmap(chunk_coordinates pos)
+{
+    if (is_lightmap_final(pos))
+        return false;
+
+    // The phase of a light map is one higher than the level it was
+    // generated at, so this is the next level.
+    auto lm(generate_lightmap(pos, lightmaps_[pos].phase));
+    storage_.store(persistent_storage_i::light_hr, pos, pack(lm));
+    lightmaps_[pos] = std::move(lm);
+
+    return true;
 }
 
 chunk_height world::get_coarse_height(map_coordinates pos)
@@ -283,17 +337,52 @@ chunk_height world::get_coarse_height(map_coordinates pos)
     return set_coarse_height({pos.x, pos.y, generate_coarse_height(pos)});
 }
 
+const occupancy_map& world::get_occupancy(chunk_coordinates pos)
+{
+    static const occupancy_map air;
+    if (is_air_chunk(pos, get_coarse_height(pos)))
+        return air;
+
+    auto i(occupancy_.try_get(pos));
+    if (i)
+        return *i;
+
+    return occupancy_[pos] = occupancy_map(get_chunk(pos));
+}
+
+const sky_heightmap& world::get_sky_height(map_coordinates pos)
+{
+    auto i(sky_heights_.try_get(pos));
+    if (i)
+        return *i;
+
+    auto result(build_sky_height(pos));
+    return sky_heights_[pos] = result;
+}
+
 compressed_data world::get_compressed_surface(chunk_coordinates pos)
 {
     if (storage_.is_available(persistent_storage_i::surface, pos))
         return storage_.retrieve(persistent_storage_i::surface, pos);
 
-    compressed_data result{pack(get_surface(pos))};
+    compressed_data result{
+        pack(get_surface(pos), storage_.surface_format())};
     storage_.store(persistent_storage_i::surface, pos, result);
 
     return result;
 }
 
+compressed_data world::get_compressed_surface(chunk_coordinates pos,
+                                              surface_encoding enc)
+{
+    // Buffers in face list encoding can be read by everyone.
+    if (enc == surface_encoding::bitmask
+        || storage_.surface_format() == surface_encoding::face_list)
+        return get_compressed_surface(pos);
+
+    return pack(get_surface(pos), enc);
+}
+
 compressed_data world::get_compressed_lightmap(chunk_coordinates pos)
 {
     return pack(get_client_lightmap(pos));
@@ -315,6 +404,11 @@ void world::commit_write(chunk_coordinates pos)
     adjust_coarse_height(pos);
     storage_.store(persistent_storage_i::chunk, pos, pack(chunks_.get(pos)));
 
+    // The sky height map of this column will be rebuilt when the light
+    // maps are regenerated.
+    sky_heights_.remove(pos);
+    occupancy_.remove(pos);
+
     // Update the surface and the six surrounding surfaces.
     for (auto rel : neumann_neighborhood) {
         auto p = pos + rel;
@@ -324,7 +418,8 @@ void world::commit_write(chunk_coordinates pos)
             if (is_surface_available(p))
                 srf.version = get_surface(p).version + 1;
 
-            storage_.store(persistent_storage_i::surface, p, pack(srf));
+            storage_.store(persistent_storage_i::surface, p,
+                           pack(srf, storage_.surface_format()));
             surfaces_[p] = std::move(srf);
         }
     }
@@ -334,7 +429,7 @@ void world::commit_write(chunk_coordinates pos)
         auto p = pos + rel;
         if (!is_air_chunk(p, get_coarse_height(p))) {
             auto& lm = lightmaps_[p];
-            lm = generate_lightmap(p);
+            lm = generate_lightmap(p, lightmap_phases() - 1);
             storage_.store(persistent_storage_i::light_hr, p, pack(lm));
             on_update_surface(p);
         }
@@ -397,6 +492,12 @@ light_data_hr world::generate_lightmap(chunk_coordinates pos, int level)
     light_data_hr result;
     auto& surf = get_surface(pos);
 
+    aabb<world_vector> reach(world_vector(0, 0, 0));
+    for (auto& gen : lightgen_)
+        reach = reach + gen->reach(level);
+
+    proxy.prepare_buffer(pos, reach);
+
     result.opaque.resize(count_faces(surf.opaque));
     if (!result.opaque.empty()) {
         for (auto& gen : lightgen_)
@@ -437,6 +538,7 @@ chunk_height world::generate_coarse_height(map_coordinates pos)
 chunk_height world::set_coarse_height(chunk_coordinates pos)
 {
     coarse_heights_[pos] = pos.z;
+    sky_heights_.remove(pos);
     storage_.store(pos, pos.z);
     on_update_coarse_height(pos);
     return pos.z;
@@ -451,6 +553,62 @@ void world::adjust_coarse_height(chunk_coordinates pos)
     }
 }
 
+sky_heightmap world::build_sky_height(map_coordinates pos)
+{
+    sky_heightmap result;
+    chunk_height top;
+
+    // Generating the chunks we scan might move the coarse height up; if
+    // that happens, we simply start over.
+    do {
+        top = get_coarse_height(pos);
+        if (top >= chunk_world_limit.z) {
+            result.clear();
+            return result;
+        }
+
+        result.clear(top * chunk_size);
+        std::array<bool, chunk_area> found;
+        found.fill(false);
+        unsigned int left(chunk_area);
+
+        for (uint32_t z(top); z > 0 && z + sky_scan_depth > top && left > 0;
+             --z) {
+            // Light maps ask for a lot of columns around a chunk, so
+            // don't generate terrain deep down just to find the sky.  The
+            // heights found so far are a safe estimate.
+            chunk_coordinates cpos(pos.x, pos.y, z - 1);
+            if (z < top && !is_chunk_available(cpos))
+                break;
+
+            const chunk& cnk(get_chunk(cpos));
+
+            for (uint32_t y(0); y < chunk_size; ++y) {
+                for (uint32_t x(0); x < chunk_size; ++x) {
+                    if (found[x + y * chunk_size])
+                        continue;
+
+                    // Scan down until we find something that isn't
+                    // completely transparent.
+                    uint32_t bz(chunk_size);
+                    while (bz > 0
+                           && material_opacity[cnk(x, y, bz - 1).type] == 0)
+                        --bz;
+
+                    result(x, y) = (z - 1) * chunk_size + bz;
+                    if (bz > 0) {
+                        found[x + y * chunk_size] = true;
+                        --left;
+                    }
+                }
+            }
+        }
+    } while (get_coarse_height(pos) != top);
+
+    result.update_max();
+    return result;
+}
+
 surface_data world::build_surface(chunk_coordinates pos)
 {
     world_subsection_read nbh;
@@ -458,8 +616,7 @@ surface_data world::build_surface(chunk_coordinates pos)
     for (auto rel : neumann_neighborhood)
         nbh.add(rel, get_chunk(pos + rel));
 
-    return surface_data(extract_opaque_surface(nbh),
-                        extract_transparent_surface(nbh));
+    return extract_surface(nbh);
 }
 
 //--------------------------------------------------------------------------
@@ -470,36 +627,62 @@ raycast(world& w, const wfpos& origin, const yaw_pitch& direction,
 {
     typedef std::tuple<world_coordinates, world_coordinates> tuple_type;
 
-    auto line(voxel_raycast(
-        origin.frac, origin.frac + from_spherical(direction) * distance));
-    if (line.size() < 2)
-        return tuple_type(origin.pos, origin.pos);
-
     auto proxy(w.acquire_read_access());
-    for (auto i(std::next(line.begin())); i != line.end(); ++i) {
-        world_coordinates pos(*i + origin.pos);
-        auto coll_block(proxy.get_chunk(pos >> cnkshift)[pos % chunk_size]);
-
-        // If it's an air block, we can skip the other checks.
-        if (coll_block.is_air())
-            continue;
+    chunk_coordinates cnk_pos(origin.pos >> cnkshift);
+    const chunk* cnk(&proxy.get_chunk(cnk_pos));
+    const occupancy_map* occ(&proxy.get_occupancy(cnk_pos));
+    tuple_type result(origin.pos, origin.pos);
+
+    vector3<double> from(origin.frac);
+    vector3<double> to(from + vector3<double>(from_spherical(direction)
+                                              * distance));
+
+    voxel_traverse(from, to, [&](const world_vector& cur,
+                                 const world_vector& prev,
+                                 aabb<world_vector>& empty) {
+        world_coordinates pos(origin.pos + cur);
+        if ((pos >> cnkshift) != cnk_pos) {
+            cnk_pos = pos >> cnkshift;
+            cnk = &proxy.get_chunk(cnk_pos);
+            occ = &proxy.get_occupancy(cnk_pos);
+        }
+        chunk_index idx(pos % chunk_size);
+        auto coll_block((*cnk)[idx]);
+
+        // If it's an air block, we can skip the other checks.  The
+        // occupancy map tells us if there's a bigger empty area around
+        // it that can be skipped in one go.
+        if (coll_block.is_air()) {
+            int level(occ->empty_level(idx));
+            if (level > 0) {
+                int size(1 << level);
+                empty.first = cur - world_vector(idx.x % size, idx.y % size,
+                                                 idx.z % size);
+                empty.second = empty.first + world_vector(size, size, size);
+            }
+            return false;
+        }
 
         // If it's a normal block, we found an intersection.
-        auto& coll_material(material_prop[coll_block.type]);
-        if (!coll_material.is_custom_block())
-            return tuple_type(origin.pos + *(i - 1), origin.pos + *i);
+        assert(material_tables_match(coll_block.type));
+        if (!type::is_custom_block(coll_block.type)) {
+            result = tuple_type(origin.pos + prev, pos);
+            return true;
+        }
 
         // It's a custom model; we'll need to do a detailed raycast
         // against every component.
-        ray<float> pr((origin.frac - vector(*i)) * 16.f, direction);
-        for (auto& part : coll_material.model) {
-            auto intsct(ray_box_intersection(pr, part.bounding_box()));
-            if (intsct)
-                return tuple_type(origin.pos + *(i - 1), origin.pos + *i);
+        ray<float> pr((origin.frac - vector(cur)) * 16.f, direction);
+        for (auto& part : material_prop[coll_block.type].model) {
+            if (ray_box_intersection(pr, part.bounding_box())) {
+                result = tuple_type(origin.pos + prev, pos);
+                return true;
+            }
         }
-    }
+        return false;
+    });
 
-    return tuple_type(origin.pos, origin.pos);
+    return result;
 }
 
 } // namespace hexa
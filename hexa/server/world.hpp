@@ -34,6 +34,7 @@
 #include <hexa/compression.hpp>
 #include <hexa/container_uptr.hpp>
 #include <hexa/lightmap.hpp>
+#include <hexa/occupancy_map.hpp>
 #include <hexa/lru_cache.hpp>
 #include <hexa/persistent_storage_i.hpp>
 #include <hexa/read_write_lockable.hpp>
@@ -43,6 +44,8 @@
 #include "lightmap/lightmap_generator_i.hpp"
 #include "terrain/terrain_generator_i.hpp"
 
+#include "sky_heightmap.hpp"
+#include "voxel_buffer.hpp"
 #include "world_read.hpp"
 #include "world_write.hpp"
 
@@ -87,6 +90,16 @@ public:
     /** Terrain generation seed. */
     uint32_t seed() const { return seed_; }
 
+    /** Turn progressive light maps on or off.
+     *  If this is on, new light maps are first generated in the fastest,
+     *  lowest quality phase, so the terrain can be sent to the players
+     *  right away.  The network layer will then call refine_lightmap()
+     *  in the background to bring them up to full quality. */
+    void set_progressive_lighting(bool on) { progressive_lighting_ = on; }
+
+    /** The number of phases of the light map generators. */
+    unsigned int lightmap_phases() const;
+
 public:
     /** Add an area generator. */
     void add_area_generator(std::unique_ptr<area_generator_i>&& gen);
@@ -138,12 +151,35 @@ protected: // Only available through world_read and world_write
 
     const light_data_hr& get_server_lightmap(chunk_coordinates pos);
 
+    /** Check if a light map is at its final quality. */
+    bool is_lightmap_final(chunk_coordinates pos);
+
+    /** Calculate the next phase of a light map.
+     * @return False if the light map was already at its final quality */
+    bool refine_lightmap(chunk_coordinates pos);
+
     chunk_height get_coarse_height(map_coordinates pos);
 
+    /** Get the occupancy map of a chunk.
+     *  The result is cached, and is rebuilt whenever the chunk is
+     *  changed. */
+    const occupancy_map& get_occupancy(chunk_coordinates pos);
+
+    /** Get the sky exposure of a map column.
+     *  The result is cached, and is rebuilt whenever a chunk in this
+     *  column is changed, or the coarse height is adjusted. */
+    const sky_heightmap& get_sky_height(map_coordinates pos);
+
     compressed_data get_compressed_chunk(chunk_coordinates pos);
 
     compressed_data get_compressed_surface(chunk_coordinates pos);
 
+    /** Get a surface in a given encoding.
+     *  The stored surface is returned as is if the receiver can read it,
+     *  otherwise it is encoded again. */
+    compressed_data get_compressed_surface(chunk_coordinates pos,
+                                           surface_encoding enc);
+
     compressed_data get_compressed_lightmap(chunk_coordinates pos);
 
     bool is_area_available(map_coordinates pos, uint16_t idx) const;
@@ -176,6 +212,10 @@ private:
 
     void adjust_coarse_height(chunk_coordinates pos);
 
+    /** Scan a map column from the coarse height down to find the sky
+     ** exposure of every block column. */
+    sky_heightmap build_sky_height(map_coordinates pos);
+
     /** Build a new surface at the given location. */
     surface_data build_surface(chunk_coordinates pos);
 
@@ -193,10 +233,16 @@ private:
     cache_map<chunk> chunks_;
     cache_map<surface_data> surfaces_;
     cache_map<light_data_hr> lightmaps_;
+    cache_map<occupancy_map> occupancy_;
 
     lru_cache<map_coordinates, chunk_height> coarse_heights_;
+    lru_cache<map_coordinates, sky_heightmap> sky_heights_;
+
+    /** Scratch space for the light map generators. */
+    voxel_buffer light_buffer_;
 
     uint32_t seed_;
+    bool progressive_lighting_;
 };
 
 //--------------------------------------------------------------------------
@@ -21,6 +21,8 @@
 
 #include "world_lightmap_access.hpp"
 
+#include <algorithm>
+
 #include "world.hpp"
 
 namespace hexa
@@ -34,15 +36,65 @@ static const chunk dummy_;
 
 world_lightmap_access::world_lightmap_access(world& w)
     : w_(w)
+    , buf_(w.light_buffer_)
     , cached_pos_(-1, -1, -1)
     , cached_cnk_(dummy_)
 {
+    buf_.clear();
 }
 
 world_lightmap_access::~world_lightmap_access()
 {
 }
 
+void world_lightmap_access::prepare_buffer(const chunk_coordinates& pos,
+                                           const aabb<world_vector>& reach)
+{
+    // There's no need to go any higher than the sky; everything above it
+    // is clear anyway.
+    uint32_t sky(get_sky_height(pos, reach));
+    world_coordinates corner(pos * chunk_size);
+    world_coordinates first(corner + reach.first);
+    world_coordinates last(corner + reach.second
+                           + world_vector(chunk_size - 2));
+    if (sky != undefined_height && last.z >= sky)
+        last.z = std::max(sky, first.z + 1) - 1;
+
+    chunk_coordinates first_chunk(first >> cnkshift);
+    buf_.reset(first_chunk,
+               (last >> cnkshift) - first_chunk + chunk_coordinates(1, 1, 1));
+}
+
+void world_lightmap_access::load_buffer(const world_coordinates& pos,
+                                        const aabb<world_vector>& reach)
+{
+    // Find the chunk slots that overlap the reach, relative to the first
+    // slot.  Everything outside the buffer is left alone.
+    world_vector rel(pos - buf_.origin());
+    world_vector first((rel + reach.first) >> cnkshift);
+    world_vector last((rel + reach.second - world_vector(1)) >> cnkshift);
+    world_vector chunks(buf_.chunks());
+
+    for (int32_t z(std::max(first.z, 0)); z <= std::min(last.z, chunks.z - 1);
+         ++z) {
+        for (int32_t y(std::max(first.y, 0));
+             y <= std::min(last.y, chunks.y - 1); ++y) {
+            for (int32_t x(std::max(first.x, 0));
+                 x <= std::min(last.x, chunks.x - 1); ++x) {
+                size_t slot(x + (y + size_t(z) * chunks.y) * chunks.x);
+                if (buf_.is_loaded(slot))
+                    continue;
+
+                auto cpos(buf_.slot_position(slot));
+                if (w_.is_chunk_available(cpos))
+                    buf_.load(slot, get_chunk(cpos));
+                else
+                    buf_.load_empty(slot);
+            }
+        }
+    }
+}
+
 const chunk& world_lightmap_access::get_chunk(const chunk_coordinates& pos)
 {
     if (pos == cached_pos_)
@@ -60,4 +112,57 @@ world_lightmap_access::get_surface(const chunk_coordinates& pos)
     return w_.get_surface(pos);
 }
 
+const sky_heightmap&
+world_lightmap_access::get_sky_height(const map_coordinates& pos)
+{
+    return w_.get_sky_height(pos);
+}
+
+uint32_t world_lightmap_access::get_sky_height(const chunk_coordinates& pos,
+                                               const aabb<world_vector>& reach)
+{
+    world_coordinates corner(pos * chunk_size);
+    uint32_t result(0);
+    for (uint32_t y((corner.y + reach.first.y) >> cnkshift);
+         y <= (corner.y + chunk_size - 2 + reach.second.y) >> cnkshift; ++y) {
+        for (uint32_t x((corner.x + reach.first.x) >> cnkshift);
+             x <= (corner.x + chunk_size - 2 + reach.second.x) >> cnkshift;
+             ++x) {
+            result = std::max(result, w_.get_sky_height({x, y}).max());
+        }
+    }
+    return result;
+}
+
+sky_heightmap
+world_lightmap_access::get_sky_heights(const chunk_coordinates& pos,
+                                       const aabb<world_vector>& reach)
+{
+    world_vector window(reach.second - reach.first);
+    world_coordinates first(pos * chunk_size + reach.first);
+    uint32_t width(chunk_size - 1 + window.x);
+    uint32_t height(chunk_size - 1 + window.y);
+
+    // Copy the heights of every block column the rays can reach, one
+    // map column at a time.
+    std::vector<uint32_t> grid(size_t(width) * height);
+    for (uint32_t y(0); y < height;) {
+        uint32_t wy(first.y + y), ly(wy % chunk_size);
+        uint32_t rows(std::min(chunk_size - ly, height - y));
+        for (uint32_t x(0); x < width;) {
+            uint32_t wx(first.x + x), lx(wx % chunk_size);
+            uint32_t cols(std::min(chunk_size - lx, width - x));
+            auto& sky(w_.get_sky_height({wx >> cnkshift, wy >> cnkshift}));
+            for (uint32_t j(0); j < rows; ++j) {
+                for (uint32_t i(0); i < cols; ++i)
+                    grid[x + i + (y + j) * width] = sky(lx + i, ly + j);
+            }
+            x += cols;
+        }
+        y += rows;
+    }
+
+    return window_max(grid, window.x, window.y);
+}
+
 } // namespace hexa
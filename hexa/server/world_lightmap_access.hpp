@@ -23,14 +23,17 @@
 
 #include <boost/optional.hpp>
 
+#include "../aabb.hpp"
 #include "../basic_types.hpp"
 #include "../chunk.hpp"
+#include "voxel_buffer.hpp"
 
 namespace hexa
 {
 
 class area_data;
 class chunk;
+class sky_heightmap;
 class surface_data;
 class world;
 
@@ -40,6 +43,7 @@ class world;
 class world_lightmap_access
 {
     world& w_;
+    voxel_buffer& buf_;
 
     chunk_coordinates cached_pos_;
     std::reference_wrapper<const chunk> cached_cnk_;
@@ -63,9 +67,65 @@ public:
 
     const surface_data& get_surface(const chunk_coordinates& pos);
 
+    const sky_heightmap& get_sky_height(const map_coordinates& pos);
+
+    /** Find the height above which all rays are in the open.
+     * @param pos    The rays start from any block in this chunk
+     * @param reach  The voxels the rays can visit, relative to the
+     *               starting block
+     * @return The highest sky height of all map columns these rays can
+     *         reach. */
+    uint32_t get_sky_height(const chunk_coordinates& pos,
+                            const aabb<world_vector>& reach);
+
+    /** Find the height above which all rays are in the open, for every
+     ** block column of a chunk separately.
+     * @param pos    The rays start from any block in this chunk
+     * @param reach  The voxels the rays can visit, relative to the
+     *               starting block
+     * @return For every block column, the highest sky height of all
+     *         block columns its rays can reach. */
+    sky_heightmap get_sky_heights(const chunk_coordinates& pos,
+                                  const aabb<world_vector>& reach);
+
+    /** Prepare the voxel buffer for a new light map.
+     * @param pos    The chunk that is being lit
+     * @param reach  The voxels the light map generators can visit,
+     *               relative to a block in this chunk */
+    void prepare_buffer(const chunk_coordinates& pos,
+                        const aabb<world_vector>& reach);
+
+    /** The voxel buffer.  Call load_buffer() for every starting block
+     ** before reading it directly. */
+    const voxel_buffer& buffer() const { return buf_; }
+
+    /** Fill the part of the voxel buffer that rays from a block can get
+     ** to.
+     *  Normally, the buffer is filled one chunk at a time, as the blocks
+     *  are looked up.  Use this before accessing the buffer directly.
+     *  Chunks that haven't been generated yet are filled with air instead
+     *  of generating them; lighting should not set off terrain
+     *  generation all around the chunk.
+     * @param pos    The block the rays start from
+     * @param reach  The voxels the rays can visit, relative to \a pos */
+    void load_buffer(const world_coordinates& pos,
+                     const aabb<world_vector>& reach);
+
     const block operator[](const world_coordinates& pos)
     {
-        return get_chunk(pos >> cnkshift)[pos % chunk_size];
+        if (!buf_.contains(pos))
+            return get_chunk(pos >> cnkshift)[pos % chunk_size];
+
+        load_slot(pos);
+        return buf_[buf_.index(pos)];
+    }
+
+private:
+    void load_slot(const world_coordinates& pos)
+    {
+        auto slot(buf_.slot(pos));
+        if (!buf_.is_loaded(slot))
+            buf_.load(slot, get_chunk(buf_.slot_position(slot)));
     }
 };
 
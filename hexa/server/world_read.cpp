@@ -62,21 +62,47 @@ light_data world_read::get_lightmap(chunk_coordinates pos)
     return w_.get_client_lightmap(pos);
 }
 
+light_data_hr world_read::generate_lightmap(chunk_coordinates pos, int level)
+{
+    return w_.generate_lightmap(pos, level);
+}
+
 compressed_data world_read::get_compressed_surface(chunk_coordinates pos)
 {
     return w_.get_compressed_surface(pos);
 }
 
+compressed_data world_read::get_compressed_surface(chunk_coordinates pos,
+                                                   surface_encoding enc)
+{
+    return w_.get_compressed_surface(pos, enc);
+}
+
 compressed_data world_read::get_compressed_lightmap(chunk_coordinates pos)
 {
     return w_.get_compressed_lightmap(pos);
 }
 
+bool world_read::is_lightmap_final(chunk_coordinates pos)
+{
+    return w_.is_lightmap_final(pos);
+}
+
+bool world_read::refine_lightmap(chunk_coordinates pos)
+{
+    return w_.refine_lightmap(pos);
+}
+
 chunk_height world_read::get_coarse_height(map_coordinates pos)
 {
     return w_.get_coarse_height(pos);
 }
 
+const occupancy_map& world_read::get_occupancy(chunk_coordinates pos)
+{
+    return w_.get_occupancy(pos);
+}
+
 bool world_read::is_area_available(map_coordinates pos, uint16_t index) const
 {
     return w_.is_area_available(pos, index);
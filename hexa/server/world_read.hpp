@@ -35,6 +35,7 @@ namespace hexa
 class area_data;
 class chunk;
 class compressed_data;
+class occupancy_map;
 class world;
 
 /** This object grants read access to the game world. */
@@ -67,12 +68,30 @@ public:
 
     light_data get_lightmap(chunk_coordinates pos);
 
+    /** Calculate a light map from scratch.
+     *  The result is not cached or stored anywhere; this is meant for
+     *  benchmarks and tests.
+     * @param level  The phase, 0 up to world::lightmap_phases() */
+    light_data_hr generate_lightmap(chunk_coordinates pos, int level);
+
     chunk_height get_coarse_height(map_coordinates pos);
 
+    const occupancy_map& get_occupancy(chunk_coordinates pos);
+
     compressed_data get_compressed_surface(chunk_coordinates pos);
 
+    compressed_data get_compressed_surface(chunk_coordinates pos,
+                                           surface_encoding enc);
+
     compressed_data get_compressed_lightmap(chunk_coordinates pos);
 
+    /** Check if a light map is at its final quality. */
+    bool is_lightmap_final(chunk_coordinates pos);
+
+    /** Calculate the next phase of a light map.
+     * @return False if there was nothing left to do */
+    bool refine_lightmap(chunk_coordinates pos);
+
     bool is_area_available(map_coordinates pos, uint16_t index) const;
     bool is_chunk_available(chunk_coordinates pos) const;
     bool is_surface_available(chunk_coordinates pos) const;
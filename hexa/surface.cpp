@@ -21,6 +21,10 @@
 
 #include "surface.hpp"
 
+#include <cassert>
+
+#include "serialize.hpp"
+
 namespace hexa
 {
 
@@ -64,4 +68,315 @@ size_t count_faces(const surface& s)
     return result;
 }
 
+namespace
+{
+
+inline int bitcount(uint8_t x)
+{
+#if defined(__GNUC__) && !defined(HEXA_FORCE_SW_BITCOUNT)
+    return __builtin_popcount(x);
+#else
+    int result(0);
+    for (; x; x &= x - 1)
+        ++result;
+    return result;
+#endif
+}
+
+inline bool inside_chunk(const chunk_index& p)
+{
+    return p.x >= 0 && p.y >= 0 && p.z >= 0 && p.x < chunk_size
+           && p.y < chunk_size && p.z < chunk_size;
+}
+
+inline size_t table_index(const chunk_index& p)
+{
+    return p.x + p.y * chunk_size + p.z * chunk_area;
+}
+
+} // anonymous namespace
+
+constexpr int surface_index::not_found;
+
+surface_index::surface_index(const surface& s)
+    : s_(s)
+    , blocks_(chunk_volume, 0)
+{
+    assert(s.size() < 0xffff);
+    first_face_.reserve(s.size());
+
+    uint16_t face(0);
+    for (size_t i(0); i < s.size(); ++i) {
+        assert(inside_chunk(s[i].pos));
+        blocks_[table_index(s[i].pos)] = i + 1;
+        first_face_.push_back(face);
+        // Custom blocks use the magic value 255, but only ever have six
+        // faces in a light map.
+        face += bitcount(s[i].dirs & 0x3f);
+    }
+}
+
+int surface_index::find(const chunk_index& p) const
+{
+    if (!inside_chunk(p))
+        return not_found;
+
+    return int(blocks_[table_index(p)]) - 1;
+}
+
+int surface_index::find(const chunk_index& p, int dir) const
+{
+    int i(find(p));
+    if (i == not_found)
+        return not_found;
+
+    uint8_t dirs(s_[i].dirs);
+    if ((dirs & (1 << dir)) == 0)
+        return not_found;
+
+    return first_face_[i] + bitcount(dirs & ((1 << dir) - 1));
+}
+
+//---------------------------------------------------------------------------
+
+namespace
+{
+
+/** Buffers in bitmask encoding start with this value, where face lists
+ ** have the surface version.  Versions go up one at a time, and will
+ ** never get this high. */
+const uint32_t bitmask_tag = 0xfffffff1;
+
+/** How the two parts of a surface are written in bitmask encoding. */
+enum : uint8_t { layout_list = 0, layout_mask = 1 };
+
+inline int bitcount64(uint64_t x)
+{
+#if defined(__GNUC__) && !defined(HEXA_FORCE_SW_BITCOUNT)
+    return __builtin_popcountll(x);
+#else
+    int result(0);
+    for (; x; x &= x - 1)
+        ++result;
+    return result;
+#endif
+}
+
+inline int lowest_bit64(uint64_t x)
+{
+    assert(x != 0);
+#if defined(__GNUC__) && !defined(HEXA_FORCE_SW_BITCOUNT)
+    return __builtin_ctzll(x);
+#else
+    int result(0);
+    for (; (x & 1) == 0; x >>= 1)
+        ++result;
+    return result;
+#endif
+}
+
+inline size_t canonical_rank(const chunk_index& p)
+{
+    const int last(chunk_size - 1);
+    bool outside(p.x == 0 || p.y == 0 || p.z == 0 || p.x == last
+                 || p.y == last || p.z == last);
+    return table_index(p) + (outside ? 0 : chunk_volume);
+}
+
+static_assert(chunk_size == 16, "Morton codes assume 4 bits per axis");
+
+/** Put the lowest four bits of a number three bits apart. */
+inline uint16_t spread(uint16_t x)
+{
+    return (x & 1) | ((x & 2) << 2) | ((x & 4) << 4) | ((x & 8) << 6);
+}
+
+/** The opposite of spread(). */
+inline int8_t compact(uint16_t x)
+{
+    return (x & 1) | ((x >> 2) & 2) | ((x >> 4) & 4) | ((x >> 6) & 8);
+}
+
+inline chunk_index from_morton_code(uint16_t code)
+{
+    return chunk_index(compact(code), compact(code >> 1), compact(code >> 2));
+}
+
+template <typename archive>
+void write_part(archive& ar, const surface& s)
+{
+    // A face list uses five bytes per block, the bitmask three plus the
+    // mask itself and two length prefixes.
+    const size_t list_size(s.size() * 5);
+    const size_t mask_size(chunk_volume / 8 + 4 + s.size() * 3);
+
+    if (mask_size >= list_size || !is_canonical_order(s)) {
+        ar(uint8_t(layout_list))(s);
+        return;
+    }
+
+    // The materials go through the serializer's array path, so they end
+    // up in network byte order like everything else.
+    auto b(to_bitmask(s));
+    ar(uint8_t(layout_mask));
+    for (auto word : b.mask)
+        ar(word);
+
+    ar(b.dirs)(b.types);
+}
+
+template <typename archive>
+void read_part(archive& ar, surface& s)
+{
+    uint8_t layout;
+    ar(layout);
+    if (layout == layout_list) {
+        ar(s);
+        return;
+    }
+    if (layout != layout_mask)
+        throw serialize_error("unknown surface layout");
+
+    surface_bitmask b;
+    size_t total(0);
+    for (auto& word : b.mask) {
+        ar(word);
+        total += bitcount64(word);
+    }
+    ar(b.dirs)(b.types);
+    if (b.dirs.size() != total || b.types.size() != total)
+        throw serialize_error("surface bitmask does not match its size");
+
+    s = from_bitmask(b);
+}
+
+} // anonymous namespace
+
+uint16_t morton_code(const chunk_index& p)
+{
+    assert(inside_chunk(p));
+    return spread(p.x) | (spread(p.y) << 1) | (spread(p.z) << 2);
+}
+
+bool is_canonical_order(const surface& s)
+{
+    size_t prev(0);
+    for (size_t i(0); i < s.size(); ++i) {
+        if (!inside_chunk(s[i].pos))
+            return false;
+
+        auto rank(canonical_rank(s[i].pos));
+        if (i > 0 && rank <= prev)
+            return false;
+
+        prev = rank;
+    }
+    return true;
+}
+
+surface_bitmask to_bitmask(const surface& s)
+{
+    assert(is_canonical_order(s));
+
+    std::vector<int16_t> by_code(chunk_volume, -1);
+    surface_bitmask result;
+    for (size_t i(0); i < s.size(); ++i) {
+        auto code(morton_code(s[i].pos));
+        by_code[code] = i;
+        result.mask[code >> 6] |= uint64_t(1) << (code & 63);
+    }
+
+    result.dirs.reserve(s.size());
+    result.types.reserve(s.size());
+    for (auto i : by_code) {
+        if (i >= 0) {
+            result.dirs.push_back(s[i].dirs);
+            result.types.push_back(s[i].type);
+        }
+    }
+    return result;
+}
+
+surface from_bitmask(const surface_bitmask& s)
+{
+    // Go through the blocks in Morton order, and sort them into rows
+    // along the x axis.
+    std::array<uint16_t, chunk_area> rows;
+    std::array<uint16_t, chunk_volume> data;
+    rows.fill(0);
+    uint16_t count(0);
+    for (size_t w(0); w < s.mask.size(); ++w) {
+        for (uint64_t bits(s.mask[w]); bits; bits &= bits - 1, ++count) {
+            auto p(from_morton_code(w * 64 + lowest_bit64(bits)));
+            rows[p.y + p.z * chunk_size] |= 1 << p.x;
+            data[table_index(p)] = count;
+        }
+    }
+    assert(count == s.size());
+
+    surface result;
+    result.reserve(count);
+    auto emit = [&](uint16_t bits, int y, int z) {
+        for (; bits; bits &= bits - 1) {
+            chunk_index p(lowest_bit64(bits), y, z);
+            auto i(data[table_index(p)]);
+            result.emplace_back(p, s.dirs[i], s.types[i]);
+        }
+    };
+
+    // The outside of the chunk first, then the inside.
+    const int last(chunk_size - 1);
+    const uint16_t sides(1 | (1 << last));
+    for (int z(0); z < chunk_size; ++z) {
+        for (int y(0); y < chunk_size; ++y) {
+            bool edge(z == 0 || z == last || y == 0 || y == last);
+            auto row(rows[y + z * chunk_size]);
+            emit(edge ? row : row & sides, y, z);
+        }
+    }
+    for (int z(1); z < last; ++z) {
+        for (int y(1); y < last; ++y)
+            emit(rows[y + z * chunk_size] & ~sides, y, z);
+    }
+    return result;
+}
+
+binary_data encode_surface(const surface_data& s, surface_encoding enc)
+{
+    binary_data result;
+    auto ar(make_serializer(result));
+    if (enc == surface_encoding::face_list) {
+        ar(s);
+    } else {
+        ar(bitmask_tag)(s.version);
+        write_part(ar, s.opaque);
+        write_part(ar, s.transparent);
+    }
+    return result;
+}
+
+surface_data decode_surface(const binary_data& buf)
+{
+    if (encoding_of(buf) == surface_encoding::face_list)
+        return deserialize_as<surface_data>(buf);
+
+    surface_data result;
+    auto ar(make_deserializer(buf));
+    uint32_t tag;
+    ar(tag)(result.version);
+    read_part(ar, result.opaque);
+    read_part(ar, result.transparent);
+    return result;
+}
+
+surface_encoding encoding_of(const binary_data& buf)
+{
+    if (buf.size() < sizeof(bitmask_tag))
+        return surface_encoding::face_list;
+
+    return deserialize_as<uint32_t>(buf) == bitmask_tag
+               ? surface_encoding::bitmask
+               : surface_encoding::face_list;
+}
+
 } // namespace hexa
@@ -21,6 +21,7 @@
 //---------------------------------------------------------------------------
 #pragma once
 
+#include <array>
 #include <memory>
 #include <vector>
 #include "basic_types.hpp"
@@ -127,4 +128,99 @@ public:
 /** Count the number of faces in a surface. */
 size_t count_faces(const surface& s);
 
+/** Fast lookup of blocks and faces in a surface, by position.
+ *  A surface is a plain list, so finding a block in it means a linear
+ *  search.  This index is built once, and after that every lookup is a
+ *  single table access.  It keeps a reference to the surface, so it must
+ *  not outlive it, and it has to be rebuilt if the surface changes. */
+class surface_index
+{
+public:
+    /** Value returned if a block or face is not part of the surface. */
+    static constexpr int not_found = -1;
+
+    surface_index(const surface& s);
+
+    /** Find a block.
+     * @param p  The position of the block.  It is allowed to lie outside
+     *           the chunk, this is simply reported as not found.
+     * @return The block's index in the surface, or \a not_found */
+    int find(const chunk_index& p) const;
+
+    /** Find a face.
+     *  The faces of a surface are numbered block by block, and within a
+     *  block in the order of the directions.  This is the same order
+     *  as the light map of the surface.
+     * @param p    The position of the block
+     * @param dir  The direction of the face (0..5)
+     * @return The face's index, or \a not_found */
+    int find(const chunk_index& p, int dir) const;
+
+private:
+    const surface& s_;
+    /** Index in the surface plus one, for every block in the chunk. */
+    std::vector<uint16_t> blocks_;
+    /** Index of the first face, for every block in the surface. */
+    std::vector<uint16_t> first_face_;
+};
+
+/** The ways a surface_data can be laid out in storage or on the wire. */
+enum class surface_encoding : uint8_t {
+    /** Every block as a faces record, in the order of the surface.  This
+     ** is what surface_data::serialize() produces. */
+    face_list = 0,
+    /** A mask of the blocks in the chunk that have any visible faces,
+     ** followed by their direction masks and materials in Morton order. */
+    bitmask = 1
+};
+
+/** A surface in bitmask layout.
+ *  The bitmask layout doesn't store the order of the blocks.  It can
+ *  only be used for surfaces in canonical order, which is the order
+ *  extract_surface() builds them in: the blocks on the outside of the
+ *  chunk first, then the ones on the inside, both sorted by z, y, x. */
+class surface_bitmask
+{
+public:
+    /** One bit for every block, indexed by its Morton code. */
+    std::array<uint64_t, chunk_volume / 64> mask;
+    /** The direction masks of the blocks in the mask, in Morton order. */
+    std::vector<uint8_t> dirs;
+    /** The materials of the blocks in the mask, in Morton order. */
+    std::vector<uint16_t> types;
+
+public:
+    surface_bitmask() { mask.fill(0); }
+
+    /** The number of blocks. */
+    size_t size() const { return dirs.size(); }
+};
+
+/** The Morton code of a block in a chunk (x in the lowest bit). */
+uint16_t morton_code(const chunk_index& p);
+
+/** Check if a surface is in canonical order.  \sa surface_bitmask */
+bool is_canonical_order(const surface& s);
+
+/** Convert a surface to bitmask layout.
+ * @pre is_canonical_order(s) */
+surface_bitmask to_bitmask(const surface& s);
+
+/** Convert a surface from bitmask layout.
+ * @return The surface, in canonical order */
+surface from_bitmask(const surface_bitmask& s);
+
+/** Encode a surface for storage or sending.
+ *  Surfaces encoded as face_list are exactly what serializing a
+ *  surface_data gives.  With bitmask, the opaque and transparent parts
+ *  are still written as face lists if that's smaller, or if they are not
+ *  in canonical order. */
+binary_data encode_surface(const surface_data& s, surface_encoding enc);
+
+/** Decode a buffer made by encode_surface(), in either encoding. */
+surface_data decode_surface(const binary_data& buf);
+
+/** Find out which encoding was used for a buffer. */
+surface_encoding encoding_of(const binary_data& buf);
+
 } // namespace hexa
@@ -25,6 +25,7 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <future>
 #include <memory>
 #include <thread>
@@ -97,19 +98,38 @@ public:
         return result;
     }
 
+    /** Add a low priority job to the queue.
+     *  These jobs are only picked up if there is nothing else to do.
+     *  Unlike the normal jobs, they are dropped if the pool is stopped
+     *  before they could run.
+     * @param f     The function to be added to the work queue */
+    template <typename Func>
+    void enqueue_idle(Func&& f)
+    {
+        if (stop_)
+            throw std::runtime_error("threadpool was stopped");
+
+        {
+            std::unique_lock<std::mutex> lock{queue_mutex_};
+            idle_tasks_.emplace(std::forward<Func>(f));
+        }
+        condition_.notify_one();
+    }
+
 private:
     void worker()
     {
         for (;;) {
             std::unique_lock<std::mutex> lock{queue_mutex_};
-            while (!stop_ && tasks_.empty())
+            while (!stop_ && tasks_.empty() && idle_tasks_.empty())
                 condition_.wait(lock);
 
             if (stop_ && tasks_.empty())
                 break;
 
-            auto task = tasks_.front();
-            tasks_.pop();
+            auto& queue = tasks_.empty() ? idle_tasks_ : tasks_;
+            auto task = queue.front();
+            queue.pop();
             lock.unlock();
 
             task();
@@ -119,6 +139,7 @@ private:
 private:
     std::vector<std::thread> workers_;
     std::queue<std::function<void()>> tasks_;
+    std::queue<std::function<void()>> idle_tasks_;
     std::atomic_bool stop_;
     std::mutex queue_mutex_;
     std::condition_variable condition_;
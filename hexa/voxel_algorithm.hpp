@@ -22,7 +22,9 @@
 #pragma once
 
 #include <cmath>
+#include <limits>
 #include <utility>
+#include "aabb.hpp"
 #include "vector3.hpp"
 #include "algorithm.hpp"
 
@@ -121,6 +123,104 @@ func voxel_raycast(vector from, vector to, func op)
     }
     return op;
 }
+/** Follow a line through the voxel grid, skipping empty space.
+ *  This is a voxel traversal as described by Amanatides and Woo.  The
+ *  callback is invoked for every voxel after the first one, with the
+ *  voxel itself and the one before it.  It returns true to stop the
+ *  traversal.  It can also fill in a box of voxels around the current
+ *  one that is known to be empty; the traversal then jumps straight to
+ *  the last voxel inside that box along the line.
+ *
+ *  Example:
+ *  \code
+ *  voxel_traverse(from, to, [&](const vector3<int>& v,
+ *                               const vector3<int>& prev,
+ *                               aabb<vector3<int>>& empty) {
+ *      if (is_solid(v))
+ *          return true;
+ *      empty = find_empty_area(v);
+ *      return false;
+ *  });
+ *  \endcode
+ * @param from  Starting point
+ * @param to    End point
+ * @param op    bool op(voxel, previous voxel, empty box)
+ * @return True if \a op stopped the traversal */
+template <class func>
+bool voxel_traverse(const vector3<double>& from, const vector3<double>& to,
+                    func op)
+{
+    typedef vector3<int> voxel;
+    const double inf(std::numeric_limits<double>::infinity());
+
+    // The line is parametrized from 0 to 1.
+    vector3<double> dir(to - from);
+    voxel cur(static_cast<int>(std::floor(from.x)),
+              static_cast<int>(std::floor(from.y)),
+              static_cast<int>(std::floor(from.z)));
+    voxel prev(cur), step(0, 0, 0);
+    vector3<double> t_max(inf, inf, inf), t_delta(inf, inf, inf);
+
+    auto reset = [&] {
+        for (int i(0); i < 3; ++i) {
+            if (dir[i] > 0)
+                t_max[i] = (cur[i] + 1 - from[i]) / dir[i];
+            else if (dir[i] < 0)
+                t_max[i] = (cur[i] - from[i]) / dir[i];
+        }
+    };
+
+    for (int i(0); i < 3; ++i) {
+        step[i] = dir[i] > 0 ? 1 : (dir[i] < 0 ? -1 : 0);
+        if (dir[i] != 0)
+            t_delta[i] = 1.0 / std::abs(dir[i]);
+    }
+    reset();
+
+    double t(0);
+    for (;;) {
+        int axis(t_max.x <= t_max.y ? (t_max.x <= t_max.z ? 0 : 2)
+                                    : (t_max.y <= t_max.z ? 1 : 2));
+        if (t_max[axis] > 1.0)
+            return false;
+
+        t = t_max[axis];
+        prev = cur;
+        cur[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+
+        aabb<voxel> empty(cur, cur);
+        if (op(cur, prev, empty))
+            return true;
+
+        if (!empty.is_correct() || !is_inside(cur, empty))
+            continue;
+
+        // Find where the line leaves the empty box.
+        double t_exit(inf);
+        for (int i(0); i < 3; ++i) {
+            double edge(dir[i] > 0 ? empty.second[i] : empty.first[i]);
+            if (dir[i] != 0)
+                t_exit = std::min(t_exit, (edge - from[i]) / dir[i]);
+        }
+
+        // Only jump if it gets us somewhere; rounding errors could
+        // otherwise get us stuck at the edge of the box.
+        if (t_exit <= t + 1e-9)
+            continue;
+
+        if (t_exit > 1.0)
+            return false;
+
+        for (int i(0); i < 3; ++i) {
+            int c(static_cast<int>(std::floor(from[i] + dir[i] * t_exit)));
+            cur[i] = clamp(c, empty.first[i], empty.second[i] - 1);
+        }
+        t = t_exit;
+        reset();
+    }
+}
+
 inline std::vector<vector3<int>> dumbass_line(vector3<float> f,
                                               vector3<float> to)
 {
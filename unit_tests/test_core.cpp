@@ -2,6 +2,7 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <random>
 #include <set>
@@ -13,24 +14,36 @@
 
 #include <hexa/aabb.hpp>
 #include <hexa/algorithm.hpp>
+#include <hexa/base58.hpp>
+#include <hexa/bots/bot_stats.hpp>
 #include <hexa/chunk.hpp>
 #include <hexa/collision.hpp>
 #include <hexa/compression.hpp>
 #include <hexa/concurrent_queue.hpp>
 #include <hexa/crypto.hpp>
+#include <hexa/entity_snapshot.hpp>
 #include <hexa/geometric.hpp>
 #include <hexa/hotbar_slot.hpp>
 #include <hexa/json.hpp>
 #include <hexa/lru_cache.hpp>
+#include <hexa/occupancy_map.hpp>
 #include <hexa/persistence_leveldb.hpp>
 #include <hexa/persistence_null.hpp>
 #include <hexa/protocol.hpp>
 #include <hexa/quaternion.hpp>
+#include <hexa/server/aoi_grid.hpp>
+#include <hexa/server/authenticator.hpp>
+#include <hexa/server/chunk_request_queue.hpp>
 #include <hexa/server/random.hpp>
+#include <hexa/server/send_scheduler.hpp>
+#include <hexa/server/sky_heightmap.hpp>
+#include <hexa/server/tick_scheduler.hpp>
+#include <hexa/server/lightmap/ray_bundle_cache.hpp>
 #include <hexa/ray.hpp>
 #include <hexa/ray_bundle.hpp>
 #include <hexa/serialize.hpp>
 #include <hexa/surface.hpp>
+#include <hexa/threadpool.hpp>
 #include <hexa/trace.hpp>
 #include <hexa/vector3.hpp>
 #include <hexa/voxel_algorithm.hpp>
@@ -160,6 +173,52 @@ BOOST_AUTO_TEST_CASE (serialize_test)
     BOOST_CHECK(test_cnk == compare_cnk);
 }
 
+BOOST_AUTO_TEST_CASE (serialize_array_test)
+{
+    typedef std::vector<uint8_t> buffer;
+
+    std::vector<uint16_t> u16 {1, 0x1234, 0xffff};
+    std::vector<int32_t> i32 {-1, 0x12345678, 0};
+    std::vector<float> f32 {3.141f, -2.5f};
+    std::vector<double> f64 {1.0 / 3.0};
+    std::vector<int8_t> i8 {-128, 0, 127};
+    std::vector<std::string> str {"foo", "", "bar"};
+
+    buffer a;
+    make_serializer(a)(u16)(i32)(f32)(f64)(i8)(str);
+    BOOST_CHECK_EQUAL(a.size(), 6 * 2 + 3 * 2 + 3 * 4 + 2 * 4 + 8 + 3
+                                    + 3 * 2 + 6);
+
+    // Arrays of numbers keep the same big-endian layout as single values.
+    BOOST_CHECK_EQUAL(a[4], 0x12);
+    BOOST_CHECK_EQUAL(a[5], 0x34);
+
+    std::vector<uint16_t> u16_out;
+    std::vector<int32_t> i32_out;
+    std::vector<float> f32_out;
+    std::vector<double> f64_out;
+    std::vector<int8_t> i8_out;
+    std::vector<std::string> str_out;
+    auto dser (make_deserializer(a));
+    dser(u16_out)(i32_out)(f32_out)(f64_out)(i8_out)(str_out);
+    BOOST_CHECK_EQUAL(dser.bytes_left(), 0);
+    BOOST_CHECK(u16 == u16_out);
+    BOOST_CHECK(i32 == i32_out);
+    BOOST_CHECK(f32 == f32_out);
+    BOOST_CHECK(f64 == f64_out);
+    BOOST_CHECK(i8 == i8_out);
+    BOOST_CHECK(str == str_out);
+
+    // A truncated array is caught.
+    a.resize(4);
+    std::vector<uint16_t> short_out;
+    BOOST_CHECK_THROW(make_deserializer(a)(short_out), serialize_error);
+
+    // So is an array that doesn't fit in the 16-bit length prefix.
+    std::vector<uint16_t> too_long(70000);
+    BOOST_CHECK_THROW(make_serializer(a)(too_long), serialize_error);
+}
+
 BOOST_AUTO_TEST_CASE (vector2_test)
 {
     vector2<int> first (1, 2);
@@ -378,6 +437,96 @@ BOOST_AUTO_TEST_CASE (bresenham_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE (voxel_traverse_test)
+{
+    // A sparse grid of solid voxels, 32x32x32.
+    std::mt19937 prng;
+    std::uniform_int_distribution<int> solid (0, 49);
+    std::vector<bool> grid (32 * 32 * 32);
+    for (size_t i (0); i < grid.size(); ++i)
+        grid[i] = solid(prng) == 0;
+
+    auto is_solid = [&](const vector3<int>& v)
+    {
+        return grid[(v.x & 31) + (v.y & 31) * 32 + (v.z & 31) * 1024];
+    };
+
+    // The aligned 4x4x4 cell around a voxel, if it is empty.
+    auto empty_cell = [&](const vector3<int>& v)
+    {
+        vector3<int> lo (v.x & ~3, v.y & ~3, v.z & ~3);
+        for (auto p : make_range<vector3<int>>(lo, lo + vector3<int>(4, 4, 4)))
+        {
+            if (is_solid(p))
+                return aabb<vector3<int>>(v, v);
+        }
+        return aabb<vector3<int>>(lo, lo + vector3<int>(4, 4, 4));
+    };
+
+    std::uniform_real_distribution<double> rc (0, 96);
+    for (int i (0); i < 500; ++i)
+    {
+        vector3<double> from (rc(prng), rc(prng), rc(prng));
+        vector3<double> to (rc(prng), rc(prng), rc(prng));
+
+        vector3<int> hit1, prev1, hit2, prev2;
+        bool found1 (voxel_traverse(from, to,
+            [&](const vector3<int>& v, const vector3<int>& p,
+                aabb<vector3<int>>&)
+            {
+                hit1 = v; prev1 = p;
+                return is_solid(v);
+            }));
+
+        bool found2 (voxel_traverse(from, to,
+            [&](const vector3<int>& v, const vector3<int>& p,
+                aabb<vector3<int>>& empty)
+            {
+                hit2 = v; prev2 = p;
+                if (is_solid(v))
+                    return true;
+
+                empty = empty_cell(v);
+                return false;
+            }));
+
+        BOOST_CHECK_EQUAL(found1, found2);
+        if (found1 && found2)
+        {
+            BOOST_CHECK_EQUAL(hit1, hit2);
+            BOOST_CHECK_EQUAL(prev1, prev2);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE (occupancy_map_test)
+{
+    const uint16_t stone (1);
+
+    occupancy_map empty_map;
+    BOOST_CHECK_EQUAL(empty_map.empty_level(chunk_index(3, 4, 5)),
+                      occupancy_map::top_level);
+
+    chunk cnk;
+    cnk(5, 5, 5) = stone;
+    occupancy_map map (cnk);
+
+    BOOST_CHECK(!map.is_empty(1, chunk_index(4, 4, 4)));
+    BOOST_CHECK(map.is_empty(1, chunk_index(6, 6, 6)));
+    BOOST_CHECK(!map.is_empty(4, chunk_index(0, 0, 0)));
+    BOOST_CHECK_EQUAL(map.empty_level(chunk_index(0, 0, 0)), 2);
+    BOOST_CHECK_EQUAL(map.empty_level(chunk_index(6, 6, 6)), 1);
+    BOOST_CHECK_EQUAL(map.empty_level(chunk_index(4, 5, 4)), 0);
+    BOOST_CHECK_EQUAL(map.empty_level(chunk_index(15, 15, 15)), 3);
+
+    for (auto& b : cnk)
+        b = stone;
+
+    occupancy_map full (cnk);
+    BOOST_CHECK(!full.is_empty(4, chunk_index(7, 7, 7)));
+    BOOST_CHECK_EQUAL(full.empty_level(chunk_index(7, 7, 7)), 0);
+}
+
 BOOST_AUTO_TEST_CASE (lrucache_test)
 {
     lru_cache<int, std::string> cache;
@@ -632,6 +781,30 @@ BOOST_AUTO_TEST_CASE (concurrent_queue_test)
     BOOST_CHECK_EQUAL(q.size(), 1);
 }
 
+BOOST_AUTO_TEST_CASE (threadpool_idle_test)
+{
+    threadpool pool (1);
+    std::string order;
+
+    // Keep the only worker busy until everything has been queued.
+    std::promise<void> go;
+    auto gate (go.get_future().share());
+    auto blocker (pool.enqueue([=]{ gate.wait(); }));
+
+    std::promise<void> idle_done;
+    pool.enqueue_idle([&]{ order += 'i'; idle_done.set_value(); });
+    auto n1 (pool.enqueue([&]{ order += 'a'; }));
+    auto n2 (pool.enqueue([&]{ order += 'b'; }));
+
+    go.set_value();
+    blocker.get();
+    n1.get();
+    n2.get();
+    idle_done.get_future().get();
+
+    BOOST_CHECK_EQUAL(order, "abi");
+}
+
 BOOST_AUTO_TEST_CASE (persistent_storage_test)
 {
     boost::filesystem::path tmpdb ("storetest.leveldb");
@@ -847,6 +1020,659 @@ BOOST_AUTO_TEST_CASE (surfacedata_serialize_test)
     BOOST_CHECK_EQUAL(ret3.transparent[2047].type, 890 + 2047);
 }
 
+BOOST_AUTO_TEST_CASE (surface_index_test)
+{
+    surface test { {{{ 1, 2, 3 }, 0x05 }, 1},
+                   {{{ 0, 0, 0 }, 0x3f }, 2},
+                   {{{ 15, 15, 15 }, 0x22 }, 3} };
+
+    surface_index index (test);
+    const int none (surface_index::not_found);
+
+    BOOST_CHECK_EQUAL(index.find(chunk_index(1, 2, 3)), 0);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(0, 0, 0)), 1);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(15, 15, 15)), 2);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(3, 2, 1)), none);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(-1, 0, 0)), none);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(0, 16, 0)), none);
+
+    // Faces are numbered in the same order as the light map.
+    BOOST_CHECK_EQUAL(index.find(chunk_index(1, 2, 3), 0), 0);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(1, 2, 3), 1), none);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(1, 2, 3), 2), 1);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(0, 0, 0), 0), 2);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(0, 0, 0), 5), 7);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(15, 15, 15), 1), 8);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(15, 15, 15), 5), 9);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(15, 15, 15), 4), none);
+    BOOST_CHECK_EQUAL(index.find(chunk_index(2, 2, 2), 0), none);
+}
+
+BOOST_AUTO_TEST_CASE (surface_encoding_test)
+{
+    auto same = [](const surface& a, const surface& b) {
+        BOOST_REQUIRE_EQUAL(a.size(), b.size());
+        for (size_t i (0); i < a.size(); ++i) {
+            BOOST_CHECK_EQUAL(a[i].pos, b[i].pos);
+            BOOST_CHECK_EQUAL(a[i].dirs, b[i].dirs);
+            BOOST_CHECK_EQUAL(a[i].type, b[i].type);
+        }
+    };
+
+    BOOST_CHECK_EQUAL(morton_code(chunk_index(0, 0, 0)), 0);
+    BOOST_CHECK_EQUAL(morton_code(chunk_index(1, 0, 0)), 1);
+    BOOST_CHECK_EQUAL(morton_code(chunk_index(0, 1, 0)), 2);
+    BOOST_CHECK_EQUAL(morton_code(chunk_index(0, 0, 1)), 4);
+    BOOST_CHECK_EQUAL(morton_code(chunk_index(2, 0, 0)), 8);
+    BOOST_CHECK_EQUAL(morton_code(chunk_index(15, 15, 15)), 4095);
+
+    // A random surface in canonical order: the outside of the chunk
+    // first, then the inside.
+    std::mt19937 prng (5);
+    surface big;
+    for (int pass (0); pass < 2; ++pass) {
+        for (auto p : every_block_in_chunk) {
+            bool outside (p.x == 0 || p.y == 0 || p.z == 0 || p.x == 15
+                          || p.y == 15 || p.z == 15);
+            if (outside == (pass == 0) && prng() % 4 == 0)
+                big.emplace_back(p, prng() % 64, prng() % 1000);
+        }
+    }
+    BOOST_CHECK(is_canonical_order(big));
+
+    auto b (to_bitmask(big));
+    BOOST_CHECK_EQUAL(b.size(), big.size());
+    same(from_bitmask(b), big);
+
+    // The bitmask layout keeps the data in Morton order.
+    auto first (std::min_element(big.begin(), big.end(),
+        [](const faces& x, const faces& y) {
+            return morton_code(x.pos) < morton_code(y.pos); }));
+    BOOST_CHECK_EQUAL(b.types[0], first->type);
+
+    // The same surface, out of order.
+    surface small { {{{ 1, 2, 3 }, 0x05 }, 1},
+                    {{{ 0, 0, 0 }, 0x3f }, 2},
+                    {{{ 15, 15, 15 }, 0x22 }, 3} };
+    BOOST_CHECK(!is_canonical_order(small));
+
+    surface_data data;
+    data.version = 42;
+    data.opaque = big;
+    data.transparent = small;
+
+    auto list (encode_surface(data, surface_encoding::face_list));
+    BOOST_CHECK(list == serialize(data));
+    BOOST_CHECK(encoding_of(list) == surface_encoding::face_list);
+
+    auto mask (encode_surface(data, surface_encoding::bitmask));
+    BOOST_CHECK(encoding_of(mask) == surface_encoding::bitmask);
+    BOOST_CHECK_LT(mask.size(), list.size());
+
+    for (auto& buf : std::vector<binary_data>{ list, mask }) {
+        auto result (decode_surface(buf));
+        BOOST_CHECK_EQUAL(result.version, 42);
+        same(result.opaque, big);
+        same(result.transparent, small);
+    }
+
+    // Empty surfaces, and the empty buffer.
+    surface_data none;
+    auto buf (encode_surface(none, surface_encoding::bitmask));
+    BOOST_CHECK(decode_surface(buf).empty());
+    BOOST_CHECK(decode_surface(binary_data()).empty());
+}
+
+BOOST_AUTO_TEST_CASE (entity_snapshot_test)
+{
+    std::mt19937 prng;
+    std::uniform_real_distribution<float> offset (-150, 150);
+    std::uniform_real_distribution<float> speed (-50, 50);
+
+    const chunk_coordinates base (world_chunk_center);
+    msg::entity_update_physics plain;
+    std::vector<quantized_motion> entities;
+    for (uint32_t i (0); i < 200; ++i) {
+        wfpos p (world_center, vector(offset(prng), offset(prng),
+                                      offset(prng)));
+        p.normalize();
+        vector v (speed(prng), speed(prng), speed(prng));
+        // Every other entity is standing still.
+        if (i % 2)
+            v = vector(0, 0, 0);
+
+        plain.updates.emplace_back(i * 3 + 1000, p, v);
+        entities.push_back(quantize(i * 3 + 1000, p, v));
+    }
+    // One entity very far away from the base chunk.
+    wfpos far (world_center + world_coordinates(100000, 5, 0),
+               vector(0.25f, 0.5f, 0.75f));
+    plain.updates.emplace_back(1, far, vector(1, 2, 3));
+    entities.push_back(quantize(1, far, vector(1, 2, 3)));
+
+    auto buf (encode_snapshot(base, entities));
+    auto out (decode_snapshot(base, buf));
+    BOOST_REQUIRE_EQUAL(out.size(), entities.size());
+
+    for (auto& original : plain.updates) {
+        auto found (std::find_if(out.begin(), out.end(),
+                                 [&](const quantized_motion& m) {
+            return m.entity == original.entity_id;
+        }));
+        BOOST_REQUIRE(found != out.end());
+
+        auto p (position(*found));
+        vector error (vector(world_vector(p.pos - original.pos.pos))
+                      + p.frac - original.pos.frac);
+        BOOST_CHECK_LE(chebyshev_length(error),
+                       snapshot_position_error + 1e-5f);
+
+        vector verror (velocity(*found) - original.velocity);
+        BOOST_CHECK_LE(chebyshev_length(verror),
+                       snapshot_velocity_error + 1e-5f);
+    }
+
+    // Quantizing again gives the exact same result.
+    for (auto& m : out)
+        BOOST_CHECK(quantize(m.entity, position(m), velocity(m)) == m);
+
+    // The plain message is at least three times as big.
+    binary_data plain_buf;
+    auto ser (make_serializer(plain_buf));
+    plain.serialize(ser);
+    BOOST_CHECK_LT(buf.size() * 3, plain_buf.size());
+
+    // The message carries the sequence number the client acknowledges.
+    msg::entity_snapshot snap;
+    snap.sequence = 0x12345678;
+    snap.timestamp = 42;
+    snap.base = base;
+    snap.entities = buf;
+    binary_data snap_buf;
+    auto snap_ser (make_serializer(snap_buf));
+    snap.serialize(snap_ser);
+
+    msg::entity_snapshot snap_in;
+    auto snap_des (make_deserializer(snap_buf));
+    snap_in.serialize(snap_des);
+    BOOST_CHECK_EQUAL(snap_in.sequence, snap.sequence);
+    BOOST_CHECK(snap_in.base == base);
+    BOOST_CHECK(snap_in.entities == buf);
+
+    // Truncated snapshots are rejected.
+    buf.resize(buf.size() / 2);
+    BOOST_CHECK_THROW(decode_snapshot(base, buf), serialize_error);
+
+    std::vector<quantized_motion> none;
+    BOOST_CHECK(decode_snapshot(base, encode_snapshot(base, none)).empty());
+
+    // So are snapshots that claim more entities than they could hold.
+    binary_data huge { 0xff, 0xff, 0xff, 0xff, 0x0f, 0x00 };
+    BOOST_CHECK_THROW(decode_snapshot(base, huge), serialize_error);
+}
+
+BOOST_AUTO_TEST_CASE (send_scheduler_test)
+{
+    typedef send_scheduler<int> scheduler;
+    auto t0 (scheduler::clock::now());
+    auto ms = [&](int n) { return t0 + boost::chrono::milliseconds(n); };
+    auto msg = [](size_t size, uint8_t tag) {
+        return std::make_shared<const binary_data>(size, tag);
+    };
+
+    // 1000 bytes per second, and a burst of at most 1000 bytes.
+    scheduler s (1000, 1000);
+    BOOST_CHECK(s.empty());
+
+    s.push(1, send_priority::far_terrain, msg(600, 1), msg::reliable, t0);
+    s.push(1, send_priority::far_terrain, msg(600, 2), msg::reliable, t0);
+    s.push(1, send_priority::near_terrain, msg(600, 3), msg::reliable, t0);
+    s.push(1, send_priority::entity, msg(10, 4), msg::reliable, t0);
+    BOOST_CHECK_EQUAL(s.queued_bytes(1), 1810);
+    BOOST_CHECK_EQUAL(s.queued_bytes(2), 0);
+
+    // Highest priority first.  The budget is allowed to go below zero
+    // once, so the near terrain goes out too.
+    auto out (s.take(t0));
+    BOOST_REQUIRE_EQUAL(out.size(), 3);
+    BOOST_CHECK_EQUAL((*out[0].data)[0], 4);
+    BOOST_CHECK_EQUAL((*out[1].data)[0], 3);
+    BOOST_CHECK_EQUAL((*out[2].data)[0], 1);
+    BOOST_CHECK_EQUAL(out[2].peer, 1);
+    BOOST_CHECK(!s.empty());
+
+    // We're 210 bytes in debt, so nothing goes out for a while.
+    BOOST_CHECK(s.take(ms(100)).empty());
+
+    // Control messages are never held back.
+    s.push(1, send_priority::control, msg(5, 5), msg::reliable, ms(100));
+    out = s.take(ms(150));
+    BOOST_REQUIRE_EQUAL(out.size(), 1);
+    BOOST_CHECK_EQUAL((*out[0].data)[0], 5);
+
+    out = s.take(ms(300));
+    BOOST_REQUIRE_EQUAL(out.size(), 1);
+    BOOST_CHECK_EQUAL((*out[0].data)[0], 2);
+    BOOST_CHECK(s.empty());
+
+    // Another connection has its own budget, and the connections take
+    // turns going first.
+    s.push(2, send_priority::far_terrain, msg(10, 6), msg::reliable, ms(300));
+    s.push(1, send_priority::control, msg(10, 7), msg::reliable, ms(300));
+    out = s.take(ms(300));
+    BOOST_REQUIRE_EQUAL(out.size(), 2);
+    BOOST_CHECK_EQUAL(out[0].peer, 1);
+    BOOST_CHECK_EQUAL(out[1].peer, 2);
+
+    s.push(1, send_priority::control, msg(10, 8), msg::reliable, ms(300));
+    s.push(2, send_priority::control, msg(10, 9), msg::reliable, ms(300));
+    out = s.take(ms(300));
+    BOOST_REQUIRE_EQUAL(out.size(), 2);
+    BOOST_CHECK_EQUAL(out[0].peer, 2);
+    BOOST_CHECK_EQUAL(out[1].peer, 1);
+
+    s.push(2, send_priority::control, msg(10, 10), msg::reliable, ms(300));
+    s.remove(2);
+    BOOST_CHECK(s.empty());
+    BOOST_CHECK(s.take(ms(400)).empty());
+
+    // The same payload can go out to several connections without being
+    // copied.
+    auto shared (msg(10, 11));
+    s.push(1, send_priority::control, shared, msg::reliable, ms(400));
+    s.push(3, send_priority::control, shared, msg::reliable, ms(400));
+    BOOST_CHECK_EQUAL(s.queued_bytes(3), 10);
+    out = s.take(ms(400));
+    BOOST_REQUIRE_EQUAL(out.size(), 2);
+    BOOST_CHECK(out[0].data == out[1].data);
+    BOOST_CHECK(out[0].data == shared);
+
+    // A message about a chunk never overtakes an earlier one about the
+    // same chunk, even if it has a higher priority.
+    chunk_coordinates a (1, 2, 3), b (4, 5, 6);
+    s.push(1, send_priority::far_terrain, msg(10, 12), msg::reliable,
+           ms(2000), {a, b});
+    s.push(1, send_priority::near_terrain, msg(10, 13), msg::reliable,
+           ms(2000), {b});
+    s.push(1, send_priority::near_terrain, msg(10, 14), msg::reliable,
+           ms(2000), {chunk_coordinates(7, 8, 9)});
+    out = s.take(ms(2000));
+    BOOST_REQUIRE_EQUAL(out.size(), 3);
+    BOOST_CHECK_EQUAL((*out[0].data)[0], 14);
+    BOOST_CHECK_EQUAL((*out[1].data)[0], 12);
+    BOOST_CHECK_EQUAL((*out[2].data)[0], 13);
+
+    // Once they're gone, the chunk is free to go first again.
+    s.push(1, send_priority::far_terrain, msg(10, 15), msg::reliable,
+           ms(2000));
+    s.push(1, send_priority::near_terrain, msg(10, 16), msg::reliable,
+           ms(2000), {b});
+    out = s.take(ms(2000));
+    BOOST_REQUIRE_EQUAL(out.size(), 2);
+    BOOST_CHECK_EQUAL((*out[0].data)[0], 16);
+    BOOST_CHECK(s.empty());
+}
+
+BOOST_AUTO_TEST_CASE (sky_window_max_test)
+{
+    // A 3x2 window over a flat area, with one tall column.
+    const uint32_t w (3), h (2);
+    const uint32_t width (chunk_size - 1 + w), height (chunk_size - 1 + h);
+    std::vector<uint32_t> grid (width * height, 100);
+    grid[5 + 7 * width] = 300;
+
+    auto result (window_max(grid, w, h));
+    BOOST_CHECK_EQUAL(result.max(), 300);
+    for (uint32_t y (0); y < chunk_size; ++y) {
+        for (uint32_t x (0); x < chunk_size; ++x) {
+            bool covered (x <= 5 && x + w > 5 && y <= 7 && y + h > 7);
+            BOOST_CHECK_EQUAL(result(x, y), covered ? 300 : 100);
+        }
+    }
+
+    // An undefined column keeps its neighbours from being skipped.
+    grid[0] = undefined_height;
+    result = window_max(grid, w, h);
+    BOOST_CHECK_EQUAL(result(0, 0), undefined_height);
+    BOOST_CHECK_EQUAL(result(1, 0), 100);
+}
+
+BOOST_AUTO_TEST_CASE (tick_scheduler_test)
+{
+    auto t0 (tick_scheduler::clock::now());
+    auto ms = [&](int n) { return t0 + boost::chrono::milliseconds(n); };
+
+    tick_scheduler t (boost::chrono::milliseconds(50), 3, t0);
+    BOOST_CHECK_EQUAL(t.due(ms(0)), 1);
+    BOOST_CHECK_EQUAL(t.due(ms(10)), 0);
+    BOOST_CHECK_EQUAL(t.due(ms(49)), 0);
+    BOOST_CHECK(t.next_tick() == ms(50));
+
+    // A late tick doesn't push the ones after it back.
+    BOOST_CHECK_EQUAL(t.due(ms(70)), 1);
+    BOOST_CHECK(t.next_tick() == ms(100));
+
+    // Falling behind by two ticks: catch up on both.
+    BOOST_CHECK_EQUAL(t.due(ms(199)), 2);
+    BOOST_CHECK_EQUAL(t.skipped(), 0);
+
+    // Falling behind by five ticks: three are run, the rest are skipped,
+    // and the next one is still on the grid.
+    BOOST_CHECK_EQUAL(t.due(ms(420)), 3);
+    BOOST_CHECK_EQUAL(t.skipped(), 2);
+    BOOST_CHECK(t.next_tick() == ms(450));
+    BOOST_CHECK_EQUAL(t.ticks(), 7);
+
+    tick_profile p ("test", boost::chrono::milliseconds(1), {"a", "b"});
+    BOOST_CHECK(!p.fell_behind());
+
+    auto timer (p.start());
+    timer.lap(0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    timer.lap(1);
+    timer.finish();
+    BOOST_CHECK(p.fell_behind());
+
+    auto report (p.report(true));
+    BOOST_CHECK(report.find("test: 1 ticks, 1 over") == 0);
+    BOOST_CHECK(report.find("; b ") != std::string::npos);
+    BOOST_CHECK(!p.fell_behind());
+
+    p.add_skipped(4);
+    BOOST_CHECK(p.fell_behind());
+    BOOST_CHECK(p.report().find("4 skipped") != std::string::npos);
+    BOOST_CHECK_THROW(tick_profile("x", boost::chrono::milliseconds(1),
+                                   std::vector<std::string>(9, "x")),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE (authenticator_test)
+{
+    auto server_key (crypto::make_new_key());
+    auto player_key (crypto::make_new_key());
+    auto player_pub (crypto::get_public_key(player_key));
+
+    // Log in the same way the client does.
+    auto make_request = [&](const binary_data& uid, const std::string& name) {
+        login_request req;
+        req.msg.mode = 1;
+        req.msg.name = name;
+        req.msg.uid = uid;
+        req.msg.public_key = crypto::to_binary(player_pub);
+        req.nonce = crypto::make_random(16);
+        req.hashed_id = false;
+        req.address = 0x0100007f;
+
+        auto secret (crypto::ecdh(crypto::get_public_key(server_key),
+                                  player_key));
+        secret.resize(16);
+        req.msg.mac = crypto::sha256(crypto::concat(secret, req.nonce));
+        return req;
+    };
+
+    binary_data registered {1, 2, 3, 4, 5, 6, 7, 8};
+    binary_data unknown    {8, 7, 6, 5, 4, 3, 2, 1};
+    binary_data down       {0, 0, 0, 0, 0, 0, 0, 1};
+
+    // A stand-in for the authentication server.
+    std::vector<rest::request> calls;
+    auto fetch = [&](const rest::request& r) {
+        calls.push_back(r);
+        rest::response res;
+        if (r.url == "auth/" + base58_encode(registered)) {
+            res.status_code = 200;
+            res.json.put("users.username", "alice");
+            res.json.put_child("users.pubkey", crypto::to_json(player_pub));
+        } else if (r.url == "auth/" + base58_encode(down)) {
+            throw std::runtime_error("curl get failed: Timeout was reached");
+        } else {
+            res.status_code = 404;
+        }
+        return res;
+    };
+
+    authenticator auth (server_key, "auth/", false, 250, fetch);
+
+    auto req (make_request(registered, "bob"));
+    auto result (auth.check(req));
+    BOOST_CHECK(result.is_ok());
+    BOOST_CHECK(result.method == login_type::authenticated);
+    BOOST_CHECK_EQUAL(result.name, "alice");
+    BOOST_CHECK_EQUAL(result.uid,
+                      *reinterpret_cast<const uint64_t*>(&registered[0]));
+    BOOST_REQUIRE_EQUAL(calls.size(), 1);
+    BOOST_CHECK_EQUAL(calls[0].timeout, 250);
+
+    auto secret (crypto::ecdh(player_pub, server_key));
+    secret.resize(16);
+    BOOST_CHECK(result.key == crypto::x_or(secret, req.nonce));
+
+    BOOST_CHECK_EQUAL(auth.check(make_request(unknown, "bob")).error,
+                      "Player ID does not exist");
+    BOOST_CHECK(!auth.check(make_request(down, "bob")).is_ok());
+
+    // A MAC that doesn't match the nonce.
+    req = make_request(registered, "bob");
+    req.nonce = crypto::make_random(16);
+    BOOST_CHECK_EQUAL(auth.check(req).error, "Could not authenticate player");
+
+    // Players without an ID are not looked up.
+    calls.clear();
+    req = make_request(unknown, "");
+    req.hashed_id = true;
+    result = auth.check(req);
+    BOOST_CHECK(result.is_ok());
+    BOOST_CHECK(result.method == login_type::anonymous_guest);
+    BOOST_CHECK_EQUAL(result.name.substr(0, 5), "Guest");
+    BOOST_CHECK(calls.empty());
+
+    // Nor is anyone connecting from this machine, when running offline.
+    authenticator offline (server_key, "auth/", true, 250, fetch);
+    result = offline.check(make_request(unknown, "bob"));
+    BOOST_CHECK(result.is_ok());
+    BOOST_CHECK_EQUAL(result.name, "bob");
+    BOOST_CHECK(result.method == login_type::named_guest);
+    BOOST_CHECK(calls.empty());
+
+    // Players from elsewhere still have to be registered.
+    req = make_request(unknown, "bob");
+    req.address = 0x0101a8c0; // 192.168.1.1
+    BOOST_CHECK_EQUAL(offline.check(req).error, "Player ID does not exist");
+    BOOST_CHECK_EQUAL(calls.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE (aoi_grid_test)
+{
+    const auto c (world_center);
+    auto at = [&](int x, int y, int z) {
+        return world_coordinates(c.x + x, c.y + y, c.z + z);
+    };
+
+    aoi_grid grid (32);
+    grid.set(1, at(0, 0, 0));
+    grid.set(2, at(40, 0, 0));
+    grid.set(3, at(-100, 0, 0));
+    grid.set(4, at(0, 0, 70));
+    BOOST_CHECK_EQUAL(grid.size(), 4);
+
+    auto near = [&](const world_coordinates& p, uint32_t r) {
+        std::set<uint32_t> result;
+        grid.for_each_near(p, r, [&](uint32_t e, const world_coordinates&,
+                                     int64_t) { result.insert(e); });
+        return result;
+    };
+    BOOST_CHECK((near(at(0, 0, 0), 50) == std::set<uint32_t>{1, 2}));
+    BOOST_CHECK((near(at(0, 0, 0), 100) == std::set<uint32_t>{1, 2, 3, 4}));
+    BOOST_CHECK((near(at(-90, 0, 0), 10) == std::set<uint32_t>{3}));
+
+    // Moving to another cell, and removing.
+    grid.set(2, at(-95, 0, 0));
+    BOOST_CHECK((near(at(-90, 0, 0), 10) == std::set<uint32_t>{2, 3}));
+    grid.remove(3);
+    BOOST_CHECK((near(at(-90, 0, 0), 10) == std::set<uint32_t>{2}));
+    world_coordinates pos;
+    BOOST_CHECK(!grid.find(3, pos));
+    BOOST_REQUIRE(grid.find(2, pos));
+    BOOST_CHECK_EQUAL(pos, at(-95, 0, 0));
+
+    // Entities enter within the radius, and leave beyond the margin.
+    aoi_subscription sub;
+    std::vector<uint32_t> entered, left;
+    auto update = [&](const world_coordinates& p) {
+        entered.clear();
+        left.clear();
+        sub.update(grid, p, 50, 10,
+                   [&](uint32_t e) { entered.push_back(e); },
+                   [&](uint32_t e) { left.push_back(e); });
+        std::sort(entered.begin(), entered.end());
+    };
+
+    update(at(0, 0, 0));
+    BOOST_CHECK((entered == std::vector<uint32_t>{1}));
+    BOOST_CHECK(left.empty());
+
+    update(at(0, 0, 25));
+    BOOST_CHECK((entered == std::vector<uint32_t>{4}));
+    BOOST_CHECK(left.empty());
+
+    // Entity 1 is now 55 blocks away; still inside the margin.
+    update(at(0, 0, 55));
+    BOOST_CHECK(entered.empty());
+    BOOST_CHECK(left.empty());
+
+    update(at(0, 0, 65));
+    BOOST_CHECK((left == std::vector<uint32_t>{1}));
+    BOOST_CHECK(sub.contains(4));
+    BOOST_CHECK(!sub.contains(1));
+
+    grid.remove(4);
+    update(at(0, 0, 65));
+    BOOST_CHECK((left == std::vector<uint32_t>{4}));
+    BOOST_CHECK(sub.entities().empty());
+}
+
+BOOST_AUTO_TEST_CASE (chunk_request_queue_test)
+{
+    const auto c (world_chunk_center);
+    auto at = [&](int x, int y, int z) {
+        return chunk_coordinates(c.x + x, c.y + y, c.z + z);
+    };
+    chunk_request_queue::request next;
+
+    chunk_request_queue q (10);
+    BOOST_CHECK(q.empty());
+    BOOST_CHECK(!q.pop(next));
+
+    // Without a view, requests come out in the order they were made.
+    q.push(at(3, 0, 0), 1);
+    q.push(at(1, 0, 0), 2);
+    q.push(at(3, 0, 0), 3);
+    BOOST_CHECK_EQUAL(q.size(), 2);
+    BOOST_REQUIRE(q.pop(next));
+    BOOST_CHECK_EQUAL(next.position, at(3, 0, 0));
+    BOOST_CHECK_EQUAL(next.version, 3);
+    BOOST_REQUIRE(q.pop(next));
+    BOOST_CHECK_EQUAL(next.position, at(1, 0, 0));
+    BOOST_CHECK(q.empty());
+
+    // The player stands in the middle of the center chunk, looking
+    // along the y axis.
+    const float half_pi (1.5707963f);
+    wfpos player (c * chunk_size + world_vector(8, 8, 8), vector(0, 0, 0));
+    q.set_view(player, yaw_pitch(0, half_pi));
+
+    q.push(at(0, -2, 0), 0);
+    q.push(at(0, 3, 0), 0);
+    q.push(at(0, 0, 0), 0);
+    q.push(at(2, 0, 0), 0);
+    q.push(at(0, 20, 0), 0);
+    BOOST_CHECK(q.cost(at(0, 2, 0)) < q.cost(at(2, 0, 0)));
+    BOOST_CHECK(q.cost(at(2, 0, 0)) < q.cost(at(0, -2, 0)));
+
+    std::vector<chunk_coordinates> order;
+    while (q.pop(next))
+        order.push_back(next.position);
+
+    // The chunk that is out of range has been dropped.
+    BOOST_REQUIRE_EQUAL(order.size(), 4);
+    BOOST_CHECK_EQUAL(order[0], at(0, 0, 0));
+    BOOST_CHECK_EQUAL(order[1], at(2, 0, 0));
+    BOOST_CHECK_EQUAL(order[2], at(0, 3, 0));
+    BOOST_CHECK_EQUAL(order[3], at(0, -2, 0));
+    BOOST_CHECK(q.empty());
+
+    // Turning around changes the order.
+    q.push(at(0, -2, 0), 0);
+    q.push(at(0, 2, 0), 0);
+    BOOST_REQUIRE(q.pop(next));
+    BOOST_CHECK_EQUAL(next.position, at(0, 2, 0));
+    q.push(at(0, 2, 0), 0);
+    q.set_view(player, yaw_pitch(2 * half_pi, half_pi));
+    BOOST_REQUIRE(q.pop(next));
+    BOOST_CHECK_EQUAL(next.position, at(0, -2, 0));
+
+    // And so does moving.
+    q.push(at(0, -2, 0), 0);
+    q.set_view(wfpos(at(0, 5, 0) * chunk_size, vector(0, 0, 0)),
+               yaw_pitch(2 * half_pi, half_pi));
+    BOOST_REQUIRE(q.pop(next));
+    BOOST_CHECK_EQUAL(next.position, at(0, 2, 0));
+
+    // Once sorted, new requests are put in their place right away.
+    q.push(at(0, 0, 0), 0);
+    q.push(at(0, 4, 0), 0);
+    q.push(at(0, 30, 0), 0);
+    q.push(at(0, 5, 0), 0);
+    BOOST_CHECK_EQUAL(q.size(), 4);
+
+    order.clear();
+    while (q.pop(next))
+        order.push_back(next.position);
+
+    BOOST_REQUIRE_EQUAL(order.size(), 4);
+    BOOST_CHECK_EQUAL(order[0], at(0, 4, 0));
+    BOOST_CHECK_EQUAL(order[1], at(0, 5, 0));
+    BOOST_CHECK_EQUAL(order[2], at(0, 0, 0));
+    BOOST_CHECK_EQUAL(order[3], at(0, -2, 0));
+}
+
+BOOST_AUTO_TEST_CASE (bot_stats_test)
+{
+    latency_stats empty;
+    BOOST_CHECK_EQUAL(empty.count(), 0);
+    BOOST_CHECK_EQUAL(empty.percentile(0.5), 0);
+    BOOST_CHECK_EQUAL(empty.max(), 0);
+
+    latency_stats a;
+    for (int i (100); i > 0; --i)
+        a.add(i);
+
+    BOOST_CHECK_EQUAL(a.count(), 100);
+    BOOST_CHECK_CLOSE(a.mean(), 50.5, 0.001);
+    BOOST_CHECK_EQUAL(a.max(), 100);
+    BOOST_CHECK_EQUAL(a.percentile(0), 1);
+    BOOST_CHECK_EQUAL(a.percentile(0.5), 51);
+    BOOST_CHECK_EQUAL(a.percentile(0.95), 96);
+    BOOST_CHECK_EQUAL(a.percentile(1), 100);
+
+    bot_stats x, y;
+    x.bytes_received = 1000;
+    x.surfaces_received = 3;
+    x.ping.add(10);
+    y.bytes_received = 24;
+    y.terrain_timeouts = 1;
+    y.ping.add(30);
+    y.terrain.add(200);
+
+    x.merge(y);
+    BOOST_CHECK_EQUAL(x.bytes_received, 1024);
+    BOOST_CHECK_EQUAL(x.surfaces_received, 3);
+    BOOST_CHECK_EQUAL(x.terrain_timeouts, 1);
+    BOOST_CHECK_EQUAL(x.ping.count(), 2);
+    BOOST_CHECK_EQUAL(x.ping.max(), 30);
+    BOOST_CHECK_EQUAL(x.terrain.count(), 1);
+}
+
 BOOST_AUTO_TEST_CASE (protocol_test)
 {
     std::vector<uint8_t> buf;
@@ -892,6 +1718,33 @@ BOOST_AUTO_TEST_CASE (protocol_test)
     upds2.serialize(arch4);
 
     BOOST_CHECK(upds.terrain == upds2.terrain);
+
+    //----------------------------------------------------------------------
+
+    msg::surface_batch batch;
+    for (uint32_t i (0); i < 3; ++i) {
+        msg::surface_batch::record rec;
+        rec.position = world_chunk_center + chunk_coordinates(i, 0, 0);
+        rec.terrain = upds.terrain;
+        rec.light = compress(binary_data(i + 1, 0x80));
+        batch.surfaces.emplace_back(std::move(rec));
+    }
+
+    buf.clear();
+    auto p5 (make_serializer(buf));
+    batch.serialize(p5);
+
+    auto arch5 (make_deserializer(buf));
+    msg::surface_batch batch2;
+    batch2.serialize(arch5);
+
+    BOOST_REQUIRE_EQUAL(batch2.surfaces.size(), 3);
+    for (size_t i (0); i < 3; ++i) {
+        BOOST_CHECK_EQUAL(batch2.surfaces[i].position,
+                          batch.surfaces[i].position);
+        BOOST_CHECK(batch2.surfaces[i].terrain == upds.terrain);
+        BOOST_CHECK(batch2.surfaces[i].light == batch.surfaces[i].light);
+    }
 }
 
 BOOST_AUTO_TEST_CASE (protocol2_test)
@@ -967,6 +1820,69 @@ BOOST_AUTO_TEST_CASE (raybundle_test)
 }
 
 
+BOOST_AUTO_TEST_CASE (raybundle_cache_test)
+{
+    ray_bundle tree { { {0,0,1}, {0,0,2}, {0,1,3} }, 1.0f };
+    tree.add({{0,0,1}, {1,0,2}, {2,0,3}}, 0.5f);
+    tree.add({{0,0,1}, {0,0,2}, {0,0,3}, {0,0,4}}, 0.25f);
+    tree.normalize_weight();
+
+    std::vector<flat_ray_set> levels (2);
+    for (int d (0); d < 6; ++d)
+    {
+        levels[0][d] = flat_ray_bundle(tree);
+        levels[1][d] = flat_ray_bundle(ray_bundle({{0,0,d}}, 1.0f));
+    }
+
+    auto file (boost::filesystem::temp_directory_path()
+               / boost::filesystem::unique_path("raycache-%%%%-%%%%.test"));
+
+    std::vector<flat_ray_set> loaded;
+    BOOST_CHECK(!load_ray_bundles(file, "test 1", loaded));
+
+    store_ray_bundles(file, "test 1", levels);
+    BOOST_CHECK(!load_ray_bundles(file, "test 2", loaded));
+    BOOST_REQUIRE(load_ray_bundles(file, "test 1", loaded));
+    BOOST_REQUIRE_EQUAL(loaded.size(), 2);
+
+    auto opacity = [](const world_coordinates& p, bool)
+    {
+        return p.x == 1 ? 0.5f : 0.0f;
+    };
+    for (int i (0); i < 2; ++i)
+    {
+        for (int d (0); d < 6; ++d)
+        {
+            auto& a (levels[i][d]);
+            auto& b (loaded[i][d]);
+            BOOST_CHECK(serialize(a) == serialize(b));
+            BOOST_CHECK(a.reach() == b.reach());
+            BOOST_CHECK_EQUAL(a.cast(world_coordinates(0,0,0), 100, opacity),
+                              b.cast(world_coordinates(0,0,0), 100, opacity));
+            BOOST_CHECK(b.is_valid());
+        }
+    }
+
+    // A bundle with a broken index is not accepted.
+    auto data (serialize(levels[0][0]));
+    auto skip (data.begin() + 8 + 12);
+    std::fill(skip, skip + 4, 0);
+    flat_ray_bundle broken;
+    auto ar (make_deserializer(data));
+    ar(broken);
+    BOOST_CHECK(!broken.is_valid());
+
+    // Neither is a bundle whose steps leave its reach.
+    data = serialize(levels[0][0]);
+    data[data.size() - 1] = 0;
+    flat_ray_bundle too_far;
+    auto ar2 (make_deserializer(data));
+    ar2(too_far);
+    BOOST_CHECK(!too_far.is_valid());
+
+    boost::filesystem::remove(file);
+}
+
 BOOST_AUTO_TEST_CASE (quaternion_test)
 {
     // Unit tests after Rosetta Code
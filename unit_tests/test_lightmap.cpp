@@ -0,0 +1,316 @@
+//---------------------------------------------------------------------------
+/// \file   hexa/unit_tests/test_lightmap.cpp
+/// \brief  Unit tests and benchmarks for the light map generators
+//
+// This file is part of Hexahedra.
+//
+// Hexahedra is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// Copyright 2014, nocte@hippie.nu
+//---------------------------------------------------------------------------
+
+#include <boost/test/unit_test.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <hexa/basic_types.hpp>
+#include <hexa/ray_batch.hpp>
+#include <hexa/ray_bundle.hpp>
+#include <hexa/voxel_algorithm.hpp>
+
+using namespace hexa;
+
+namespace
+{
+
+int hill(int x, int y)
+{
+    return std::sin(x * 0.11f) * 6.f + std::cos(y * 0.07f) * 9.f;
+}
+
+// A fixed test world: rolling hills, with a sprinkling of semi-transparent
+// blocks floating above them.  It repeats every 64 blocks in all
+// directions, so it stays in the cache and the benchmark measures the ray
+// traversal rather than the world lookups.
+std::vector<float> world_opacity;
+
+void init_world()
+{
+    if (!world_opacity.empty())
+        return;
+
+    std::mt19937 prng(42);
+    world_opacity.resize(64 * 64 * 64);
+    for (int y(0); y < 64; ++y) {
+        for (int x(0); x < 64; ++x) {
+            int height(hill(x, y));
+            for (int z(-32); z < 32; ++z) {
+                float o(0.0f);
+                if (z < height)
+                    o = 1.0f;
+                else if (z < height + 12 && prng() % 11 == 0)
+                    o = 0.4f;
+
+                world_opacity[x + y * 64 + (z & 63) * 4096] = o;
+            }
+        }
+    }
+}
+
+size_t lookups(0);
+
+float test_opacity(const world_coordinates& p)
+{
+    ++lookups;
+    return world_opacity[(p.x & 63) + (p.y & 63) * 64 + (p.z & 63) * 4096];
+}
+
+// The original recursive tree walk, as a reference.
+float recurse(const ray_bundle& r, float ray_power,
+              const world_coordinates& blk, bool first = true)
+{
+    float temp(0.0f);
+    bool should_recurse(true);
+    for (auto& voxel : r.trunk) {
+        if (first) {
+            first = false;
+            continue;
+        }
+        temp += test_opacity(blk + voxel);
+        if (temp >= 1.0f) {
+            should_recurse = false;
+            break;
+        }
+    }
+
+    ray_power -= std::min(temp, 1.0f) * r.weight;
+    if (ray_power <= 0.01)
+        return 0.0;
+
+    if (should_recurse) {
+        for (auto& s : r.branches)
+            ray_power = recurse(s, ray_power, blk, first);
+    }
+    return ray_power;
+}
+
+// A bundle similar to what sun_lightmap uses for its highest detail level.
+ray_bundle sun_bundle()
+{
+    ray_bundle result;
+    vector origin(0.5f, 0.5f, 1.1f);
+    for (int i(0); i < 13; ++i) {
+        float a(i * 0.483f), r(i == 0 ? 0.f : 0.05f);
+        vector dir(from_spherical(-0.4f + std::sin(a) * r,
+                                  0.75f + std::cos(a) * r));
+        result.add(voxel_raycast(origin, origin + dir * 200.f), dir.z);
+    }
+    result.normalize_weight();
+    return result;
+}
+
+// A bundle similar to ambient_occlusion_lightmap's highest detail level.
+ray_bundle ao_bundle()
+{
+    ray_bundle result;
+    vector origin(0.5f, 0.5f, 1.3f);
+    for (int k(0); k < 100; ++k) {
+        float z((k + 0.5f) / 100.f);
+        float r(std::sqrt(1.0f - z * z)), th(k * 2.39996f);
+        vector dir(std::cos(th) * r, std::sin(th) * r, z);
+        result.add(voxel_raycast(origin, origin + dir * 60.f), z);
+    }
+    result.normalize_weight();
+    return result;
+}
+
+std::vector<world_coordinates> test_faces()
+{
+    std::vector<world_coordinates> result;
+    for (int y(-32); y < 32; ++y) {
+        for (int x(-32); x < 32; ++x) {
+            world_vector face(x, y, hill(x & 63, y & 63) - 1);
+            result.emplace_back(world_center + face);
+        }
+    }
+    return result;
+}
+
+void compare(const ray_bundle& tree, const std::string& name)
+{
+    init_world();
+    flat_ray_bundle flat(tree);
+    auto faces(test_faces());
+    auto op = [](const world_coordinates& p, bool first) {
+        return first ? 0.0f : test_opacity(p);
+    };
+
+    typedef std::chrono::high_resolution_clock clock;
+
+    std::vector<float> expected, result;
+    lookups = 0;
+    auto start(clock::now());
+    for (int i(0); i < 4; ++i) {
+        expected.clear();
+        for (auto& f : faces)
+            expected.push_back(recurse(tree, tree.weight, f));
+    }
+    auto middle(clock::now());
+    size_t tree_lookups(lookups);
+    lookups = 0;
+    for (int i(0); i < 4; ++i) {
+        result.clear();
+        for (auto& f : faces)
+            result.push_back(flat.cast(f, undefined_height, op));
+    }
+    auto stop(clock::now());
+
+    BOOST_CHECK(expected == result);
+
+    typedef std::chrono::duration<double, std::nano> ns;
+    double count(faces.size() * 4);
+    BOOST_TEST_MESSAGE(name << ": tree " << ns(middle - start).count() / count
+                            << " ns/face, " << tree_lookups / count
+                            << " voxels/face; flat "
+                            << ns(stop - middle).count() / count
+                            << " ns/face, " << lookups / count
+                            << " voxels/face");
+}
+
+// Cast a bundle from a grid of faces, both with ray_batch and with the
+// scalar flat_ray_bundle::cast(), and check that they agree.
+void compare_batch(const ray_bundle& tree, uint32_t sky_offset)
+{
+    init_world();
+    flat_ray_bundle flat(tree);
+    auto faces(test_faces());
+    faces.resize(16 * 64 + 13); // Make sure the last batch is a partial one.
+
+    // Copy the test world into a linear volume that covers everything the
+    // rays can reach.  The three opacities in the test world get a
+    // material each.
+    aabb<world_coordinates> box(faces.front());
+    for (auto& f : faces)
+        box = box + aabb<world_coordinates>(f);
+
+    world_coordinates origin(box.first + flat.reach().first);
+    world_vector size(box.second + flat.reach().second - origin);
+    size_t stride_y(size.x), stride_z(size.x * size.y);
+    size_t volume(stride_z * size.z);
+    const uint8_t opacity[] = {0, 255, 102};
+    std::vector<uint16_t> types(volume), mask((volume + 15) / 16);
+    for (int z(0); z < size.z; ++z) {
+        for (int y(0); y < size.y; ++y) {
+            for (int x(0); x < size.x; ++x) {
+                auto o(test_opacity(origin + world_vector(x, y, z)));
+                size_t i(x + y * stride_y + z * stride_z);
+                types[i] = o == 0.0f ? 0 : o == 1.0f ? 1 : 2;
+                if (types[i] != 0)
+                    mask[i >> 4] |= 1 << (i & 15);
+            }
+        }
+    }
+
+    auto index = [&](const world_coordinates& p) {
+        world_vector d(p - origin);
+        return int32_t(d.x + d.y * stride_y + d.z * stride_z);
+    };
+    // The first voxel only counts half.
+    auto op = [&](const world_coordinates& p, bool first) {
+        float o(opacity[types[index(p)]] * (1.0f / 255.0f));
+        return first ? o * 0.5f : o;
+    };
+
+    uint32_t sky(sky_offset == undefined_height ? undefined_height
+                                                : world_center.z + sky_offset);
+
+    ray_batch batch(flat, stride_y, stride_z);
+    const ray_batch::volume vol{mask.data(), types.data(), opacity};
+    size_t mismatches(0);
+    for (size_t i(0); i < faces.size(); i += ray_batch::width) {
+        int count(std::min<size_t>(ray_batch::width, faces.size() - i));
+        int32_t idx[ray_batch::width];
+        uint32_t z[ray_batch::width];
+        float first[ray_batch::width], result[ray_batch::width];
+        for (int l(0); l < count; ++l) {
+            auto& f(faces[i + l]);
+            idx[l] = index(f);
+            z[l] = f.z;
+            first[l] = op(f + batch.first_voxel(), true);
+        }
+        batch.cast(vol, idx, z, sky, first, count, result);
+
+        for (int l(0); l < count; ++l) {
+            if (result[l] != flat.cast(faces[i + l], sky, op))
+                ++mismatches;
+        }
+    }
+    BOOST_CHECK_EQUAL(mismatches, 0);
+}
+
+} // anonymous namespace
+
+BOOST_AUTO_TEST_SUITE(lightmap)
+
+BOOST_AUTO_TEST_CASE(flat_ray_bundle_test)
+{
+    ray_bundle tree{{{0, 0, 1}, {1, 0, 1}, {1, 0, 2}}, 1.0f};
+    tree.add({{0, 0, 1}, {0, 0, 2}}, 0.5f);
+    tree.add({{0, 0, 1}, {1, 0, 1}, {2, 0, 1}}, 0.5f);
+
+    flat_ray_bundle flat(tree);
+    BOOST_CHECK_EQUAL(flat.weight(), 2.0f);
+    BOOST_CHECK_EQUAL(flat.nodes().size(), 5);
+    BOOST_CHECK_EQUAL(flat.steps().size(), 5);
+    BOOST_CHECK_EQUAL(flat.nodes()[0].skip, 5);
+    BOOST_CHECK_EQUAL(flat.nodes()[1].skip, 4);
+    BOOST_CHECK_EQUAL(flat.nodes()[4].skip, 5);
+    BOOST_CHECK(flat.nodes()[0].first_voxel);
+    BOOST_CHECK(!flat.nodes()[1].first_voxel);
+    BOOST_CHECK_EQUAL(flat.reach().first, world_vector(0, 0, 0));
+    BOOST_CHECK_EQUAL(flat.reach().second, world_vector(3, 1, 3));
+
+    // A wall in the second voxel blocks the first branch.
+    auto wall = [](const world_coordinates& p, bool) {
+        return p == world_center + world_vector(1, 0, 1) ? 1.0f : 0.0f;
+    };
+    BOOST_CHECK_EQUAL(flat.cast(world_center, undefined_height, wall), 0.5f);
+
+    // Anything at or above the sky height is ignored.
+    auto solid = [](const world_coordinates&, bool) { return 1.0f; };
+    BOOST_CHECK_EQUAL(flat.cast(world_center, world_center.z + 2, solid),
+                      0.0f);
+    BOOST_CHECK_EQUAL(flat.cast(world_center, world_center.z + 1, solid),
+                      2.0f);
+}
+
+BOOST_AUTO_TEST_CASE(ray_batch_test)
+{
+    compare_batch(sun_bundle(), undefined_height);
+    compare_batch(sun_bundle(), 4);
+    compare_batch(ao_bundle(), undefined_height);
+    compare_batch(ao_bundle(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(flat_ray_bundle_benchmark)
+{
+    compare(sun_bundle(), "sun");
+    compare(ao_bundle(), "ambient occlusion");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -104,14 +104,62 @@ void check_chunk_index(const chunk_index pos)
     BOOST_CHECK(pos.z < chunk_size);
 }
 
+// Gives the unit tests access to world_subsection_read::add().
+struct test_subsection : public world_subsection_read
+{
+    using world_subsection_read::add;
+};
+
+// The straightforward way of finding the surface of a chunk, one block
+// and one neighbor at a time.  The blocks on the outside of the chunk
+// are listed first.
+surface reference_surface(const world_subsection_read& terrain,
+                          bool transparent)
+{
+    surface shell, core;
+    for (chunk_index i : every_block_in_chunk) {
+        uint16_t type(terrain[i].type);
+        if (type == type::air)
+            continue;
+
+        uint8_t dirs(0);
+        if (type::is_custom_block(type)) {
+            if (transparent)
+                continue;
+            dirs = 0x3f;
+        } else if (type::is_transparent(type) != transparent) {
+            continue;
+        } else {
+            for (int d(0); d < 6; ++d) {
+                uint16_t other(terrain[i + dir_vector[d]].type);
+                if (type::is_visually_solid(other))
+                    continue;
+                if (transparent
+                    && (type == other
+                        || material_prop[type].textures[d]
+                           == material_prop[other].textures[d ^ 1]))
+                    continue;
+
+                dirs |= 1 << d;
+            }
+        }
+        if (dirs == 0)
+            continue;
+
+        bool edge(i.x == 0 || i.y == 0 || i.z == 0 || i.x == chunk_size - 1
+                  || i.y == chunk_size - 1 || i.z == chunk_size - 1);
+        (edge ? shell : core).emplace_back(i, dirs, type);
+    }
+    shell.insert(shell.end(), core.begin(), core.end());
+    return shell;
+}
+
 //---------------------------------------------------------------------------
 
 BOOST_FIXTURE_TEST_SUITE(terrain, fixture)
 
 BOOST_AUTO_TEST_CASE(setup_tests)
 {
-    init_surface_extraction();
-
     register_new_material(1).name = "one";
     register_new_material(2).name = "two";
     register_new_material(3).name = "three";
@@ -264,6 +312,64 @@ BOOST_AUTO_TEST_CASE(surface_test_2)
     }
 }
 
+BOOST_AUTO_TEST_CASE(surface_bitmask_test)
+{
+    // Solid, glass, water, an unregistered type, and a custom block.
+    material glass;
+    glass.transparency = 200;
+    boost::range::fill(glass.textures, 7);
+    register_new_material(11, glass);
+
+    material water;
+    water.transparency = 100;
+    boost::range::fill(water.textures, 8);
+    water.textures[4] = 9;
+    register_new_material(12, water);
+
+    material fence;
+    fence.model.resize(1);
+    register_new_material(13, fence);
+
+    register_new_material(10);
+    BOOST_CHECK(material_tables_match(12));
+    BOOST_CHECK(type::is_transparent(12));
+    BOOST_CHECK(!type::is_plain_cube(13));
+
+    const uint16_t types[] = {0, 0, 0, 10, 10, 11, 12, 13, 14};
+    std::mt19937 prng(7);
+    std::uniform_int_distribution<int> pick(0, 8);
+
+    for (int round(0); round < 4; ++round) {
+        std::vector<chunk> chunks(7);
+        test_subsection terrain;
+        for (int i(0); i < 7; ++i) {
+            for (auto& b : chunks[i])
+                b = types[round == 0 ? 3 : pick(prng)];
+
+            terrain.add(neumann_neighborhood[i], chunks[i]);
+        }
+
+        auto opaque(extract_opaque_surface(terrain));
+        auto expected(reference_surface(terrain, false));
+        BOOST_CHECK(is_canonical_order(opaque));
+        BOOST_REQUIRE_EQUAL(opaque.size(), expected.size());
+        for (size_t i(0); i < opaque.size(); ++i) {
+            BOOST_CHECK_EQUAL(opaque[i].pos, expected[i].pos);
+            BOOST_CHECK_EQUAL(opaque[i].dirs, expected[i].dirs);
+            BOOST_CHECK_EQUAL(opaque[i].type, expected[i].type);
+        }
+
+        auto trans(extract_transparent_surface(terrain));
+        expected = reference_surface(terrain, true);
+        BOOST_REQUIRE_EQUAL(trans.size(), expected.size());
+        for (size_t i(0); i < trans.size(); ++i) {
+            BOOST_CHECK_EQUAL(trans[i].pos, expected[i].pos);
+            BOOST_CHECK_EQUAL(trans[i].dirs, expected[i].dirs);
+            BOOST_CHECK_EQUAL(trans[i].type, expected[i].type);
+        }
+    }
+}
+
 //---------------------------------------------------------------------------
 
 BOOST_AUTO_TEST_CASE(hndl_1_test)